@@ -0,0 +1,330 @@
+#include "lla.h"
+#include <time.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Latency benchmark behind `make bench`. Every workload runs against a fresh lla and prints one
+// JSON object per line and operation kind, so successive runs can be diffed or loaded as they are:
+//   ./lla_bench [ops] [seed] [workload]
+// Latencies go into log-linear histograms in the style of HdrHistogram: 64 linear sub-buckets per
+// power of two keep every reported percentile within 1.6% of the measured value.
+
+#ifndef BENCH_KEY
+#define BENCH_KEY(v) ((lla_key)(v)) // key of the integer v, override along with LLA_KEY_TYPE
+#endif
+
+#define BENCH_N 1024
+#define BENCH_C 8
+#define BENCH_TAU_0 0.5
+#define BENCH_TAU_D 0.75
+#define BENCH_KEY_SPACE (1 << 30)
+#define BENCH_SCAN_KEYS 100 // keys covered by one scan of the mixed workload
+#define ZIPF_RANKS (1 << 20)
+#define ZIPF_S 0.99
+#define HOT_SPOT_KEYS 64 // hammer: every insert lands among this many keys
+
+#define HIST_SUB_BITS 6
+#define HIST_BUCKETS (64 << HIST_SUB_BITS)
+
+// ################# BEGIN HISTOGRAM FUNCTIONS ###################
+typedef struct histogram
+{
+    uint64_t counts[HIST_BUCKETS];
+    uint64_t total;
+    uint64_t max;
+} histogram;
+
+// Values below 2^(HIST_SUB_BITS+1) get a bucket each. Above, a value keeps its top
+// HIST_SUB_BITS + 1 bits: index = (shift << HIST_SUB_BITS) + (v >> shift).
+static int hist_index(uint64_t v)
+{
+    int msb = v ? 63 - __builtin_clzll(v) : 0;
+    int shift = msb > HIST_SUB_BITS ? msb - HIST_SUB_BITS : 0;
+    return (shift << HIST_SUB_BITS) + (int)(v >> shift);
+}
+
+// Largest value that lands in bucket i
+static uint64_t hist_value(int i)
+{
+    if (i < (2 << HIST_SUB_BITS))
+    {
+        return i;
+    }
+    int shift = (i >> HIST_SUB_BITS) - 1;
+    uint64_t sub = i - ((uint64_t)shift << HIST_SUB_BITS);
+    return ((sub + 1) << shift) - 1;
+}
+
+void hist_record(histogram *h, uint64_t v)
+{
+    h->counts[hist_index(v)]++;
+    h->total++;
+    if (v > h->max)
+    {
+        h->max = v;
+    }
+}
+
+// Smallest recorded value that at least fraction q of the samples do not exceed
+uint64_t hist_percentile(const histogram *h, double q)
+{
+    uint64_t rank = (uint64_t)ceil(q * h->total);
+    uint64_t seen = 0;
+
+    if (rank == 0)
+    {
+        rank = 1;
+    }
+    for (int i = 0; i < HIST_BUCKETS; i++)
+    {
+        seen += h->counts[i];
+        if (seen >= rank)
+        {
+            uint64_t v = hist_value(i);
+            return v < h->max ? v : h->max;
+        }
+    }
+    return h->max;
+}
+// ################# EOF HISTOGRAM FUNCTIONS ###################
+
+// ################# BEGIN WORKLOAD FUNCTIONS ###################
+typedef enum
+{
+    OP_INSERT,
+    OP_FIND,
+    OP_SCAN,
+    OP_KINDS
+} op_kind;
+
+static const char *op_names[OP_KINDS] = {"insert", "find", "scan"};
+
+typedef struct workload
+{
+    const char *name;
+    int preload;   // inserts before timing starts, as a fraction of ops in percent
+    int find_pct;  // share of lookups among the timed operations
+    int scan_pct;  // share of range scans
+    long long (*next_key)(long long i, long long ops);
+} workload;
+
+static uint64_t rng_state;
+
+static uint64_t next_random(void)
+{
+    // xorshift64*, cheap enough not to show up in the latencies
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return rng_state * 0x2545F4914F6CDD1DULL;
+}
+
+static double *zipf_cdf;
+
+// Zipf ranks by inverse transform over a precomputed CDF. Ranks are scattered over the key space
+// by a multiplicative hash, so the hot keys do not sit next to each other.
+static void zipf_init(void)
+{
+    zipf_cdf = (double *)malloc(sizeof(double) * ZIPF_RANKS);
+    if (!zipf_cdf)
+    {
+        printf("Malloc failed\n");
+        exit(1);
+    }
+
+    double sum = 0;
+    for (int r = 0; r < ZIPF_RANKS; r++)
+    {
+        sum += 1.0 / pow(r + 1, ZIPF_S);
+        zipf_cdf[r] = sum;
+    }
+    for (int r = 0; r < ZIPF_RANKS; r++)
+    {
+        zipf_cdf[r] /= sum;
+    }
+}
+
+static long long uniform_key(long long i, long long ops)
+{
+    (void)i;
+    (void)ops;
+    return (long long)(next_random() % BENCH_KEY_SPACE);
+}
+
+static long long zipf_key(long long i, long long ops)
+{
+    (void)i;
+    (void)ops;
+    double u = (next_random() >> 11) * (1.0 / 9007199254740992.0);
+    int lo = 0, hi = ZIPF_RANKS - 1;
+    while (lo < hi)
+    {
+        int mid = lo + (hi - lo) / 2;
+        if (zipf_cdf[mid] < u)
+        {
+            lo = mid + 1;
+        }
+        else
+        {
+            hi = mid;
+        }
+    }
+    return (long long)(((uint64_t)lo * 2654435761ULL) % BENCH_KEY_SPACE);
+}
+
+static long long sequential_key(long long i, long long ops)
+{
+    (void)ops;
+    return i;
+}
+
+static long long reverse_key(long long i, long long ops)
+{
+    return 2 * ops - i;
+}
+
+// Uniform while preloading, then every insert goes to the same small spot in the middle
+static long long hammer_key(long long i, long long ops)
+{
+    if (i < 0)
+    {
+        return uniform_key(i, ops);
+    }
+    return BENCH_KEY_SPACE / 2 + (long long)(next_random() % HOT_SPOT_KEYS);
+}
+
+static workload workloads[] = {
+    {"uniform", 0, 0, 0, uniform_key},
+    {"zipf", 0, 0, 0, zipf_key},
+    {"sequential", 0, 0, 0, sequential_key},
+    {"reverse", 0, 0, 0, reverse_key},
+    {"hammer", 50, 0, 0, hammer_key},
+    {"mixed", 50, 40, 10, uniform_key},
+};
+
+static double now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void count_scanned(void *ctx, const lla_key *keys, size_t count)
+{
+    (void)keys;
+    *(size_t *)ctx += count;
+}
+
+static histogram hists[OP_KINDS];
+
+void run_workload(const workload *w, long long ops, uint64_t seed)
+{
+    lla *bench_lla = create_lla(BENCH_N, BENCH_C, BENCH_TAU_0, BENCH_TAU_D);
+    lla_key scan_buf[BENCH_SCAN_KEYS];
+    long long preload = ops * w->preload / 100;
+    long long *inserted = (long long *)malloc(sizeof(long long) * (preload + ops)); // lookups pick from these
+    long long inserted_count = 0;
+    size_t scanned = 0;
+    long long counts[OP_KINDS] = {0};
+    double elapsed[OP_KINDS] = {0};
+
+    if (!inserted)
+    {
+        printf("Malloc failed\n");
+        exit(1);
+    }
+    rng_state = seed ? seed : 1;
+    memset(hists, 0, sizeof(hists));
+
+    // Preloaded keys come from the generator with negative indices, outside the timed sequence
+    for (long long i = -preload; i < 0; i++)
+    {
+        inserted[inserted_count] = w->next_key(i, ops);
+        insert(bench_lla, BENCH_KEY(inserted[inserted_count++]));
+    }
+    long long moved_before = bench_lla->moved;
+
+    // Key range that holds about BENCH_SCAN_KEYS keys once the run is over
+    long long scan_span = (long long)BENCH_KEY_SPACE / (ops + preload) * BENCH_SCAN_KEYS;
+    if (scan_span > BENCH_KEY_SPACE)
+    {
+        scan_span = BENCH_KEY_SPACE;
+    }
+
+    for (long long i = 0; i < ops; i++)
+    {
+        int pick = (int)(next_random() % 100);
+        op_kind kind = pick < w->find_pct ? OP_FIND : pick < w->find_pct + w->scan_pct ? OP_SCAN : OP_INSERT;
+        // Lookups go to a key inserted earlier, so they measure successful searches
+        long long key = kind == OP_FIND && inserted_count ? inserted[next_random() % inserted_count] : w->next_key(i, ops);
+
+        double start = now_ns();
+        switch (kind)
+        {
+        case OP_FIND:
+            lla_find(bench_lla, BENCH_KEY(key));
+            break;
+        case OP_SCAN:
+            lla_scan_range(bench_lla, BENCH_KEY(key), BENCH_KEY(key + scan_span), scan_buf, BENCH_SCAN_KEYS, count_scanned, &scanned);
+            break;
+        default:
+            insert(bench_lla, BENCH_KEY(key));
+            inserted[inserted_count++] = key;
+            break;
+        }
+        double took = now_ns() - start;
+
+        hist_record(&hists[kind], (uint64_t)took);
+        elapsed[kind] += took;
+        counts[kind]++;
+    }
+
+    for (int kind = 0; kind < OP_KINDS; kind++)
+    {
+        if (!counts[kind])
+        {
+            continue;
+        }
+        printf("{\"workload\":\"%s\",\"op\":\"%s\",\"ops\":%lld,\"preload\":%lld,\"ops_per_sec\":%.0f,"
+               "\"p50_ns\":%llu,\"p99_ns\":%llu,\"p999_ns\":%llu,\"max_ns\":%llu",
+               w->name, op_names[kind], counts[kind], preload, counts[kind] / (elapsed[kind] / 1e9),
+               (unsigned long long)hist_percentile(&hists[kind], 0.50), (unsigned long long)hist_percentile(&hists[kind], 0.99),
+               (unsigned long long)hist_percentile(&hists[kind], 0.999), (unsigned long long)hists[kind].max);
+        if (kind == OP_INSERT)
+        {
+            printf(",\"moved_per_insert\":%.2f", (double)(bench_lla->moved - moved_before) / counts[kind]);
+        }
+        printf(",\"final_slots\":%d,\"live\":%d}\n", bench_lla->N * bench_lla->C, bench_lla->tree[ROOT].size);
+    }
+    fflush(stdout);
+
+    free(inserted);
+    cleanup_lla(&bench_lla);
+}
+// ################# EOF WORKLOAD FUNCTIONS ###################
+
+int main(int argc, char **argv)
+{
+    long long ops = argc > 1 ? atoll(argv[1]) : 1000000;
+    uint64_t seed = argc > 2 ? strtoull(argv[2], null, 10) : 42;
+    const char *only = argc > 3 ? argv[3] : null;
+
+    if (ops <= 0)
+    {
+        printf("usage: %s [ops] [seed] [workload]\n", argv[0]);
+        return 1;
+    }
+
+    zipf_init();
+    for (size_t i = 0; i < sizeof(workloads) / sizeof(workloads[0]); i++)
+    {
+        if (!only || !strcmp(only, workloads[i].name))
+        {
+            run_workload(&workloads[i], ops, seed);
+        }
+    }
+    free(zipf_cdf);
+    return 0;
+}
@@ -1,503 +1,5225 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include "lla.h"
+#include <math.h>
+#include <sched.h>
+#include <assert.h>
+#include <pthread.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "lla_internal.h"
 
 // ################# HELPER FUNCTIONS ##############
-void print_array(int *arr, int size)
+void print_array(lla_key *arr, int size)
 {
     for (int i = 0; i < size; i++)
     {
-        printf("%d, ", arr[i]);
+        LLA_PRINT_KEY(arr[i]);
     }
     printf("\n");
 }
 
-void zero_array(int *arr, int size)
+void zero_array(lla_key *arr, int size)
 {
-    for (int i = 0; i < size; i++)
+    memset(arr, 0, size * sizeof(lla_key));
+}
+
+void print_lla(lla *my_lla)
+{
+    if (my_lla->tree == null)
+    {
+        printf("The LLA is empty.\n");
+        return;
+    }
+    printf("Array snapshot:\n");
+    int arr_size = my_lla->N * my_lla->C;
+    for (int i = 0; i < arr_size; i++)
+    {
+        if (slot_is_live(my_lla, i))
+        {
+            LLA_PRINT_KEY(my_lla->arr[i]);
+        }
+        else
+        {
+            printf("_, ");
+        }
+    }
+    printf("\n");
+
+    lla_export_heatmap(my_lla, stdout, -1);
+
+    return;
+}
+
+int log_base_2(int n)
+{
+    int result = 0;
+    while (n >>= 1)
+    {
+        result++;
+    }
+    return result;
+}
+
+// Bits of occupancy word w that fall inside the slot range [from, to].
+static inline uint64_t slot_range_mask(int w, int from, int to)
+{
+    uint64_t mask = ~0ULL;
+    if (w == from >> 6)
+    {
+        mask &= ~0ULL << (from & 63);
+    }
+    if (w == to >> 6)
+    {
+        mask &= ~0ULL >> (63 - (to & 63));
+    }
+    return mask;
+}
+
+int count_live_slots(lla *lla, int from, int to)
+{
+    int count = 0;
+    for (int w = from >> 6; w <= to >> 6; w++)
+    {
+        count += __builtin_popcountll(lla->occupied[w] & slot_range_mask(w, from, to));
+    }
+    return count;
+}
+
+void clear_slot_range(lla *lla, int from, int to)
+{
+    for (int w = from >> 6; w <= to >> 6; w++)
+    {
+        lla->occupied[w] &= ~slot_range_mask(w, from, to);
+    }
+}
+
+// Grow the lla's scratch buffers to hold n entries. The buffers are reused across calls and freed
+// with the lla.
+void reserve_scratch(lla *lla, int n)
+{
+    if (n <= lla->scratch_cap)
+    {
+        return;
+    }
+
+    int cap = lla->scratch_cap ? lla->scratch_cap : 1024;
+    while (cap < n)
+    {
+        cap *= 2;
+    }
+
+    free(lla->scratch);
+    free(lla->scratch_values);
+    lla->scratch = (lla_key *)malloc(cap * sizeof(lla_key));
+    lla->scratch_values = LLA_HAS_VALUES ? (lla_value *)malloc(cap * sizeof(lla_value)) : null;
+    if (!lla->scratch || (LLA_HAS_VALUES && !lla->scratch_values))
+    {
+        printf("Malloc failed\n");
+        exit(1);
+    }
+    lla->scratch_cap = cap;
+}
+// Writer side of the stripe seqlocks. A version holds the number of writers inside the stripe in
+// its low 32 bits and a sequence number above, so writers of neighbouring windows may share a
+// stripe: readers treat it as busy until the last of them leaves, and any change as a conflict.
+static inline void stripes_write_begin(lla *lla, int from, int to)
+{
+    for (int s = from >> LLA_STRIPE_SHIFT; s <= to >> LLA_STRIPE_SHIFT; s++)
+    {
+        atomic_fetch_add_explicit(&lla->versions[s], 1, memory_order_relaxed);
+    }
+    atomic_thread_fence(memory_order_release);
+}
+
+static inline void stripes_write_end(lla *lla, int from, int to)
+{
+    for (int s = from >> LLA_STRIPE_SHIFT; s <= to >> LLA_STRIPE_SHIFT; s++)
+    {
+        atomic_fetch_add_explicit(&lla->versions[s], (1ULL << 32) - 1, memory_order_release);
+    }
+    // The doubled arrays of a growing lla follow every change to the slots copied so far
+    if (lla->grow)
+    {
+        grow_mirror(lla, from, to);
+    }
+}
+
+// Count n elements written into slots. Concurrent writers share the counter, a single writer
+// skips the atomic.
+static inline void count_moved(lla *lla, int n)
+{
+    if (lla->locks)
+    {
+        __atomic_fetch_add(&lla->moved, n, __ATOMIC_RELAXED);
+    }
+    else
+    {
+        lla->moved += n;
+    }
+}
+
+// Deamortized mode: the smallest max_moves it accepts, enough to place an insert in its leaf while
+// the writes are mirrored into a growing array, and the largest window an operation respreads on
+// the spot out of budget moves. Mirroring doubles the writes while the array grows.
+static inline int min_budget(lla *lla)
+{
+    return 4 * lla->WINDOW_SIZE;
+}
+
+static inline int move_limit(lla *lla, int budget)
+{
+    return lla->grow ? budget / 2 : budget;
+}
+
+// Undo record of a mapped lla, see undo_save(): open it before a write path changes slots in
+// [start, end] and close it once the slots are consistent again. A no-op on the heap.
+static inline void persist_begin(lla *lla, int start, int end)
+{
+    if (lla->persist)
+    {
+        undo_save(lla, start, end);
+    }
+}
+
+static inline void persist_end(lla *lla)
+{
+    if (lla->persist)
+    {
+        undo_clear(lla);
+    }
+}
+
+// Instrumentation hooks on the write paths. LLA_STAT(...) compiles to nothing without LLA_STATS.
+#ifdef LLA_STATS
+#define LLA_STAT(...) __VA_ARGS__
+
+static inline void stats_add(lla *lla, long long *counter, long long n)
+{
+    if (lla->locks)
+    {
+        __atomic_fetch_add(counter, n, __ATOMIC_RELAXED);
+    }
+    else
+    {
+        *counter += n;
+    }
+}
+
+static void stats_insert(lla *lla, int in_leaf)
+{
+    stats_add(lla, &lla->stats.inserts, 1);
+    stats_add(lla, in_leaf ? &lla->stats.leaf_inserts : &lla->stats.escalations, 1);
+}
+
+// Count a rebalance of node's window that wrote moved elements, and report it to the hook. With
+// concurrent writers the hook may run on several threads at once.
+static void stats_rebalance(lla *lla, lla_rebalance_kind kind, int node, long long moved)
+{
+    int depth = node_depth(node);
+    int bucket = moved > 1 ? 63 - __builtin_clzll(moved) : 0;
+
+    stats_add(lla, &lla->stats.rebalances[depth < LLA_STATS_LEVELS ? depth : LLA_STATS_LEVELS - 1], 1);
+    stats_add(lla, &lla->stats.moved_hist[bucket < LLA_STATS_MOVED_BUCKETS ? bucket : LLA_STATS_MOVED_BUCKETS - 1], 1);
+    if (kind == LLA_REBALANCE_RESIZE)
+    {
+        stats_add(lla, &lla->stats.resizes, 1);
+    }
+
+    if (lla->rebalance_hook)
+    {
+        lla_rebalance_event event = {kind, node, depth, window_start(lla, node), window_end(lla, node), lla->tree[node].size, moved};
+        lla->rebalance_hook(lla->rebalance_ctx, &event);
+    }
+}
+#else
+#define LLA_STAT(...)
+#endif
+// ################# EOF HELPER FUNCTIONS ##############
+
+// ################# BEGIN POLICY FUNCTIONS ###################
+// The policy the original create_lla(N, C, TAU_0, TAU_D) used: thresholds linear in the depth,
+// lower thresholds TAU_0 / 4 at the root and TAU_0 / 8 at the leaves, leaves of log2(N) slots.
+lla_policy lla_policy_linear(int C, double TAU_0, double TAU_D)
+{
+    lla_policy policy = {0};
+    policy.C = C;
+    policy.leaf_size = 0;
+    policy.TAU_0 = TAU_0;
+    policy.TAU_D = TAU_D;
+    policy.RHO_0 = TAU_0 / 4;
+    policy.RHO_D = TAU_0 / 8;
+    policy.curve = LLA_CURVE_LINEAR;
+    return policy;
+}
+
+lla_policy lla_policy_preset(lla_preset preset)
+{
+    lla_policy policy = lla_policy_linear(8, 0.5, 0.75);
+
+    switch (preset)
+    {
+    case LLA_PRESET_MEMORY_LEAN:
+        // About 1.3x-2x the memory of the keys: dense everywhere, with long leaves so a leaf
+        // respread still finds room
+        policy.C = 2;
+        policy.leaf_size = 128;
+        policy.TAU_0 = 0.7;
+        policy.TAU_D = 0.92;
+        policy.RHO_0 = 0.3;
+        policy.RHO_D = 0.15;
+        policy.curve = LLA_CURVE_GEOMETRIC;
+        break;
+    case LLA_PRESET_INSERT_HEAVY:
+        // Sparse upper levels so big respreads are rare, short leaves so small ones are cheap
+        policy.TAU_0 = 0.3;
+        policy.TAU_D = 0.7;
+        policy.RHO_0 = 0.08;
+        policy.RHO_D = 0.04;
+        break;
+    case LLA_PRESET_SCAN_HEAVY:
+        // Few gaps for a scan to skip, leaves of one occupancy word
+        policy.C = 4;
+        policy.leaf_size = 64;
+        policy.TAU_0 = 0.6;
+        policy.TAU_D = 0.9;
+        policy.RHO_0 = 0.25;
+        policy.RHO_D = 0.12;
+        policy.curve = LLA_CURVE_GEOMETRIC;
+        break;
+    case LLA_PRESET_DEFAULT:
+    default:
+        break;
+    }
+    return policy;
+}
+
+// Threshold at relative depth frac (0 at the root, 1 at the leaves) for the upper (TAU) or the
+// lower (RHO) bound.
+double policy_threshold(const lla_policy *policy, int upper, double frac)
+{
+    double at_root = upper ? policy->TAU_0 : policy->RHO_0;
+    double at_leaves = upper ? policy->TAU_D : policy->RHO_D;
+
+    switch (policy->curve)
+    {
+    case LLA_CURVE_GEOMETRIC:
+        return at_root * pow(at_leaves / at_root, frac);
+    case LLA_CURVE_TABLE:
+    {
+        const double *table = upper ? policy->tau_table : policy->rho_table;
+        double pos = frac * (policy->table_size - 1);
+        int i = (int)pos;
+        if (i >= policy->table_size - 1)
+        {
+            return table[policy->table_size - 1];
+        }
+        return table[i] + (table[i + 1] - table[i]) * (pos - i);
+    }
+    case LLA_CURVE_LINEAR:
+    default:
+        return at_root + (at_leaves - at_root) * frac;
+    }
+}
+
+// 1 if the policy keeps the structure's guarantees: at every depth 0 < RHO_K < TAU_K <= 1, upper
+// thresholds never tighten and lower ones never loosen towards the root, and RHO_0 < TAU_0 / 2
+// so that the array does not shrink right after it doubled.
+int lla_policy_valid(const lla_policy *policy)
+{
+    if (policy->C <= 0 || policy->leaf_size < 0)
+    {
+        return 0;
+    }
+    if (policy->curve == LLA_CURVE_TABLE && (policy->table_size < 2 || policy->table_size > LLA_POLICY_TABLE_SIZE))
+    {
+        return 0;
+    }
+    if (policy->curve == LLA_CURVE_TABLE)
+    {
+        // The end points are read by resizing and bulk builds, keep them in step with the table
+        int last = policy->table_size - 1;
+        if (policy->tau_table[0] != policy->TAU_0 || policy->rho_table[0] != policy->RHO_0 ||
+            policy->tau_table[last] != policy->TAU_D || policy->rho_table[last] != policy->RHO_D)
+        {
+            return 0;
+        }
+
+        // Interpolation between entries that hold the bounds below holds them too, so checking
+        // the entries themselves covers every depth, not just the sampled ones
+        for (int i = 0; i <= last; i++)
+        {
+            double tau = policy->tau_table[i];
+            double rho = policy->rho_table[i];
+            if (!(rho > 0 && rho < tau && tau <= 1) ||
+                (i > 0 && !(tau >= policy->tau_table[i - 1] && rho <= policy->rho_table[i - 1])))
+            {
+                return 0;
+            }
+        }
+    }
+    if (policy->curve == LLA_CURVE_GEOMETRIC && (policy->TAU_0 <= 0 || policy->RHO_0 <= 0 || policy->RHO_D <= 0))
+    {
+        return 0;
+    }
+
+    double prev_tau = 0, prev_rho = 1;
+    for (int i = 0; i <= 64; i++)
+    {
+        double tau = policy_threshold(policy, 1, i / 64.0);
+        double rho = policy_threshold(policy, 0, i / 64.0);
+        if (!(rho > 0 && rho < tau && tau <= 1 && tau >= prev_tau && rho <= prev_rho))
+        {
+            return 0;
+        }
+        prev_tau = tau;
+        prev_rho = rho;
+    }
+    return policy->RHO_0 < policy->TAU_0 / 2;
+}
+// ################# EOF POLICY FUNCTIONS ###################
+
+// ################# BEGIN MAIN FUNCTIONS ###################
+// An empty node with the thresholds TAU_K and RHO_K of its depth.
+static void init_node(lla *my_lla, int node, double TAU_K, double RHO_K)
+{
+    lla_node *tree = my_lla->tree;
+    int partition_size = window_end(my_lla, node) - window_start(my_lla, node) + 1;
+    double min_size = RHO_K * partition_size;
+
+    tree[node].size = 0; // set as zero before any insertions happen
+    tree[node].max_size = (int)(TAU_K * partition_size); // size / partition_size > TAU_K  <=>  size > max_size
+    tree[node].min_size = (int)min_size;                 // size / partition_size < RHO_K  <=>  size < min_size
+    if (tree[node].min_size < min_size)
+    {
+        tree[node].min_size++;
+    }
+}
+
+// Turn the per-depth density thresholds of the policy into integer counts for every node, so that
+// checking a node on insert or delete is a single integer compare against its size.
+void init_balancing_tree(lla *my_lla)
+{
+    int MAX_DEPTH = my_lla->MAX_DEPTH;
+
+    for (int depth = 0; depth <= MAX_DEPTH; depth++)
+    {
+        double frac = MAX_DEPTH ? (double)depth / MAX_DEPTH : 1;
+        double TAU_K = policy_threshold(&my_lla->policy, 1, frac);
+
+        // Lower thresholds loosen towards the leaves, mirroring the upper ones
+        double RHO_K = policy_threshold(&my_lla->policy, 0, frac);
+
+        for (int node = 1 << depth; node < 2 << depth; node++)
+        {
+            init_node(my_lla, node, TAU_K, RHO_K);
+        }
+    }
+}
+
+lla *create_lla(int N, int C, double TAU_0, double TAU_D)
+{
+    if (C <= 0 || C >= N || TAU_0 > TAU_D)
+    {
+        printf("Illegal coefficients: C <= 0 or C >= N or TAU_0 > TAU_D \n");
+        exit(1);
+    }
+
+    lla_policy policy = lla_policy_linear(C, TAU_0, TAU_D);
+    return create_lla_with_policy(N, &policy);
+}
+
+lla *create_lla_with_policy(int N, const lla_policy *policy)
+{
+    int C = policy->C;
+    lla *my_lla = new_lla_handle(N, policy);
+
+    my_lla->arr = (lla_key *)malloc(sizeof(lla_key) * PADDED_SLOTS(N * C));
+    my_lla->values = LLA_HAS_VALUES ? (lla_value *)malloc(sizeof(lla_value) * PADDED_SLOTS(N * C)) : null;
+    my_lla->occupied = (uint64_t *)calloc(OCCUPIED_WORDS(N * C), sizeof(uint64_t));
+    if (!my_lla->arr || (LLA_HAS_VALUES && !my_lla->values) || !my_lla->occupied)
+    {
+        printf("Malloc failed\n");
+        exit(1);
+    }
+
+    // Slots are empty until their bit in occupied is set, arr itself needs no initialisation
+    build_balancing_tree(my_lla);
+
+    return my_lla;
+}
+
+// Everything of a new lla except its arrays and tree, which come from the heap or from a mapped
+// file.
+lla *new_lla_handle(int N, const lla_policy *policy)
+{
+    int C = policy->C;
+    if (C <= 0 || C >= N || !lla_policy_valid(policy))
+    {
+        printf("Illegal policy: need 0 < C < N, 0 < RHO_K < TAU_K <= 1 at every depth, TAU_K non-decreasing and RHO_K non-increasing towards the leaves, RHO_0 < TAU_0 / 2\n");
+        exit(1);
+    }
+
+    lla *my_lla = (lla *)malloc(sizeof(lla));
+    if (!my_lla)
+    {
+        printf("Malloc failed\n");
+        exit(1);
+    }
+
+    my_lla->tree = null;
+    my_lla->arr = null;
+    my_lla->values = null;
+    my_lla->occupied = null;
+    my_lla->persist = null;
+    my_lla->N = N;
+    my_lla->C = C;
+    my_lla->INITIAL_N = N;
+    my_lla->policy = *policy;
+    my_lla->TAU_0 = policy->TAU_0;
+    my_lla->TAU_D = policy->TAU_D;
+    my_lla->RHO_0 = policy->RHO_0;
+    my_lla->RHO_D = policy->RHO_D;
+    my_lla->scratch = null;
+    my_lla->scratch_values = null;
+    my_lla->scratch_cap = 0;
+    my_lla->predictor = null;
+    my_lla->predictor_ctx = null;
+    my_lla->predict_mix = 0;
+    my_lla->cdf_keys = null;
+    my_lla->cdf_ranks = null;
+    my_lla->cdf_knots = 0;
+    my_lla->max_valid = 0;
+    my_lla->append_run = 0;
+    my_lla->versions = (_Atomic uint64_t *)calloc(STRIPE_COUNT(N * C), sizeof(_Atomic uint64_t));
+    my_lla->readers = (lla_reader *)aligned_alloc(64, sizeof(lla_reader) * LLA_MAX_READERS);
+    if (!my_lla->versions || !my_lla->readers)
+    {
+        printf("Malloc failed\n");
+        exit(1);
+    }
+    my_lla->job_budget = 0;
+    my_lla->job_node = 0;
+    my_lla->job_queue = null;
+    my_lla->job_queued = 0;
+    my_lla->job_queue_cap = 0;
+    my_lla->job_overruns = 0;
+    my_lla->grow = null;
+    my_lla->grow_cursor = 0;
+    my_lla->grow_node = 0;
+    my_lla->moved = 0;
+#ifdef LLA_STATS
+    memset(&my_lla->stats, 0, sizeof(my_lla->stats));
+    my_lla->rebalance_hook = null;
+    my_lla->rebalance_ctx = null;
+    my_lla->job_moved = 0;
+#endif
+    my_lla->pool = null;
+    my_lla->parallel_slots = LLA_PARALLEL_SLOTS;
+    my_lla->lock_depth = 0;
+    my_lla->lock_target = 0;
+    my_lla->locks = null;
+    my_lla->route_right_min = null;
+    my_lla->route_left_max = null;
+    my_lla->route_flags = null;
+    my_lla->route_dirty = 0;
+    atomic_init(&my_lla->generation, 0);
+    atomic_init(&my_lla->epoch, 1);
+    for (int i = 0; i < LLA_MAX_READERS; i++)
+    {
+        atomic_init(&my_lla->readers[i].epoch, 0);
+        atomic_init(&my_lla->readers[i].used, 0);
+    }
+
+    return my_lla;
+}
+
+// Leaf size and depth of the tree over the current N * C slots: leaves of policy.leaf_size slots,
+// or log2(N) by default.
+void set_tree_shape(lla *my_lla)
+{
+    tree_shape(&my_lla->policy, my_lla->N, &my_lla->WINDOW_SIZE, &my_lla->MAX_DEPTH);
+}
+
+void tree_shape(const lla_policy *policy, int N, int *window_size, int *max_depth)
+{
+    int WINDOW_SIZE = policy->leaf_size ? policy->leaf_size : log_base_2(N);
+    int num_leaves = (policy->C * N) / WINDOW_SIZE;
+
+    *window_size = WINDOW_SIZE;
+    *max_depth = log_base_2(num_leaves > 0 ? num_leaves : 1);
+}
+
+// (Re)create the balancing tree over the current N * C slots. The nodes live in one contiguous
+// array in BFS order and their windows are derived from the index, see window_start().
+void build_balancing_tree(lla *my_lla)
+{
+    set_tree_shape(my_lla);
+    int MAX_DEPTH = my_lla->MAX_DEPTH;
+
+    // Index 0 is unused so that the root is ROOT == 1 and the parent of node i is i / 2
+    my_lla->tree = (lla_node *)malloc(sizeof(lla_node) * (2 << MAX_DEPTH));
+    if (!my_lla->tree)
+    {
+        printf("Malloc failed\n");
+        exit(1);
+    }
+
+    // printf("window size: %d\n", window_size);
+    init_balancing_tree(my_lla);
+}
+
+// Move every live element into a freshly allocated array of N * C slots and rebuild the tree
+// around it. The elements are gathered in one pass and spread evenly over the new array, so a
+// resize costs O(N * C), which doubling/halving amortizes to O(1) per insert or delete.
+int lla_resize(lla *my_lla, int N)
+{
+    int C = my_lla->C;
+    int old_capacity = my_lla->N * C;
+    int new_capacity = N * C;
+    int live = my_lla->tree[ROOT].size;
+
+    if (my_lla->locks)
+    {
+        N = lock_aligned_n(my_lla, N);
+        new_capacity = N * C;
+    }
+    if (C >= N || live > my_lla->TAU_0 * new_capacity || (my_lla->locks && N == my_lla->N))
+    {
+        return 0;
+    }
+    grow_abort(my_lla); // the resize replaces what it has copied
+    if (my_lla->persist)
+    {
+        return persist_resize(my_lla, N);
+    }
+
+    // Readers that overlap the resize see an odd generation and retry on the new layout
+    uint32_t generation = atomic_load_explicit(&my_lla->generation, memory_order_relaxed);
+    atomic_store_explicit(&my_lla->generation, generation + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+
+    lla_key *old_arr = my_lla->arr;
+    lla_value *old_values = my_lla->values;
+    uint64_t *old_occupied = my_lla->occupied;
+    lla_node *old_tree = my_lla->tree;
+    _Atomic uint64_t *old_versions = my_lla->versions;
+    lla_key *new_arr = (lla_key *)malloc(sizeof(lla_key) * PADDED_SLOTS(new_capacity));
+    lla_value *new_values = LLA_HAS_VALUES ? (lla_value *)malloc(sizeof(lla_value) * PADDED_SLOTS(new_capacity)) : null;
+    uint64_t *new_occupied = (uint64_t *)calloc(OCCUPIED_WORDS(new_capacity), sizeof(uint64_t));
+    _Atomic uint64_t *new_versions = (_Atomic uint64_t *)calloc(STRIPE_COUNT(new_capacity), sizeof(_Atomic uint64_t));
+    if (!new_arr || (LLA_HAS_VALUES && !new_values) || !new_occupied || !new_versions)
+    {
+        printf("Malloc failed\n");
+        exit(1);
+    }
+
+    // Compact the live elements to the front of the old array, then spread them over the new one.
+    // With a worker pool both passes run in parallel through the scratch arena instead.
+    lla_key none = {0};
+    lla_value none_value = {0};
+    int parallel = pool_acquire(my_lla, old_capacity > new_capacity ? old_capacity : new_capacity);
+    int count;
+    if (parallel)
+    {
+        count = parallel_gather(my_lla, 0, old_capacity - 1);
+    }
+    else
+    {
+        count = gather_range(my_lla, 0, old_capacity - 1, old_arr, old_values, none, none_value, 0);
+    }
+
+    my_lla->arr = new_arr;
+    my_lla->values = new_values;
+    my_lla->occupied = new_occupied;
+    my_lla->versions = new_versions;
+    my_lla->N = N;
+    build_balancing_tree(my_lla);
+    if (parallel)
+    {
+        parallel_spread(my_lla, 0, new_capacity - 1, count, none, none_value, count, 0);
+        pool_release(my_lla);
+    }
+    else
+    {
+        spread_elements(my_lla, 0, new_capacity, old_arr, old_values, count);
+    }
+    recount_subtree(my_lla, ROOT);
+    clear_jobs(my_lla); // everything is evenly spread now
+    atomic_store_explicit(&my_lla->generation, generation + 2, memory_order_release);
+    LLA_STAT(stats_rebalance(my_lla, LLA_REBALANCE_RESIZE, ROOT, count));
+
+    // Readers may still be walking the old layout, free it once they are done
+    lla_synchronize(my_lla);
+    free(old_arr);
+    free(old_values);
+    free(old_occupied);
+    free(old_tree);
+    free((void *)old_versions);
+
+    return 1;
+}
+
+// Route x to the right child when it is not below the first key stored there. Comparing against
+// arr[window_end] instead would often look at an empty slot and send x the wrong way.
+int route_right(lla *lla, int node, lla_key x)
+{
+    lla_node *right = &lla->tree[2 * node + 1];
+
+    if (!right->size)
+    {
+        // An empty right child may also take a key past everything on the left. Doing so once the
+        // left child is at its threshold keeps an append run from respreading the parent again.
+        lla_node *left = &lla->tree[2 * node];
+        if (left->size < left->max_size - 1)
+        {
+            return 0;
+        }
+        int last = last_live_slot(lla, 2 * node);
+        return last == -1 || !LLA_KEY_LESS(x, lla->arr[last]);
+    }
+    return !LLA_KEY_LESS(x, right->first);
+}
+
+// Read-only descent: returns the node whose window x must be respread into, i.e. the leaf when
+// every node on the path can take one more element, otherwise the parent of the topmost node
+// that would exceed its threshold. Returns 0 when even the root is full. No counter is touched,
+// see insert_commit().
+int insert_help_iterative(lla *lla, lla_key x)
+{
+    return insert_descend(lla, ROOT, x);
+}
+
+// insert_help_iterative() starting at node instead of the root; returns node / 2 when node itself
+// is full.
+int insert_descend(lla *lla, int node, lla_key x)
+{
+    lla_node *tree = lla->tree;
+    int depth = node_depth(node);
+    // note_insert() counted x as an append, so x is past every stored key and the counters alone
+    // say which way to go
+    int append = lla->append_run > 0 && lla->max_valid && !LLA_KEY_LESS(x, lla->max_key);
+
+    while (depth <= lla->MAX_DEPTH)
+    {
+        if (tree[node].size >= tree[node].max_size)
+        {
+            return node / 2;
+        }
+
+        if (depth == lla->MAX_DEPTH)
+        {
+            break;
+        }
+
+        if (append)
+        {
+            node = 2 * node + (tree[2 * node + 1].size > 0 || tree[2 * node].size >= tree[2 * node].max_size - 1);
+        }
+        else
+        {
+            node = 2 * node + route_right(lla, node, x);
+        }
+        depth++;
+    }
+
+    return node;
+}
+
+// Commit phase: x has been respread into node's window. Count it once on every ancestor, and
+// when the window spans several leaves rebuild its subtree from the new layout, since the
+// respread moved elements between its children.
+void insert_commit(lla *lla, int node)
+{
+    if (node_depth(node) < lla->MAX_DEPTH)
+    {
+        recount_subtree(lla, node);
+    }
+    else
+    {
+        lla->tree[node].size++;
+    }
+
+    for (int ancestor = node / 2; ancestor; ancestor /= 2)
+    {
+        lla->tree[ancestor].size++;
+    }
+    update_first_keys(lla, node);
+}
+
+// Copy the live keys of [start_index, end_index] into dst in sorted order, skipping empty slots a
+// whole occupancy word at a time. When insert_x is set, x is merged in at its sorted position.
+// Values follow their keys into dst_values when the build has them. Returns the number of keys
+// written. dst may alias arr as long as it does not start after start_index, which is how
+// lla_resize() compacts in place.
+int gather_range(lla *lla, int start_index, int end_index, lla_key *dst, lla_value *dst_values, lla_key x, lla_value x_value, int insert_x)
+{
+    if (LLA_SIMD_KEYS && LLA_SIMD_VALUES && lla_simd_level() > LLA_SIMD_SCALAR)
+    {
+        return gather_range_simd(lla, start_index, end_index, dst, dst_values, x, x_value, insert_x);
+    }
+
+    lla_key *arr = lla->arr;
+    lla_value *values = lla->values;
+    int count = 0;
+    int x_inserted = !insert_x;
+
+    for (int w = start_index >> 6; w <= end_index >> 6; w++)
+    {
+        uint64_t bits = lla->occupied[w] & slot_range_mask(w, start_index, end_index);
+
+        while (bits)
+        {
+            int slot = (w << 6) + __builtin_ctzll(bits);
+            lla_key val = arr[slot];
+            bits &= bits - 1;
+
+            if (!x_inserted && LLA_KEY_LESS(x, val))
+            {
+                if (LLA_HAS_VALUES)
+                {
+                    dst_values[count] = x_value;
+                }
+                dst[count++] = x;
+                x_inserted = 1;
+            }
+            if (LLA_HAS_VALUES)
+            {
+                dst_values[count] = values[slot];
+            }
+            dst[count++] = val;
+        }
+    }
+
+    if (!x_inserted)
+    {
+        if (LLA_HAS_VALUES)
+        {
+            dst_values[count] = x_value;
+        }
+        dst[count++] = x;
+    }
+
+    return count;
+}
+
+// gather_range() for 4-byte keys and values: each occupancy word is left-packed into dst by the
+// compaction kernel. x lands in the first word whose last key is greater than x, at the rank the
+// vector compare finds among that word's keys, and the rest of the word moves up one entry.
+int gather_range_simd(lla *lla, int start_index, int end_index, lla_key *dst, lla_value *dst_values, lla_key x, lla_value x_value, int insert_x)
+{
+    int count = 0;
+    int x_inserted = !insert_x;
+
+    for (int w = start_index >> 6; w <= end_index >> 6; w++)
+    {
+        uint64_t bits = lla->occupied[w] & slot_range_mask(w, start_index, end_index);
+        if (!bits)
+        {
+            continue;
+        }
+
+        int first = count;
+        count += lla_compact64((const uint32_t *)(lla->arr + (w << 6)), bits, (uint32_t *)(dst + first));
+        if (LLA_HAS_VALUES)
+        {
+            lla_compact64((const uint32_t *)(lla->values + (w << 6)), bits, (uint32_t *)(dst_values + first));
+        }
+
+        if (!x_inserted && LLA_KEY_LESS(x, dst[count - 1]))
+        {
+            int pos = first;
+#ifdef LLA_INT32_KEYS
+            pos += lla_rank32((const int32_t *)(dst + first), count - first, x);
+#else
+            while (!LLA_KEY_LESS(x, dst[pos]))
+            {
+                pos++;
+            }
+#endif
+            memmove(dst + pos + 1, dst + pos, (count - pos) * sizeof(lla_key));
+            dst[pos] = x;
+            if (LLA_HAS_VALUES)
+            {
+                memmove(dst_values + pos + 1, dst_values + pos, (count - pos) * sizeof(lla_value));
+                dst_values[pos] = x_value;
+            }
+            count++;
+            x_inserted = 1;
+        }
+    }
+
+    if (!x_inserted)
+    {
+        if (LLA_HAS_VALUES)
+        {
+            dst_values[count] = x_value;
+        }
+        dst[count++] = x;
+    }
+
+    return count;
+}
+
+// Empty the range_size slots starting at start and lay out the count sorted elements of src
+// (and src_values) evenly over them. The target slots are marked in the occupancy words first,
+// then every word that lies wholly inside the range is filled by the expand kernel.
+void spread_elements(lla *lla, int start, int range_size, const lla_key *src, const lla_value *src_values, int count)
+{
+    int end = start + range_size - 1;
+    count_moved(lla, count);
+
+    if (lla->predictor || lla_append_mode(lla))
+    {
+        lla_key none = {0};
+        mark_predicted_slots(lla, node_of_range(lla, start, end), src, count, count, none, 0);
+    }
+    else
+    {
+        mark_spread_slots(lla, start, range_size, count);
+    }
+
+    int use_simd = LLA_SIMD_KEYS && LLA_SIMD_VALUES && lla_simd_level() > LLA_SIMD_SCALAR;
+    int k = 0;
+    for (int w = start >> 6; k < count; w++)
+    {
+        uint64_t bits = lla->occupied[w] & slot_range_mask(w, start, end);
+        int n = __builtin_popcountll(bits);
+        int whole_word = (w << 6) >= start && (w << 6) + 63 <= end;
+
+        // The AVX2 kernel reads a full vector of src past the word's last element
+        if (use_simd && whole_word && k + n + 8 <= count)
+        {
+            lla_expand64((const uint32_t *)(src + k), bits, (uint32_t *)(lla->arr + (w << 6)));
+            if (LLA_HAS_VALUES)
+            {
+                lla_expand64((const uint32_t *)(src_values + k), bits, (uint32_t *)(lla->values + (w << 6)));
+            }
+            k += n;
+            continue;
+        }
+
+        while (bits)
+        {
+            int slot = (w << 6) + __builtin_ctzll(bits);
+            lla->arr[slot] = src[k];
+            if (LLA_HAS_VALUES)
+            {
+                lla->values[slot] = src_values[k];
+            }
+            k++;
+            bits &= bits - 1;
+        }
+    }
+}
+
+// Mark the slots that spread_elements() and respread_range() fill when laying count elements
+// evenly over the range_size slots starting at start, one OR per occupancy word. Element i lands
+// at or after start + i, which is what lets respread_range() move elements in place.
+void mark_spread_slots(lla *lla, int start, int range_size, int count)
+{
+    clear_slot_range(lla, start, start + range_size - 1);
+    
+    // Optimized distribution with integer arithmetic
+    if (count > 0)
+    {
+        // Use fixed-point arithmetic to avoid repeated division, 64-bit so that windows
+        // above 32K slots do not overflow
+        long long spacing_fixed = ((long long)range_size << 16) / count;  // 16-bit fixed point
+        long long pos_fixed = 0;
+        int word = start >> 6;
+        uint64_t bits = 0;
+        
+        for (int i = 0; i < count; i++)
+        {
+            int pos = (int)(pos_fixed >> 16);
+            
+            // Bounds check to prevent overflow
+            if (__builtin_expect(pos >= range_size, 0))
+            {
+                pos = range_size - (count - i);
+            }
+            
+            int slot = start + pos;
+            if ((slot >> 6) != word)
+            {
+                lla->occupied[word] |= bits;
+                word = slot >> 6;
+                bits = 0;
+            }
+            bits |= 1ULL << (slot & 63);
+            pos_fixed += spacing_fixed;
+        }
+        lla->occupied[word] |= bits;
+    }
+}
+
+// Pack the live elements of [start_index, end_index] into its first slots, in place, and return
+// how many there are. The occupancy bits are left alone.
+int compact_range(lla *lla, int start_index, int end_index)
+{
+    int use_simd = LLA_SIMD_KEYS && LLA_SIMD_VALUES && lla_simd_level() > LLA_SIMD_SCALAR;
+    int count = 0;
+
+    for (int w = start_index >> 6; w <= end_index >> 6; w++)
+    {
+        uint64_t bits = lla->occupied[w] & slot_range_mask(w, start_index, end_index);
+        if (!bits)
+        {
+            continue;
+        }
+
+        int dst = start_index + count;
+        if (use_simd)
+        {
+            count += lla_compact64((const uint32_t *)(lla->arr + (w << 6)), bits, (uint32_t *)(lla->arr + dst));
+            if (LLA_HAS_VALUES)
+            {
+                lla_compact64((const uint32_t *)(lla->values + (w << 6)), bits, (uint32_t *)(lla->values + dst));
+            }
+            continue;
+        }
+
+        while (bits)
+        {
+            int slot = (w << 6) + __builtin_ctzll(bits);
+            lla->arr[start_index + count] = lla->arr[slot];
+            if (LLA_HAS_VALUES)
+            {
+                lla->values[start_index + count] = lla->values[slot];
+            }
+            count++;
+            bits &= bits - 1;
+        }
+    }
+    return count;
+}
+
+// Respread the window (plus x when insert_x is set) evenly without scratch memory: compact the
+// live elements to the left end, then place them from the right end back. Element e of the final
+// layout comes from packed index e or e - 1 and goes to a slot at or after start + e, so walking
+// right to left never overwrites an element that has yet to move.
+void respread_range(lla *lla, int start_index, int end_index, lla_key x, lla_value x_value, int insert_x)
+{
+    int range_size = end_index - start_index + 1;
+    if (pool_acquire(lla, range_size))
+    {
+        respread_parallel(lla, start_index, end_index, x, x_value, insert_x);
+        pool_release(lla);
+        return;
+    }
+
+    int count = compact_range(lla, start_index, end_index);
+    lla_key *packed = lla->arr + start_index;
+    lla_value *packed_values = LLA_HAS_VALUES ? lla->values + start_index : null;
+
+    // x goes after its equals, at the first packed key greater than it
+    int rank = count;
+    if (insert_x)
+    {
+        int lo = 0, hi = count;
+        while (lo < hi)
+        {
+            int mid = lo + (hi - lo) / 2;
+            if (LLA_KEY_LESS(x, packed[mid]))
+            {
+                hi = mid;
+            }
+            else
+            {
+                lo = mid + 1;
+            }
+        }
+        rank = lo;
+    }
+
+    int total = count + (insert_x ? 1 : 0);
+    count_moved(lla, total);
+    if (lla->predictor || lla_append_mode(lla))
+    {
+        mark_predicted_slots(lla, node_of_range(lla, start_index, end_index), packed, count, rank, x, insert_x);
+    }
+    else
+    {
+        mark_spread_slots(lla, start_index, range_size, total);
+    }
+
+    int use_simd = LLA_SIMD_KEYS && LLA_SIMD_VALUES && lla_simd_level() > LLA_SIMD_SCALAR;
+    int k = total;
+    for (int w = end_index >> 6; k > 0; w--)
+    {
+        uint64_t bits = lla->occupied[w] & slot_range_mask(w, start_index, end_index);
+        int n = __builtin_popcountll(bits);
+        int first = k - n;
+        int shift = insert_x && first > rank;
+
+        // The expand kernel reads 8 packed entries past the word's last element and writes every
+        // lane of the word, so the packed run it reads must end below the word
+        if (use_simd && n && !(insert_x && first <= rank && rank < k) &&
+            (w << 6) >= start_index && (w << 6) + 63 <= end_index &&
+            start_index + first - shift + n + 8 <= (w << 6))
+        {
+            lla_expand64((const uint32_t *)(packed + first - shift), bits, (uint32_t *)(lla->arr + (w << 6)));
+            if (LLA_HAS_VALUES)
+            {
+                lla_expand64((const uint32_t *)(packed_values + first - shift), bits, (uint32_t *)(lla->values + (w << 6)));
+            }
+            k = first;
+            continue;
+        }
+
+        while (bits)
+        {
+            int slot = (w << 6) + 63 - __builtin_clzll(bits);
+            int e = --k;
+            bits &= ~(1ULL << (slot & 63));
+
+            if (insert_x && e == rank)
+            {
+                lla->arr[slot] = x;
+                if (LLA_HAS_VALUES)
+                {
+                    lla->values[slot] = x_value;
+                }
+                continue;
+            }
+
+            int src = e - (insert_x && e > rank);
+            lla->arr[slot] = packed[src];
+            if (LLA_HAS_VALUES)
+            {
+                lla->values[slot] = packed_values[src];
+            }
+        }
+    }
+}
+
+// High-performance optimized version: insert x into [start_index, end_index] and spread the
+// window out evenly.
+// input arr=[......, 1, 5, _, _, _, ......], start_index, end_index, x = 2
+// output: [......, 1, _, 2, _, 5, .......] // sorted and spread out
+void insert_and_distribute_array_range_optimized(lla *lla, int start_index, int end_index, lla_key x, lla_value x_value)
+{
+    respread_range(lla, start_index, end_index, x, x_value, 1);
+}
+
+// Sibling of insert_and_distribute_array_range_optimized() used after deletions: respread the
+// live elements of [start_index, end_index] evenly without inserting anything.
+void distribute_array_range(lla *lla, int start_index, int end_index)
+{
+    lla_key none = {0};
+    lla_value none_value = {0};
+    respread_range(lla, start_index, end_index, none, none_value, 0);
+}
+
+// First key of node from its slots when it is a leaf, otherwise from its children.
+static void refresh_first_key(lla *lla, int node)
+{
+    lla_node *tree = lla->tree;
+
+    if (node_depth(node) == lla->MAX_DEPTH)
+    {
+        int slot = next_live_slot(lla, window_start(lla, node), window_end(lla, node));
+        if (slot != -1)
+        {
+            tree[node].first = lla->arr[slot];
+        }
+    }
+    else
+    {
+        tree[node].first = tree[2 * node].size ? tree[2 * node].first : tree[2 * node + 1].first;
+    }
+}
+
+// With concurrent writers, note under the exclusive layout lock that node's window changed, so
+// layout_unlock_exclusive() only rebuilds the routing caches that can depend on it.
+static void touch_routing(lla *lla, int node)
+{
+    if (!lla->locks || !node)
+    {
+        return;
+    }
+    int dirty = lla->route_dirty ? lla->route_dirty : node;
+    while (dirty != node)
+    {
+        if (dirty > node)
+        {
+            dirty /= 2;
+        }
+        else
+        {
+            node /= 2;
+        }
+    }
+    lla->route_dirty = dirty;
+}
+
+// Sizes are stored atomically since routing nodes read their children's counters while a writer
+// recounts the subtree below
+static int recount_node(lla *lla, int node)
+{
+    int size = 0;
+
+    if (node_depth(node) < lla->MAX_DEPTH)
+    {
+        size = recount_node(lla, 2 * node) + recount_node(lla, 2 * node + 1);
+    }
+    else
+    {
+        size = count_live_slots(lla, window_start(lla, node), window_end(lla, node));
+    }
+
+    __atomic_store_n(&lla->tree[node].size, size, __ATOMIC_RELAXED);
+    refresh_first_key(lla, node);
+    return size;
+}
+
+// Recount every node of the subtree from the array, after its window was respread.
+int recount_subtree(lla *lla, int node)
+{
+    touch_routing(lla, node);
+    return recount_node(lla, node);
+}
+
+// Redo the first key of node and of its ancestors once the keys in node's window changed. The
+// counters must already be up to date.
+void update_first_keys(lla *lla, int node)
+{
+    touch_routing(lla, node);
+    for (; node; node /= 2)
+    {
+        refresh_first_key(lla, node);
+    }
+}
+
+// Fast path for a leaf that can take x: write it into the gap between its neighbours, or shift the
+// few keys between x's position and the nearest free slot of the leaf over by one. Returns the
+// number of keys written (x plus the shifted ones), or 0 without touching anything when that slot
+// is more than SHIFT_LIMIT keys away, in which case the caller respreads the leaf instead.
+// Counters are left to insert_commit().
+int insert_local_shift(lla *lla, int leaf, lla_key x, lla_value x_value)
+{
+    enum { SHIFT_LIMIT = 8 };
+    int start = window_start(lla, leaf);
+    int end = window_end(lla, leaf);
+
+    // pred is the last key <= x, so x goes after its equals as in respread_range()
+    int pred = start - 1;
+    for (int slot = next_live_slot(lla, start, end); slot != -1; slot = next_live_slot(lla, slot + 1, end))
+    {
+        if (LLA_KEY_LESS(x, lla->arr[slot]))
+        {
+            break;
+        }
+        pred = slot;
+    }
+    int succ = next_live_slot(lla, pred + 1, end);
+    if (succ == -1)
+    {
+        succ = end + 1;
+    }
+
+    int slot;
+    int shifted = 0;
+    if (succ - pred > 1)
+    {
+        // A gap is already there, take its middle to keep room on both sides. During an append run
+        // the next key goes right after this one, so the leaf fills up densely.
+        slot = lla_append_mode(lla) && succ == end + 1 && pred >= start ? pred + 1 : pred + (succ - pred) / 2;
+    }
+    else
+    {
+        int right = next_free_slot(lla, succ, end);
+        int left = prev_free_slot(lla, start, pred);
+        int right_cost = right == -1 ? SHIFT_LIMIT + 1 : right - succ;
+        int left_cost = left == -1 ? SHIFT_LIMIT + 1 : pred - left;
+
+        if (right_cost <= left_cost && right_cost <= SHIFT_LIMIT)
+        {
+            memmove(lla->arr + succ + 1, lla->arr + succ, right_cost * sizeof(lla_key));
+            if (LLA_HAS_VALUES)
+            {
+                memmove(lla->values + succ + 1, lla->values + succ, right_cost * sizeof(lla_value));
+            }
+            set_slot_live(lla, right);
+            slot = succ;
+            shifted = right_cost;
+        }
+        else if (left_cost <= SHIFT_LIMIT)
+        {
+            memmove(lla->arr + left, lla->arr + left + 1, left_cost * sizeof(lla_key));
+            if (LLA_HAS_VALUES)
+            {
+                memmove(lla->values + left, lla->values + left + 1, left_cost * sizeof(lla_value));
+            }
+            set_slot_live(lla, left);
+            slot = pred;
+            shifted = left_cost;
+        }
+        else
+        {
+            return 0;
+        }
+    }
+
+    lla->arr[slot] = x;
+    if (LLA_HAS_VALUES)
+    {
+        lla->values[slot] = x_value;
+    }
+    set_slot_live(lla, slot);
+    count_moved(lla, 1 + shifted);
+    return 1 + shifted;
+}
+
+void insert(lla *lla, lla_key x)
+{
+    lla_value none_value = {0};
+    lla_insert_value(lla, x, none_value);
+}
+
+// Track the largest key and how many inserts in a row were at or past it. LLA_APPEND_RUN of them
+// in a row switch respreads to the append layout, the first insert below the maximum ends it.
+void note_insert(lla *lla, lla_key x)
+{
+    if (!lla->max_valid)
+    {
+        int slot = last_live_slot(lla, ROOT);
+        lla->max_key = slot == -1 ? x : lla->arr[slot];
+        lla->max_valid = 1;
+    }
+
+    if (LLA_KEY_LESS(x, lla->max_key))
+    {
+        lla->append_run = 0;
+        return;
+    }
+    lla->max_key = x;
+    if (lla->append_run < LLA_APPEND_RUN)
+    {
+        lla->append_run++;
+    }
+}
+
+void lla_insert_value(lla *lla, lla_key x, lla_value x_value)
+{
+    if (lla->locks)
+    {
+        insert_concurrent(lla, x, x_value);
+        return;
+    }
+
+    long long before = lla->moved;
+    note_insert(lla, x);
+    insert_entry(lla, x, x_value);
+    if (!lla->job_budget)
+    {
+        return;
+    }
+
+    if (!lla->job_node)
+    {
+        anticipate_rebalance(lla, x);
+    }
+    // Start growing while the root still has room for the inserts that arrive during the copy
+    lla_node *root = &lla->tree[ROOT];
+    if (!lla->grow && !lla->persist && root->size >= root->max_size - root->max_size / 8)
+    {
+        grow_start(lla);
+    }
+
+    // Carry the pending work along with whatever budget this insert left over
+    carry_work(lla, lla->job_budget - (int)(lla->moved - before));
+}
+
+// Insert x into the structure as it stands: grow it when the root is full, then place x in the
+// smallest window with room. Returns the number of elements written.
+int insert_entry(lla *lla, lla_key x, lla_value x_value)
+{
+    if (lla->tree[ROOT].size >= lla->tree[ROOT].max_size)
+    { /* The array would exceed TAU_0, grow it before inserting */
+        if (lla->job_budget && !lla->locks && !lla->persist)
+        {
+            // Deamortized mode doubles the array in steps, the root takes the inserts meanwhile
+            if (!lla->grow)
+            {
+                grow_start(lla);
+            }
+        }
+        else
+        {
+            lla_resize(lla, lla->N * 2);
+        }
+    }
+
+    int node = insert_help_iterative(lla, x); // either a leaf, or nearest ancestor in threshhold
+    if (!node && lla->grow)
+    {
+        node = ROOT;
+    }
+
+    if (!node)
+    {
+        printf("insert failed");
+        exit(1);
+    }
+
+    // In deamortized mode a window too large for the budget becomes a rebalance job
+    if (lla->job_budget && !lla->locks && node_depth(node) < lla->MAX_DEPTH && lla->tree[node].size >= move_limit(lla, lla->job_budget))
+    {
+        return insert_deamortized(lla, node, x, x_value);
+    }
+
+    int start = window_start(lla, node);
+    int end = window_end(lla, node);
+    stripes_write_begin(lla, start, end);
+    persist_begin(lla, start, end);
+
+    // A leaf with room usually has a free slot next to x's position, respreading it is the fallback
+    int moved;
+    if (node_depth(node) == lla->MAX_DEPTH && (moved = insert_local_shift(lla, node, x, x_value)))
+    {
+        persist_end(lla);
+        stripes_write_end(lla, start, end);
+        insert_commit(lla, node);
+        LLA_STAT(stats_insert(lla, 1));
+        return moved;
+    }
+
+    insert_and_distribute_array_range_optimized(lla, start, end, x, x_value);
+    // printf("insert and redistribute range [%d, %d]\n", start, end);
+    persist_end(lla);
+    stripes_write_end(lla, start, end);
+    insert_commit(lla, node);
+    LLA_STAT(stats_insert(lla, node_depth(node) == lla->MAX_DEPTH));
+    LLA_STAT(stats_rebalance(lla, LLA_REBALANCE_INSERT, node, lla->tree[node].size));
+    return lla->tree[node].size;
+}
+
+int lla_delete(lla *lla, lla_key x)
+{
+    if (lla->locks)
+    {
+        layout_lock_exclusive(lla);
+        int deleted = delete_entry(lla, x);
+        layout_unlock_exclusive(lla);
+        return deleted;
+    }
+
+    long long before = lla->moved;
+    int deleted = delete_entry(lla, x);
+    if (lla->job_budget)
+    {
+        carry_work(lla, lla->job_budget - (int)(lla->moved - before));
+    }
+    return deleted;
+}
+
+int delete_entry(lla *lla, lla_key x)
+{
+    int slot = lla_find(lla, x);
+    if (slot == -1)
+    {
+        return 0;
+    }
+
+    lla_node *tree = lla->tree;
+    stripes_write_begin(lla, slot, slot);
+    persist_begin(lla, slot, slot);
+    clear_slot_live(lla, slot);
+    persist_end(lla);
+    stripes_write_end(lla, slot, slot);
+    if (lla->max_valid && !LLA_KEY_LESS(x, lla->max_key))
+    {
+        lla->max_valid = 0;
+    }
+
+    // Walk the path owning the slot, lowering the counters on the way down
+    int node = ROOT;
+    for (int depth = 0;; depth++)
+    {
+        tree[node].size--;
+        if (depth == lla->MAX_DEPTH)
+        {
+            break;
+        }
+        node = 2 * node + (slot > window_end(lla, 2 * node));
+    }
+    update_first_keys(lla, node);
+
+    // In deamortized mode the array keeps its size, a shrink would respread everything at once
+    if (tree[ROOT].size < tree[ROOT].min_size && lla->N / 2 >= lla->INITIAL_N && !lla->job_budget && lla_resize(lla, lla->N / 2))
+    { /* Give memory back once the array has emptied out, the respread also restores every rho_k */
+        return 1;
+    }
+
+    if (tree[node].size >= tree[node].min_size)
+    {
+        return 1;
+    }
+
+    // Leaf fell below rho_k: merge it with its neighbours by respreading the nearest ancestor
+    // that is still dense enough. When even the root is below rho_0 at the initial capacity the
+    // whole array is uniformly sparse and a respread would not help.
+    int ancestor = node / 2;
+    while (ancestor && tree[ancestor].size < tree[ancestor].min_size)
+    {
+        ancestor /= 2;
+    }
+
+    if (ancestor && lla->job_budget && !lla->locks && tree[ancestor].size > move_limit(lla, lla->job_budget))
+    {
+        schedule_rebalance(lla, ancestor);
+    }
+    else if (ancestor)
+    {
+        int start = window_start(lla, ancestor);
+        int end = window_end(lla, ancestor);
+        stripes_write_begin(lla, start, end);
+        persist_begin(lla, start, end);
+        distribute_array_range(lla, start, end);
+        persist_end(lla);
+        stripes_write_end(lla, start, end);
+        recount_subtree(lla, ancestor);
+        LLA_STAT(stats_rebalance(lla, LLA_REBALANCE_DELETE, ancestor, tree[ancestor].size));
+    }
+
+    return 1;
+}
+// ################# EOF MAIN FUNCTIONS ###################
+
+// ################# BEGIN PREDICTION FUNCTIONS ###################
+// With a predictor set, respreads size each gap by the predicted share of future inserts that
+// fall between its two neighbours instead of spacing elements evenly. The predictor is a CDF over
+// keys: predict(ctx, k) is the fraction of upcoming keys expected to be <= k, non-decreasing in k.
+void lla_set_predictor(lla *lla, lla_predictor predictor, void *ctx, double mix)
+{
+    lla->predictor = predictor;
+    lla->predictor_ctx = ctx;
+    lla->predict_mix = mix < 0 ? 0 : mix > 1 ? 1 : mix;
+}
+
+static int compare_doubles(const void *a, const void *b)
+{
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+// Piecewise-linear CDF through the fitted knots, flat outside the sample's range
+double cdf_model_predict(void *ctx, lla_key key)
+{
+    lla *lla = ctx;
+    double k = LLA_KEY_TO_DOUBLE(key);
+    double *xs = lla->cdf_keys;
+    int n = lla->cdf_knots;
+
+    if (k <= xs[0])
+    {
+        return 0;
+    }
+    if (k >= xs[n - 1])
+    {
+        return 1;
+    }
+
+    int lo = 0, hi = n - 1;
+    while (hi - lo > 1)
+    {
+        int mid = lo + (hi - lo) / 2;
+        if (xs[mid] <= k)
+        {
+            lo = mid;
+        }
+        else
+        {
+            hi = mid;
+        }
+    }
+    return lla->cdf_ranks[lo] + (lla->cdf_ranks[hi] - lla->cdf_ranks[lo]) * (k - xs[lo]) / (xs[hi] - xs[lo]);
+}
+
+// Fit a learned CDF with up to knots quantile knots to a sample of the keys expected to be
+// inserted, and predict with it. An empty sample turns predictions off.
+void lla_fit_predictor(lla *lla, const lla_key *sample, size_t n, int knots, double mix)
+{
+    free(lla->cdf_keys);
+    free(lla->cdf_ranks);
+    lla->cdf_keys = null;
+    lla->cdf_ranks = null;
+    lla->cdf_knots = 0;
+
+    if (n == 0 || knots < 2)
+    {
+        lla_set_predictor(lla, null, null, 0);
+        return;
+    }
+
+    double *sorted = (double *)malloc(n * sizeof(double));
+    lla->cdf_keys = (double *)malloc(knots * sizeof(double));
+    lla->cdf_ranks = (double *)malloc(knots * sizeof(double));
+    if (!sorted || !lla->cdf_keys || !lla->cdf_ranks)
+    {
+        printf("Malloc failed\n");
+        exit(1);
+    }
+
+    for (size_t i = 0; i < n; i++)
+    {
+        sorted[i] = LLA_KEY_TO_DOUBLE(sample[i]);
+    }
+    qsort(sorted, n, sizeof(double), compare_doubles);
+
+    // Knot i sits at the (i / (knots - 1)) quantile, duplicate keys collapse into one knot
+    int m = 0;
+    for (int i = 0; i < knots; i++)
+    {
+        size_t idx = (size_t)((double)(n - 1) * i / (knots - 1));
+        if (m && sorted[idx] <= lla->cdf_keys[m - 1])
+        {
+            lla->cdf_ranks[m - 1] = (double)(idx + 1) / n;
+            continue;
+        }
+        lla->cdf_keys[m] = sorted[idx];
+        lla->cdf_ranks[m] = (double)(idx + 1) / n;
+        m++;
+    }
+    free(sorted);
+
+    if (m < 2)
+    {
+        // Every sampled key was the same, widen it into a unit step
+        lla->cdf_keys[1] = lla->cdf_keys[0] + 1;
+        lla->cdf_ranks[0] = 0;
+        lla->cdf_ranks[1] = 1;
+        m = 2;
+    }
+    lla->cdf_knots = m;
+    lla_set_predictor(lla, cdf_model_predict, lla, mix);
+}
+
+// Elements being laid out by mark_predicted_slots(): element e is keys[e], or x at rank when
+// insert_x is set and keys[e - 1] after it
+typedef struct predicted_layout {
+    lla *lla;
+    lla_predictor predictor;
+    void *ctx;
+    double mix;
+    const lla_key *keys;
+    int rank;
+    lla_key x;
+    int insert_x;
+    int word;
+    uint64_t bits;
+} predicted_layout;
+
+static double layout_cdf(predicted_layout *layout, int e)
+{
+    lla_key key = layout->insert_x && e == layout->rank ? layout->x : layout->keys[e - (layout->insert_x && e > layout->rank)];
+    return layout->predictor(layout->ctx, key);
+}
+
+// Predicted mass up to the gap between elements e - 1 and e, given the node's bounds lo/hi
+static double layout_split_cdf(predicted_layout *layout, int e, int first, int count, double lo, double hi)
+{
+    if (e == first)
+    {
+        return lo;
+    }
+    if (e == first + count)
+    {
+        return hi;
+    }
+    return (layout_cdf(layout, e - 1) + layout_cdf(layout, e)) / 2;
+}
+
+// Lay elements [first, first + count) out over node's window. A leaf spaces its elements evenly;
+// an inner node splits them between its children by predicted demand, see below.
+static void mark_predicted_node(predicted_layout *layout, int node, int first, int count, double lo, double hi)
+{
+    lla *lla = layout->lla;
+    int start = window_start(lla, node);
+    int len = window_end(lla, node) - start + 1;
+
+    if (count == 0)
+    {
+        return;
+    }
+
+    if (node_depth(node) == lla->MAX_DEPTH)
+    {
+        for (int i = 0; i < count; i++)
+        {
+            int slot = start + (int)((long long)i * len / count);
+            if ((slot >> 6) != layout->word)
+            {
+                lla->occupied[layout->word] |= layout->bits;
+                layout->word = slot >> 6;
+                layout->bits = 0;
+            }
+            layout->bits |= 1ULL << (slot & 63);
+        }
+        return;
+    }
+
+    lla_node *left = &lla->tree[2 * node];
+    lla_node *right = &lla->tree[2 * node + 1];
+
+    // What gets shared out is the children's slack: the inserts each can take before reaching its
+    // max_size. Under accurate predictions both then fill up at the same time.
+    int cap_left = left->max_size - 1;
+    int cap_right = right->max_size - 1;
+    int slack = cap_left + cap_right - count;
+    int lo_left = count - cap_right > 0 ? count - cap_right : 0;
+    int hi_left = cap_left < count ? cap_left : count;
+
+    if (slack < 0)
+    {
+        lo_left = hi_left = count / 2;
+    }
+    else if (layout->predictor != append_predict)
+    {
+        // Stay above the children's min_size when the count allows it. An append run packs the
+        // left child and leaves its sibling empty instead: a sibling kept at min_size would put
+        // keys up to the end of the array, and the run would respread the tail level by level.
+        int lo_min = lo_left > left->min_size ? lo_left : left->min_size;
+        int hi_min = hi_left < count - right->min_size ? hi_left : count - right->min_size;
+        if (lo_min <= hi_min)
+        {
+            lo_left = lo_min;
+            hi_left = hi_min;
+        }
+    }
+
+    // The left child's elements plus its share of the slack reach cap_left at the split, and that
+    // share only grows with the elements given to it, so binary search for the first such split
+    double mix = hi > lo ? layout->mix : 0;
+    double even = (1 - mix) * cap_left / (cap_left + cap_right > 0 ? cap_left + cap_right : 1);
+    int a = lo_left, b = hi_left;
+    while (a < b)
+    {
+        int mid = a + (b - a) / 2;
+        double share = even;
+        if (mix > 0)
+        {
+            share += mix * (layout_split_cdf(layout, first + mid, first, count, lo, hi) - lo) / (hi - lo);
+        }
+        if (mid + slack * share >= cap_left)
+        {
+            b = mid;
+        }
+        else
+        {
+            a = mid + 1;
+        }
+    }
+
+    double split = layout_split_cdf(layout, first + a, first, count, lo, hi);
+    split = split < lo ? lo : split > hi ? hi : split;
+    mark_predicted_node(layout, 2 * node, first, a, lo, split);
+    mark_predicted_node(layout, 2 * node + 1, first + a, count - a, split, hi);
+}
+
+// Predictor of an append run: no upcoming key falls among the stored ones
+double append_predict(void *ctx, lla_key key)
+{
+    (void)ctx;
+    (void)key;
+    return 0;
+}
+
+// Predicted layout for the elements that respread_range() and spread_elements() lay out over
+// node's window. The window's predicted mass runs from halfway to the nearest key outside it
+// (within one window length) to halfway to the nearest key on the other side, or to the ends
+// of the CDF. Element e still lands at or after start + e, as the in-place respread requires.
+void mark_predicted_slots(lla *lla, int node, const lla_key *keys, int count, int rank, lla_key x, int insert_x)
+{
+    int start = window_start(lla, node);
+    int end = window_end(lla, node);
+    int range_size = end - start + 1;
+    int capacity = lla->N * lla->C;
+    int total = count + (insert_x ? 1 : 0);
+
+    clear_slot_range(lla, start, end);
+    if (total == 0)
+    {
+        return;
+    }
+
+    // An append run overrides the predictor: every upcoming key is expected past the current
+    // maximum, so the slack goes to the tail and everything to its left is packed
+    predicted_layout layout = {lla, lla->predictor, lla->predictor_ctx, lla->predict_mix, keys, rank, x, insert_x, start >> 6, 0};
+    if (lla_append_mode(lla))
+    {
+        layout.predictor = append_predict;
+        layout.ctx = null;
+        layout.mix = 1;
+    }
+    int left = start > 0 ? prev_live_slot(lla, start > range_size ? start - range_size : 0, start - 1) : -1;
+    int right = end < capacity - 1 ? next_live_slot(lla, end + 1, end + range_size < capacity ? end + range_size : capacity - 1) : -1;
+    double first_cdf = layout_cdf(&layout, 0);
+    double last_cdf = layout_cdf(&layout, total - 1);
+    double lo = left == -1 ? 0 : (layout.predictor(layout.ctx, lla->arr[left]) + first_cdf) / 2;
+    double hi = right == -1 ? 1 : (layout.predictor(layout.ctx, lla->arr[right]) + last_cdf) / 2;
+
+    mark_predicted_node(&layout, node, 0, total, lo < first_cdf ? lo : first_cdf, hi > last_cdf ? hi : last_cdf);
+    lla->occupied[layout.word] |= layout.bits;
+}
+
+// Node whose window is exactly [start, end]
+int node_of_range(lla *lla, int start, int end)
+{
+    int node = leaf_of_slot(lla, start);
+    while (window_end(lla, node) < end)
+    {
+        node /= 2;
+    }
+    return node;
+}
+// ################# EOF PREDICTION FUNCTIONS ###################
+
+// ################# BEGIN BATCH FUNCTIONS ###################
+// Stable bottom-up merge sort of keys (and their values) using LLA_KEY_LESS.
+void sort_entries(lla_key *keys, lla_value *values, size_t n)
+{
+    if (n < 2)
+    {
+        return;
+    }
+
+    lla_key *key_buf = (lla_key *)malloc(n * sizeof(lla_key));
+    lla_value *value_buf = LLA_HAS_VALUES ? (lla_value *)malloc(n * sizeof(lla_value)) : null;
+    if (!key_buf || (LLA_HAS_VALUES && !value_buf))
+    {
+        printf("Malloc failed\n");
+        exit(1);
+    }
+
+    lla_key *src = keys, *dst = key_buf;
+    lla_value *src_values = values, *dst_values = value_buf;
+
+    for (size_t width = 1; width < n; width *= 2)
+    {
+        for (size_t lo = 0; lo < n; lo += 2 * width)
+        {
+            size_t mid = lo + width < n ? lo + width : n;
+            size_t hi = lo + 2 * width < n ? lo + 2 * width : n;
+            size_t i = lo, j = mid, k = lo;
+
+            while (k < hi)
+            {
+                size_t from = (j >= hi || (i < mid && !LLA_KEY_LESS(src[j], src[i]))) ? i++ : j++;
+                if (LLA_HAS_VALUES)
+                {
+                    dst_values[k] = src_values[from];
+                }
+                dst[k++] = src[from];
+            }
+        }
+
+        lla_key *swap = src;
+        src = dst;
+        dst = swap;
+        lla_value *swap_values = src_values;
+        src_values = dst_values;
+        dst_values = swap_values;
+    }
+
+    if (src != keys)
+    {
+        memcpy(keys, src, n * sizeof(lla_key));
+        if (LLA_HAS_VALUES)
+        {
+            memcpy(values, src_values, n * sizeof(lla_value));
+        }
+    }
+
+    free(key_buf);
+    free(value_buf);
+}
+
+// Merge the k sorted keys into node's window with a single gather and spread, then fix up the
+// counters of the subtree and of every ancestor.
+void merge_into_window(lla *lla, int node, const lla_key *keys, const lla_value *values, int k)
+{
+    int start = window_start(lla, node);
+    int end = window_end(lla, node);
+    int live = lla->tree[node].size;
+    int total = live + k;
+
+    reserve_scratch(lla, total);
+    lla_key *buf = lla->scratch;
+    lla_value *buf_values = lla->scratch_values;
+
+    // Park the window's elements at the back of the buffer, then merge forward: the write
+    // position never passes the read position of the parked run
+    lla_key none = {0};
+    lla_value none_value = {0};
+    gather_range(lla, start, end, buf + k, LLA_HAS_VALUES ? buf_values + k : null, none, none_value, 0);
+
+    int i = k, j = 0, out = 0;
+    while (j < k)
+    {
+        if (i < total && !LLA_KEY_LESS(keys[j], buf[i]))
+        {
+            if (LLA_HAS_VALUES)
+            {
+                buf_values[out] = buf_values[i];
+            }
+            buf[out++] = buf[i++];
+        }
+        else
+        {
+            if (LLA_HAS_VALUES)
+            {
+                buf_values[out] = values[j];
+            }
+            buf[out++] = keys[j++];
+        }
+    }
+
+    stripes_write_begin(lla, start, end);
+    persist_begin(lla, start, end);
+    spread_elements(lla, start, end - start + 1, buf, buf_values, total);
+    persist_end(lla);
+    stripes_write_end(lla, start, end);
+
+    if (node_depth(node) < lla->MAX_DEPTH)
+    {
+        recount_subtree(lla, node);
+    }
+    else
+    {
+        lla->tree[node].size = total;
+    }
+
+    for (int ancestor = node / 2; ancestor; ancestor /= 2)
+    {
+        lla->tree[ancestor].size += k;
+    }
+    update_first_keys(lla, node);
+    LLA_STAT(stats_rebalance(lla, LLA_REBALANCE_BATCH, node, total));
+}
+
+// Split the sorted run between node's children. When both children can absorb their share
+// without exceeding TAU_K, push the shares down; otherwise this window is the smallest one that
+// can take the whole run, so merge it here in one pass.
+void insert_batch_help(lla *lla, int node, const lla_key *keys, const lla_value *values, int k)
+{
+    if (k == 0)
+    {
+        return;
+    }
+
+    if (node_depth(node) == lla->MAX_DEPTH)
+    {
+        merge_into_window(lla, node, keys, values, k);
+        return;
+    }
+
+    int left = 2 * node;
+    int right = 2 * node + 1;
+    int first = first_live_slot(lla, right);
+
+    // Same routing rule as route_right(): keys not below the right child's first key go right
+    int split = k;
+    if (first != -1)
+    {
+        int lo = 0, hi = k;
+        while (lo < hi)
+        {
+            int mid = lo + (hi - lo) / 2;
+            if (LLA_KEY_LESS(keys[mid], lla->arr[first]))
+            {
+                lo = mid + 1;
+            }
+            else
+            {
+                hi = mid;
+            }
+        }
+        split = lo;
+    }
+
+    lla_node *tree = lla->tree;
+    if (tree[left].size + split <= tree[left].max_size && tree[right].size + (k - split) <= tree[right].max_size)
+    {
+        insert_batch_help(lla, left, keys, values, split);
+        insert_batch_help(lla, right, keys + split, LLA_HAS_VALUES ? values + split : null, k - split);
+    }
+    else
+    {
+        merge_into_window(lla, node, keys, values, k);
+    }
+}
+
+void lla_insert_batch(lla *lla, const lla_key *keys, size_t n)
+{
+    lla_insert_batch_values(lla, keys, null, n);
+}
+
+// Sort the batch, grow once if the root cannot take it, then distribute it top-down so every
+// affected window is respread exactly once. values may be NULL for zero-initialised payloads.
+void lla_insert_batch_values(lla *lla, const lla_key *keys, const lla_value *values, size_t n)
+{
+    if (lla->locks)
+    {
+        layout_lock_exclusive(lla);
+        insert_batch_entry(lla, keys, values, n);
+        layout_unlock_exclusive(lla);
+        return;
+    }
+    insert_batch_entry(lla, keys, values, n);
+}
+
+void insert_batch_entry(lla *lla, const lla_key *keys, const lla_value *values, size_t n)
+{
+    if (n == 0)
+    {
+        return;
+    }
+    lla->max_valid = 0;
+    lla->append_run = 0;
+
+    lla_key *sorted = (lla_key *)malloc(n * sizeof(lla_key));
+    lla_value *sorted_values = LLA_HAS_VALUES ? (lla_value *)calloc(n, sizeof(lla_value)) : null;
+    if (!sorted || (LLA_HAS_VALUES && !sorted_values))
+    {
+        printf("Malloc failed\n");
+        exit(1);
+    }
+    memcpy(sorted, keys, n * sizeof(lla_key));
+    if (LLA_HAS_VALUES && values)
+    {
+        memcpy(sorted_values, values, n * sizeof(lla_value));
+    }
+    sort_entries(sorted, sorted_values, n);
+
+    long long needed = (long long)lla->tree[ROOT].size + n;
+    int N = lla->N;
+    while (needed > lla->TAU_0 * N * lla->C)
+    {
+        N *= 2;
+    }
+    if (N != lla->N)
+    {
+        lla_resize(lla, N);
+    }
+
+    insert_batch_help(lla, ROOT, sorted, sorted_values, (int)n);
+
+    free(sorted);
+    free(sorted_values);
+}
+
+// Build an lla straight from n sorted keys: size N so the keys fill density of the N * C slots,
+// lay them out evenly in one pass and count the tree bottom-up. density <= 0 picks TAU_0 / 2,
+// the density right after a doubling. Unsorted input is sorted first.
+lla *lla_build_from_sorted(const lla_key *keys, size_t n, int C, double TAU_0, double TAU_D, double density)
+{
+    return lla_build_from_sorted_values(keys, null, n, C, TAU_0, TAU_D, density);
+}
+
+lla *lla_build_from_sorted_values(const lla_key *keys, const lla_value *values, size_t n, int C, double TAU_0, double TAU_D, double density)
+{
+    lla_policy policy = lla_policy_linear(C, TAU_0, TAU_D);
+    return lla_build_from_sorted_policy(keys, values, n, &policy, density);
+}
+
+lla *lla_build_from_sorted_policy(const lla_key *keys, const lla_value *values, size_t n, const lla_policy *policy, double density)
+{
+    int C = policy->C;
+    double TAU_0 = policy->TAU_0;
+    if (density <= 0 || density > TAU_0)
+    {
+        density = TAU_0 / 2;
+    }
+
+    long long N = (long long)(n / (density * C)) + 1;
+    if (N <= C)
+    {
+        N = C + 1;
+    }
+    if (N * C > INT32_MAX)
+    {
+        printf("Illegal size: %zu keys do not fit at density %.2f\n", n, density);
+        exit(1);
+    }
+
+    lla *my_lla = create_lla_with_policy((int)N, policy);
+
+    lla_key *sorted = null;
+    lla_value *sorted_values = null;
+    for (size_t i = 1; i < n; i++)
+    {
+        if (LLA_KEY_LESS(keys[i], keys[i - 1]))
+        {
+            sorted = (lla_key *)malloc(n * sizeof(lla_key));
+            sorted_values = LLA_HAS_VALUES ? (lla_value *)calloc(n, sizeof(lla_value)) : null;
+            if (!sorted || (LLA_HAS_VALUES && !sorted_values))
+            {
+                printf("Malloc failed\n");
+                exit(1);
+            }
+            memcpy(sorted, keys, n * sizeof(lla_key));
+            if (LLA_HAS_VALUES && values)
+            {
+                memcpy(sorted_values, values, n * sizeof(lla_value));
+            }
+            sort_entries(sorted, sorted_values, n);
+            keys = sorted;
+            values = sorted_values;
+            break;
+        }
+    }
+
+    lla_value *zero_values = null;
+    if (LLA_HAS_VALUES && !values)
+    {
+        zero_values = (lla_value *)calloc(n ? n : 1, sizeof(lla_value));
+        if (!zero_values)
+        {
+            printf("Malloc failed\n");
+            exit(1);
+        }
+        values = zero_values;
+    }
+
+    spread_elements(my_lla, 0, my_lla->N * C, keys, values, (int)n);
+    recount_subtree(my_lla, ROOT);
+
+    free(sorted);
+    free(sorted_values);
+    free(zero_values);
+    return my_lla;
+}
+// ################# EOF BATCH FUNCTIONS ###################
+
+// ################# BEGIN SEARCH FUNCTIONS ###################
+// First occupied slot in [from, to], or -1 if the range holds only gaps. Gaps are skipped a
+// whole occupancy word (64 slots) at a time.
+int next_live_slot(lla *lla, int from, int to)
+{
+    if (from > to)
+    {
+        return -1;
+    }
+
+    for (int w = from >> 6; w <= to >> 6; w++)
+    {
+        uint64_t bits = lla->occupied[w] & slot_range_mask(w, from, to);
+        if (bits)
+        {
+            return (w << 6) + __builtin_ctzll(bits);
+        }
+    }
+    return -1;
+}
+
+// Last occupied slot in [from, to], or -1 if the range holds only gaps.
+int prev_live_slot(lla *lla, int from, int to)
+{
+    if (from > to)
+    {
+        return -1;
+    }
+
+    for (int w = to >> 6; w >= from >> 6; w--)
+    {
+        uint64_t bits = lla->occupied[w] & slot_range_mask(w, from, to);
+        if (bits)
+        {
+            return (w << 6) + 63 - __builtin_clzll(bits);
+        }
+    }
+    return -1;
+}
+
+// First empty slot in [from, to], or -1 if every slot is taken.
+int next_free_slot(lla *lla, int from, int to)
+{
+    if (from > to)
+    {
+        return -1;
+    }
+
+    for (int w = from >> 6; w <= to >> 6; w++)
+    {
+        uint64_t bits = ~lla->occupied[w] & slot_range_mask(w, from, to);
+        if (bits)
+        {
+            return (w << 6) + __builtin_ctzll(bits);
+        }
+    }
+    return -1;
+}
+
+// Last empty slot in [from, to], or -1 if every slot is taken.
+int prev_free_slot(lla *lla, int from, int to)
+{
+    if (from > to)
+    {
+        return -1;
+    }
+
+    for (int w = to >> 6; w >= from >> 6; w--)
+    {
+        uint64_t bits = ~lla->occupied[w] & slot_range_mask(w, from, to);
+        if (bits)
+        {
+            return (w << 6) + 63 - __builtin_clzll(bits);
+        }
+    }
+    return -1;
+}
+
+// First occupied slot of node's window, or -1 when it is empty. Evenly spread windows have a
+// live slot right at their start, so probe one leaf's worth of slots before falling back to
+// following the leftmost non-empty child down to a leaf.
+int first_live_slot(lla *lla, int node)
+{
+    lla_node *tree = lla->tree;
+
+    if (tree[node].size == 0)
+    {
+        return -1;
+    }
+
+    int start = window_start(lla, node);
+    int end = window_end(lla, node);
+    int probe_end = start + lla->WINDOW_SIZE < end ? start + lla->WINDOW_SIZE : end;
+    int slot = next_live_slot(lla, start, probe_end);
+    if (slot != -1 || probe_end == end)
+    {
+        return slot;
+    }
+
+    while (node_depth(node) < lla->MAX_DEPTH)
+    {
+        node = tree[2 * node].size ? 2 * node : 2 * node + 1;
+    }
+    return next_live_slot(lla, window_start(lla, node), window_end(lla, node));
+}
+
+// Last occupied slot of node's window, or -1 when it is empty.
+int last_live_slot(lla *lla, int node)
+{
+    lla_node *tree = lla->tree;
+
+    if (tree[node].size == 0)
+    {
+        return -1;
+    }
+
+    while (node_depth(node) < lla->MAX_DEPTH)
+    {
+        node = tree[2 * node + 1].size ? 2 * node + 1 : 2 * node;
+    }
+    return prev_live_slot(lla, window_start(lla, node), window_end(lla, node));
+}
+
+// First occupied slot after the window of node, found through the nearest non-empty right
+// sibling of node or of one of its ancestors.
+int next_live_after(lla *lla, int node)
+{
+    for (; node > ROOT; node /= 2)
+    {
+        if (node % 2 == 0 && lla->tree[node + 1].size)
+        {
+            return first_live_slot(lla, node + 1);
+        }
+    }
+    return -1;
+}
+
+// Last occupied slot before the window of node.
+int prev_live_before(lla *lla, int node)
+{
+    for (; node > ROOT; node /= 2)
+    {
+        if (node % 2 == 1 && lla->tree[node - 1].size)
+        {
+            return last_live_slot(lla, node - 1);
+        }
+    }
+    return -1;
+}
+
+// Descend to the leaf whose window holds the boundary for x, comparing against the first key of
+// each right child. Every live key left of the returned window is < x (or <= x when strict is
+// set), so the answer to any ordered query is either inside the leaf or the first live slot after it.
+int search_descend(lla *lla, lla_key x, int strict)
+{
+    lla_node *tree = lla->tree;
+    int node = ROOT;
+
+    for (int depth = 0; depth < lla->MAX_DEPTH; depth++)
+    {
+        int right = 2 * node + 1;
+
+        if (tree[right].size && (strict ? !LLA_KEY_LESS(x, tree[right].first) : LLA_KEY_LESS(tree[right].first, x)))
+        { /* the whole left half is below x, so the boundary is on the right */
+            node = right;
+        }
+        else
+        {
+            node = 2 * node;
+        }
+    }
+
+    return node;
+}
+
+// Slot of the first key >= x (strict == 0) or > x (strict != 0), or -1.
+int search_bound(lla *lla, lla_key x, int strict)
+{
+    if (!lla || !lla->tree)
+    {
+        return -1;
+    }
+
+    lla_key *arr = lla->arr;
+    int leaf = search_descend(lla, x, strict);
+    int leaf_start = window_start(lla, leaf);
+    int leaf_end = window_end(lla, leaf);
+
+    for (int w = leaf_start >> 6; w <= leaf_end >> 6; w++)
+    {
+        uint64_t bits = lla->occupied[w] & slot_range_mask(w, leaf_start, leaf_end);
+
+        while (bits)
+        {
+            int i = (w << 6) + __builtin_ctzll(bits);
+            bits &= bits - 1;
+
+            if (strict ? LLA_KEY_LESS(x, arr[i]) : !LLA_KEY_LESS(arr[i], x))
+            {
+                return i;
+            }
+        }
+    }
+
+    return next_live_after(lla, leaf);
+}
+
+int lla_lower_bound(lla *lla, lla_key x)
+{
+    return search_bound(lla, x, 0);
+}
+
+int lla_find(lla *lla, lla_key x)
+{
+    int slot = search_bound(lla, x, 0);
+
+    // arr[slot] is the first key not below x, so it matches unless x is below it
+    if (slot != -1 && !LLA_KEY_LESS(x, lla->arr[slot]))
+    {
+        return slot;
+    }
+    return -1;
+}
+
+int lla_successor(lla *lla, lla_key x)
+{
+    return search_bound(lla, x, 1);
+}
+
+int lla_predecessor(lla *lla, lla_key x)
+{
+    if (!lla || !lla->tree)
+    {
+        return -1;
+    }
+
+    int slot = search_bound(lla, x, 0);
+    if (slot == -1)
+    {
+        return last_live_slot(lla, ROOT);
+    }
+
+    int leaf = leaf_of_slot(lla, slot);
+    int prev = prev_live_slot(lla, window_start(lla, leaf), slot - 1);
+    if (prev != -1)
+    {
+        return prev;
+    }
+    return prev_live_before(lla, leaf);
+}
+// ################# EOF SEARCH FUNCTIONS ###################
+
+// ################# BEGIN RANGE SCAN FUNCTIONS ###################
+void lla_iter_seek(lla *lla, lla_iter *it, lla_key lo)
+{
+    it->lla = lla;
+    int slot = lla_lower_bound(lla, lo);
+    it->slot = slot == -1 ? lla->N * lla->C : slot;
+}
+
+int lla_iter_next(lla_iter *it)
+{
+    int capacity = it->lla->N * it->lla->C;
+    int slot = next_live_slot(it->lla, it->slot, capacity - 1);
+    if (slot == -1)
+    {
+        it->slot = capacity;
+        return -1;
+    }
+
+    it->slot = slot + 1;
+    return slot;
+}
+
+// Copy up to cap keys <= hi (and their values when out_values is not NULL) from the iterator into
+// out, returning how many were copied. The scan works one occupancy word at a time: gaps cost one
+// bit test per 64 slots and, for 32-bit keys, the live keys of a word are left-packed into out by
+// the SIMD kernel. Once a key > hi is seen the iterator is exhausted.
+size_t lla_iter_fill(lla_iter *it, lla_key hi, lla_key *out, lla_value *out_values, size_t cap)
+{
+    lla *lla = it->lla;
+    int capacity = lla->N * lla->C;
+    int use_simd = sizeof(lla_key) == sizeof(uint32_t) && !(LLA_HAS_VALUES && out_values);
+    size_t count = 0;
+
+    while (it->slot < capacity && count < cap)
+    {
+        int w = it->slot >> 6;
+        uint64_t bits = lla->occupied[w] & (~0ULL << (it->slot & 63));
+        size_t first = count;
+        int next = (w + 1) << 6;
+
+        if (use_simd && count + __builtin_popcountll(bits) <= cap)
+        {
+            count += lla_compact64((const uint32_t *)(lla->arr + (w << 6)), bits, (uint32_t *)(out + count));
+        }
+        else
+        {
+            while (bits && count < cap)
+            {
+                int slot = (w << 6) + __builtin_ctzll(bits);
+                out[count] = lla->arr[slot];
+                if (LLA_HAS_VALUES && out_values)
+                {
+                    out_values[count] = lla->values[slot];
+                }
+                count++;
+                bits &= bits - 1;
+            }
+            if (bits)
+            {
+                next = (w << 6) + __builtin_ctzll(bits);
+            }
+        }
+        it->slot = next < capacity ? next : capacity;
+
+        // Keys are sorted, so only the last key of the word needs checking against hi
+        if (count > first && LLA_KEY_LESS(hi, out[count - 1]))
+        {
+            while (count > first && LLA_KEY_LESS(hi, out[count - 1]))
+            {
+                count--;
+            }
+            it->slot = capacity;
+        }
+    }
+    return count;
+}
+
+// Visit every key in [lo, hi] in sorted order, handing them to fn in chunks of up to cap keys
+// staged in out. Without fn only the first chunk is produced. Returns the number of keys visited.
+size_t lla_scan_range(lla *lla, lla_key lo, lla_key hi, lla_key *out, size_t cap, lla_scan_fn fn, void *ctx)
+{
+    if (!lla || !lla->tree || cap == 0)
+    {
+        return 0;
+    }
+
+    lla_iter it;
+    size_t total = 0;
+    lla_iter_seek(lla, &it, lo);
+    for (;;)
+    {
+        size_t count = lla_iter_fill(&it, hi, out, null, cap);
+        total += count;
+        if (fn && count)
+        {
+            fn(ctx, out, count);
+        }
+        if (!fn || count < cap)
+        {
+            break;
+        }
+    }
+    return total;
+}
+// ################# EOF RANGE SCAN FUNCTIONS ###################
+
+// ################# BEGIN CONCURRENT READ FUNCTIONS ###################
+// Readers never lock and never write to the lla. A read runs optimistically on a snapshot of the
+// layout and then proves its answer: it reads the keys it returns together with the live key just
+// before them, under the versions of every stripe those slots (and the gaps between them) are in.
+// If all those versions are unchanged afterwards, the keys were adjacent in one consistent state
+// and the answer holds, whatever the optimistic search saw on the way. Resizes move everything, so
+// they flip the generation seqlock instead, and replaced arrays are freed only once every read
+// that could still see them has ended (lla_synchronize()).
+lla_reader *lla_reader_register(lla *lla)
+{
+    for (int i = 0; i < LLA_MAX_READERS; i++)
+    {
+        lla_reader *reader = &lla->readers[i];
+        int expected = 0;
+        if (atomic_compare_exchange_strong(&reader->used, &expected, 1))
+        {
+            reader->lla = lla;
+            reader->seen_count = 0;
+            reader->seen_cap = 16;
+            reader->seen_stripes = (int *)malloc(sizeof(int) * reader->seen_cap);
+            reader->seen_versions = (uint64_t *)malloc(sizeof(uint64_t) * reader->seen_cap);
+            if (!reader->seen_stripes || !reader->seen_versions)
+            {
+                printf("Malloc failed\n");
+                exit(1);
+            }
+            return reader;
+        }
+    }
+    return null;
+}
+
+void lla_reader_unregister(lla_reader *reader)
+{
+    if (!reader)
+    {
+        return;
+    }
+    free(reader->seen_stripes);
+    free(reader->seen_versions);
+    reader->seen_stripes = null;
+    reader->seen_versions = null;
+    atomic_store(&reader->used, 0);
+}
+
+void lla_synchronize(lla *lla)
+{
+    uint64_t target = atomic_fetch_add(&lla->epoch, 1) + 1;
+    atomic_thread_fence(memory_order_seq_cst);
+
+    for (int i = 0; i < LLA_MAX_READERS; i++)
+    {
+        for (;;)
+        {
+            uint64_t seen = atomic_load(&lla->readers[i].epoch);
+            if (seen == 0 || seen >= target)
+            {
+                break;
+            }
+            sched_yield();
+        }
+    }
+}
+
+static void read_enter(lla_reader *reader)
+{
+    atomic_store(&reader->epoch, atomic_load(&reader->lla->epoch));
+    // Pairs with the fence in lla_synchronize(): either the writer sees this reader, or this
+    // reader sees the arrays the writer published before bumping the epoch
+    atomic_thread_fence(memory_order_seq_cst);
+}
+
+static void read_exit(lla_reader *reader)
+{
+    atomic_store_explicit(&reader->epoch, 0, memory_order_release);
+}
+
+// Copy the layout into snap under the generation seqlock. Returns the generation, which is even.
+static uint32_t read_snapshot(lla *lla, struct lla *snap)
+{
+    for (;;)
+    {
+        uint32_t generation = atomic_load_explicit(&lla->generation, memory_order_acquire);
+        if (generation & 1)
+        {
+            sched_yield();
+            continue;
+        }
+
+        snap->tree = lla->tree;
+        snap->arr = lla->arr;
+        snap->values = lla->values;
+        snap->occupied = lla->occupied;
+        snap->versions = lla->versions;
+        snap->N = lla->N;
+        snap->C = lla->C;
+        snap->MAX_DEPTH = lla->MAX_DEPTH;
+        snap->WINDOW_SIZE = lla->WINDOW_SIZE;
+
+        atomic_thread_fence(memory_order_acquire);
+        if (atomic_load_explicit(&lla->generation, memory_order_relaxed) == generation)
+        {
+            return generation;
+        }
+    }
+}
+
+// Note the version of stripe before reading any of its slots. Returns 0 when the writer is in it.
+static int read_stripe(lla_reader *reader, struct lla *snap, int stripe)
+{
+    uint64_t version = atomic_load_explicit(&snap->versions[stripe], memory_order_acquire);
+    if ((uint32_t)version)
+    {
+        return 0;
+    }
+
+    if (reader->seen_count == reader->seen_cap)
+    {
+        reader->seen_cap *= 2;
+        reader->seen_stripes = (int *)realloc(reader->seen_stripes, sizeof(int) * reader->seen_cap);
+        reader->seen_versions = (uint64_t *)realloc(reader->seen_versions, sizeof(uint64_t) * reader->seen_cap);
+        if (!reader->seen_stripes || !reader->seen_versions)
+        {
+            printf("Malloc failed\n");
+            exit(1);
+        }
+    }
+    reader->seen_stripes[reader->seen_count] = stripe;
+    reader->seen_versions[reader->seen_count] = version;
+    reader->seen_count++;
+    return 1;
+}
+
+// 1 when no stripe read by this attempt, and not the layout, changed since it was first read
+static int read_validate(lla_reader *reader, struct lla *snap, uint32_t generation)
+{
+    atomic_thread_fence(memory_order_acquire);
+    for (int i = 0; i < reader->seen_count; i++)
+    {
+        if (atomic_load_explicit(&snap->versions[reader->seen_stripes[i]], memory_order_relaxed) != reader->seen_versions[i])
+        {
+            return 0;
+        }
+    }
+    return atomic_load_explicit(&reader->lla->generation, memory_order_relaxed) == generation;
+}
+
+// One attempt at copying up to cap keys >= lo (and <= hi when bounded), skipping the first skip
+// keys equal to lo. Returns -1 when the attempt has to be retried, otherwise the number of keys.
+static long read_attempt(lla_reader *reader, lla_key lo, lla_key hi, int bounded, size_t skip, lla_key *out, lla_value *out_values, size_t cap)
+{
+    struct lla snap;
+    uint32_t generation = read_snapshot(reader->lla, &snap);
+    int capacity = snap.N * snap.C;
+    int shift = LLA_STRIPE_SHIFT - 6; // stripes are whole bitmap words
+    reader->seen_count = 0;
+
+    // Optimistic guess of the first slot >= lo, proven or refuted below
+    int first = search_bound(&snap, lo, 0);
+    if (first == -1)
+    {
+        first = capacity;
+    }
+
+    // Backwards from the guess to the live key before it, which must be < lo
+    int w = (first < capacity ? first : capacity - 1) >> 6;
+    int stripe = w >> shift;
+    int top_stripe = stripe;
+    if (!read_stripe(reader, &snap, stripe))
+    {
+        return -1;
+    }
+    int prev = -1;
+    for (w = (first - 1) >> 6; first > 0 && w >= 0; w--)
+    {
+        if (w >> shift != stripe)
+        {
+            stripe = w >> shift;
+            if (!read_stripe(reader, &snap, stripe))
+            {
+                return -1;
+            }
+        }
+        uint64_t bits = snap.occupied[w];
+        if (w == (first - 1) >> 6 && ((first - 1) & 63) != 63)
+        {
+            bits &= (2ULL << ((first - 1) & 63)) - 1;
+        }
+        if (bits)
+        {
+            prev = (w << 6) + 63 - __builtin_clzll(bits);
+            break;
+        }
+    }
+    if (prev != -1 && !LLA_KEY_LESS(snap.arr[prev], lo))
+    {
+        return -1;
+    }
+
+    // Forwards from there, copying keys until one is past hi or cap are copied
+    size_t count = 0, skipped = 0;
+    int done = 0;
+    for (w = (prev + 1) >> 6; !done && count < cap && (w << 6) < capacity; w++)
+    {
+        if (w >> shift > top_stripe)
+        {
+            top_stripe = w >> shift;
+            if (!read_stripe(reader, &snap, top_stripe))
+            {
+                return -1;
+            }
+        }
+        uint64_t bits = snap.occupied[w];
+        if (w == (prev + 1) >> 6)
+        {
+            bits &= ~0ULL << ((prev + 1) & 63);
+        }
+        while (bits && count < cap)
+        {
+            int slot = (w << 6) + __builtin_ctzll(bits);
+            bits &= bits - 1;
+            lla_key key = snap.arr[slot];
+            if (LLA_KEY_LESS(key, lo) || (bounded && LLA_KEY_LESS(hi, key)))
+            {
+                // Below lo means the attempt saw a torn state, past hi ends the range
+                if (LLA_KEY_LESS(key, lo))
+                {
+                    return -1;
+                }
+                done = 1;
+                break;
+            }
+            if (skipped < skip && !LLA_KEY_LESS(lo, key))
+            {
+                skipped++;
+                continue;
+            }
+            out[count] = key;
+            if (LLA_HAS_VALUES && out_values)
+            {
+                out_values[count] = snap.values[slot];
+            }
+            count++;
+        }
+    }
+
+    return read_validate(reader, &snap, generation) ? (long)count : -1;
+}
+
+static size_t read_range(lla_reader *reader, lla_key lo, lla_key hi, int bounded, size_t skip, lla_key *out, lla_value *out_values, size_t cap)
+{
+    long count;
+    read_enter(reader);
+    while ((count = read_attempt(reader, lo, hi, bounded, skip, out, out_values, cap)) < 0)
+    {
+        // The writer is moving these slots, let it finish
+        sched_yield();
+    }
+    read_exit(reader);
+    return (size_t)count;
+}
+
+int lla_read_find(lla_reader *reader, lla_key x, lla_value *value_out)
+{
+    lla_key key;
+    return read_range(reader, x, x, 1, 0, &key, value_out, 1) == 1;
+}
+
+int lla_read_lower_bound(lla_reader *reader, lla_key x, lla_key *key_out, lla_value *value_out)
+{
+    lla_key key;
+    int found = read_range(reader, x, x, 0, 0, &key, value_out, 1) == 1;
+    if (found && key_out)
+    {
+        *key_out = key;
+    }
+    return found;
+}
+
+// Up to cap keys of [lo, hi] as of one instant.
+size_t lla_read_range(lla_reader *reader, lla_key lo, lla_key hi, lla_key *out, lla_value *out_values, size_t cap)
+{
+    if (cap == 0)
+    {
+        return 0;
+    }
+    return read_range(reader, lo, hi, 1, 0, out, out_values, cap);
+}
+
+// Stream [lo, hi] to fn in chunks of up to cap keys. Each chunk is read as of one instant and the
+// next one resumes after the last key handed out, so the writer is never held up for a whole scan.
+// Returns the number of keys visited.
+size_t lla_read_scan(lla_reader *reader, lla_key lo, lla_key hi, lla_key *out, size_t cap, lla_scan_fn fn, void *ctx)
+{
+    if (cap == 0)
+    {
+        return 0;
+    }
+
+    size_t total = 0, skip = 0;
+    for (;;)
+    {
+        size_t count = read_range(reader, lo, hi, 1, skip, out, null, cap);
+        total += count;
+        if (fn && count)
+        {
+            fn(ctx, out, count);
+        }
+        if (!fn || count < cap)
+        {
+            break;
+        }
+
+        // Resume at the last key, past the copies of it already handed out
+        size_t equal = 0;
+        while (equal < count && !LLA_KEY_LESS(out[count - 1 - equal], out[count - 1]))
+        {
+            equal++;
+        }
+        skip = equal == count && !LLA_KEY_LESS(lo, out[0]) ? skip + count : equal;
+        lo = out[count - 1];
+    }
+    return total;
+}
+// ################# EOF CONCURRENT READ FUNCTIONS ###################
+
+// ################# BEGIN CONCURRENT WRITE FUNCTIONS ###################
+// Once lla_enable_concurrent_writers() has run, any number of threads may insert at the same time.
+// The tree is cut at lock_depth: every node down to it has a lock, a node at lock_depth guards the
+// whole subtree below it, and the nodes above only route. An insert walks down hand over hand,
+// holding one routing lock at a time, and then inserts with the lock of its subtree held, so
+// inserts into different subtrees run in parallel. Routing reads no keys of other subtrees: each
+// routing node caches the smallest key sent right and the largest sent left, updated under its
+// lock, which keeps keys sent left below keys sent right whatever is in flight. Counters above
+// lock_depth count an insert when it passes. A respread wider than a subtree, a resize, a delete
+// or a batch takes the layout lock exclusively, once every insert in flight has left.
+static void node_lock(lla *lla, int node)
+{
+    atomic_int *lock = &lla->locks[node];
+    while (atomic_exchange_explicit(lock, 1, memory_order_acquire))
+    {
+        while (atomic_load_explicit(lock, memory_order_relaxed))
+        {
+            sched_yield();
+        }
+    }
+}
+
+static void node_unlock(lla *lla, int node)
+{
+    atomic_store_explicit(&lla->locks[node], 0, memory_order_release);
+}
+
+// Shared side of the layout lock, held by every insert. A waiting exclusive holder keeps new
+// inserts out, so escalations are not starved.
+static void layout_lock_shared(lla *lla)
+{
+    for (;;)
+    {
+        while (atomic_load(&lla->layout_waiting))
+        {
+            sched_yield();
+        }
+        atomic_fetch_add(&lla->layout_shared, 1);
+        if (!atomic_load(&lla->layout_waiting))
+        {
+            return;
+        }
+        atomic_fetch_sub(&lla->layout_shared, 1);
+    }
+}
+
+static void layout_unlock_shared(lla *lla)
+{
+    atomic_fetch_sub_explicit(&lla->layout_shared, 1, memory_order_release);
+}
+
+void layout_lock_exclusive(lla *lla)
+{
+    int expected = 0;
+    while (!atomic_compare_exchange_weak(&lla->layout_waiting, &expected, 1))
+    {
+        expected = 0;
+        sched_yield();
+    }
+    while (atomic_load(&lla->layout_shared))
+    {
+        sched_yield();
+    }
+}
+
+// Writes under the exclusive lock may move keys between subtrees and resize the tree, so the
+// routing caches that can see the changed windows are rebuilt from the array before inserts
+// resume: those of the ancestors of route_dirty and of the routing nodes inside it. A resize
+// dirties the root and rebuilds them all.
+void layout_unlock_exclusive(lla *lla)
+{
+    int dirty = lla->route_dirty;
+    int lock_depth = lla->MAX_DEPTH < lla->lock_target ? lla->MAX_DEPTH : lla->lock_target;
+
+    if (dirty == ROOT || lock_depth != lla->lock_depth)
+    {
+        build_routing(lla);
+    }
+    else if (dirty)
+    {
+        for (int node = dirty / 2; node; node /= 2)
+        {
+            if (node_depth(node) < lock_depth)
+            {
+                build_routing_node(lla, node);
+            }
+        }
+        for (int first = dirty, last = dirty; node_depth(first) < lock_depth; first *= 2, last = 2 * last + 1)
+        {
+            for (int node = first; node <= last; node++)
+            {
+                build_routing_node(lla, node);
+            }
+        }
+    }
+    lla->route_dirty = 0;
+    atomic_store(&lla->layout_waiting, 0);
+}
+
+// Smallest N' >= N for which N' * C is a multiple of 64 << lock_target. The windows of the locked
+// subtrees then start on occupancy words, so two writers never modify the same word.
+int lock_aligned_n(lla *lla, int N)
+{
+    int unit = 64 << lla->lock_target;
+    int a = unit, b = lla->C;
+    while (b)
+    {
+        int r = a % b;
+        a = b;
+        b = r;
+    }
+    int step = unit / a; // unit / gcd(unit, C)
+    return (N + step - 1) / step * step;
+}
+
+// Pick the lock depth for the current tree and fill the routing caches from the array. The locks
+// and caches are sized for LLA_LOCK_DEPTH once and never reallocated, so writers may read the
+// pointers without holding the layout lock.
+void build_routing(lla *lla)
+{
+    int lock_depth = lla->MAX_DEPTH < lla->lock_target ? lla->MAX_DEPTH : lla->lock_target;
+    lla->lock_depth = lock_depth;
+
+    for (int node = ROOT; node < 1 << lock_depth; node++)
+    {
+        build_routing_node(lla, node);
+    }
+}
+
+// Routing caches of one node: the right child's first key and the left child's last one
+void build_routing_node(lla *lla, int node)
+{
+    lla_node *right = &lla->tree[2 * node + 1];
+    int last = last_live_slot(lla, 2 * node);
+    int has_right = __atomic_load_n(&right->size, __ATOMIC_RELAXED) > 0;
+
+    lla->route_flags[node] = (has_right ? ROUTE_RIGHT_MIN : 0) | (last != -1 ? ROUTE_LEFT_MAX : 0);
+    if (has_right)
+    {
+        lla->route_right_min[node] = right->first;
+    }
+    if (last != -1)
+    {
+        lla->route_left_max[node] = lla->arr[last];
+    }
+}
+
+// Must run before the writer threads start: they read lla->locks to pick the concurrent path.
+// The tree is cut into LLA_LOCKS_PER_CPU subtrees per online CPU, up to LLA_LOCK_DEPTH, and the
+// array grows to the next size whose subtrees start on occupancy words.
+void lla_enable_concurrent_writers(lla *lla)
+{
+    if (lla->locks)
+    {
+        return;
+    }
+    if (lla->persist)
+    {
+        printf("Concurrent writers are not supported on a mapped lla\n");
+        return;
+    }
+    grow_finish(lla); // writers in parallel would mirror into the doubled arrays at once
+
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    lla->lock_target = 0;
+    while (lla->lock_target < LLA_LOCK_DEPTH && (1L << lla->lock_target) < (cpus > 1 ? cpus : 1) * LLA_LOCKS_PER_CPU)
+    {
+        lla->lock_target++;
+    }
+    int N = lock_aligned_n(lla, lla->N);
+    if (N != lla->N)
+    {
+        lla_resize(lla, N);
+    }
+
+    // Append runs track the maximum across all inserts, which concurrent writers do not share
+    lla->append_run = 0;
+    lla->max_valid = 0;
+    lla_simd_level();
+    atomic_init(&lla->layout_shared, 0);
+    atomic_init(&lla->layout_waiting, 0);
+
+    lla->route_right_min = (lla_key *)malloc(sizeof(lla_key) << LLA_LOCK_DEPTH);
+    lla->route_left_max = (lla_key *)malloc(sizeof(lla_key) << LLA_LOCK_DEPTH);
+    lla->route_flags = (unsigned char *)malloc(1 << LLA_LOCK_DEPTH);
+    atomic_int *locks = (atomic_int *)calloc(2 << LLA_LOCK_DEPTH, sizeof(atomic_int));
+    if (!locks || !lla->route_right_min || !lla->route_left_max || !lla->route_flags)
+    {
+        printf("Malloc failed\n");
+        exit(1);
+    }
+    build_routing(lla);
+    lla->locks = locks;
+}
+
+// route_right() for a routing node, from its caches instead of the keys. Called with node locked.
+static int route_right_cached(lla *lla, int node, lla_key x)
+{
+    unsigned char flags = lla->route_flags[node];
+    int right;
+
+    if (flags & ROUTE_RIGHT_MIN)
+    {
+        right = !LLA_KEY_LESS(x, lla->route_right_min[node]);
+    }
+    else
+    {
+        // Nothing went right yet: same rule as for an empty right child in route_right()
+        lla_node *left = &lla->tree[2 * node];
+        right = __atomic_load_n(&left->size, __ATOMIC_RELAXED) >= left->max_size - 1 &&
+                (!(flags & ROUTE_LEFT_MAX) || !LLA_KEY_LESS(x, lla->route_left_max[node]));
+    }
+
+    if (right && (!(flags & ROUTE_RIGHT_MIN) || LLA_KEY_LESS(x, lla->route_right_min[node])))
+    {
+        lla->route_right_min[node] = x;
+        lla->route_flags[node] |= ROUTE_RIGHT_MIN;
+    }
+    if (!right && (!(flags & ROUTE_LEFT_MAX) || LLA_KEY_LESS(lla->route_left_max[node], x)))
+    {
+        lla->route_left_max[node] = x;
+        lla->route_flags[node] |= ROUTE_LEFT_MAX;
+    }
+    return right;
+}
+
+void insert_concurrent(lla *lla, lla_key x, lla_value x_value)
+{
+    lla_node *tree;
+    int node = ROOT;
+    int placed = 0;
+
+    layout_lock_shared(lla);
+    tree = lla->tree;
+    node_lock(lla, ROOT);
+    for (int depth = 0; depth < lla->lock_depth; depth++)
+    {
+        if (__atomic_load_n(&tree[node].size, __ATOMIC_RELAXED) >= tree[node].max_size)
+        {
+            break;
+        }
+        if (!__atomic_fetch_add(&tree[node].size, 1, __ATOMIC_RELAXED) || LLA_KEY_LESS(x, tree[node].first))
+        {
+            tree[node].first = x;
+        }
+
+        int child = 2 * node + route_right_cached(lla, node, x);
+        node_lock(lla, child);
+        node_unlock(lla, node);
+        node = child;
+    }
+
+    // node is the subtree x belongs to, unless a routing node on the way was full
+    if (node_depth(node) == lla->lock_depth && tree[node].size < tree[node].max_size)
+    {
+        int target = insert_descend(lla, node, x);
+        int start = window_start(lla, target);
+        int end = window_end(lla, target);
+
+        stripes_write_begin(lla, start, end);
+        int shifted = node_depth(target) == lla->MAX_DEPTH && insert_local_shift(lla, target, x, x_value);
+        if (!shifted)
+        {
+            insert_and_distribute_array_range_optimized(lla, start, end, x, x_value);
+        }
+        stripes_write_end(lla, start, end);
+
+        // insert_commit() up to the subtree root, whose counter the routing nodes above may read.
+        // Their caches took x on the way down, so nothing is left to rebuild.
+        if (node_depth(target) < lla->MAX_DEPTH)
+        {
+            recount_node(lla, target);
+        }
+        else
+        {
+            tree[target].size++;
+        }
+        for (int ancestor = target / 2; ancestor > node; ancestor /= 2)
+        {
+            tree[ancestor].size++;
+        }
+        if (target != node)
+        {
+            __atomic_fetch_add(&tree[node].size, 1, __ATOMIC_RELAXED);
+        }
+        for (int ancestor = target; ancestor >= node; ancestor /= 2)
+        {
+            refresh_first_key(lla, ancestor);
+        }
+        placed = 1;
+        LLA_STAT(stats_insert(lla, node_depth(target) == lla->MAX_DEPTH));
+        LLA_STAT(if (!shifted) stats_rebalance(lla, LLA_REBALANCE_INSERT, target, tree[target].size));
+    }
+    node_unlock(lla, node);
+
+    if (!placed)
+    {
+        // Uncount x above node, then respread the wider window with every other writer out
+        for (int ancestor = node / 2; ancestor; ancestor /= 2)
+        {
+            __atomic_fetch_sub(&tree[ancestor].size, 1, __ATOMIC_RELAXED);
+        }
+    }
+    layout_unlock_shared(lla);
+
+    if (!placed)
+    {
+        layout_lock_exclusive(lla);
+        insert_entry(lla, x, x_value);
+        // The routing nodes passed on the way took x as their first key, which holds only if x
+        // landed below them
+        update_first_keys(lla, node / 2);
+        layout_unlock_exclusive(lla);
+    }
+}
+// ################# EOF CONCURRENT WRITE FUNCTIONS ###################
+
+// ################# BEGIN DEAMORTIZED FUNCTIONS ###################
+// With lla_set_deamortized(lla, max_moves), a respread of more than max_moves elements is not run
+// on the spot. It becomes a rebalance job, and each later insert or delete does up to max_moves of
+// its element moves (lla_rebalance_step() does the same from a background loop). The job moves
+// elements to an even layout one at a time, always into a free slot with no live key in between,
+// so after every move the array is sorted, the bitmap is exact and the counters are updated: every
+// lookup stays correct mid-job. Keys inserted meanwhile are placed with at most max_moves moves
+// and the job adapts, since it recomputes ranks from the counters instead of remembering them.
+// A window that needs a respread while another job runs takes over, and the job it pushed aside
+// waits on a pending list with its cursor, so no request is dropped. Doubling the array is done in
+// steps the same way, see grow_step().
+enum { JOB_SCAN, JOB_FIND_RUN, JOB_MOVE_RUN };
+
+// max_moves below min_budget() is raised to it. Turning the mode off is the one call without a
+// bound: it finishes the pending jobs and the growth of the array, in steps of the old budget.
+void lla_set_deamortized(lla *lla, int max_moves)
+{
+    if (max_moves <= 0)
+    {
+        while (lla->job_node)
+        {
+            rebalance_step(lla, lla->job_budget);
+        }
+        grow_finish(lla);
+        lla->job_budget = 0;
+        return;
+    }
+    lla->job_budget = max_moves > min_budget(lla) ? max_moves : min_budget(lla);
+}
+
+int lla_rebalance_step(lla *lla)
+{
+    // Jobs and growth only start in the mode, and turning it off finishes them
+    assert(lla->job_budget || (!lla->job_node && !lla->grow));
+    return lla->job_budget ? carry_work(lla, lla->job_budget) : 0;
+}
+
+// Spend up to budget moves on the pending work: the rebalance job, then the copy of a growing
+// array. While the array grows the job's moves are mirrored, so it gets half the budget in moves,
+// and none once the root is past its threshold, when only the doubled array makes room. Building
+// the doubled tree moves nothing and goes on when the job has used up the moves, otherwise a job
+// kept busy would hold off the swap that relieves it. Returns 1 while work is left.
+int carry_work(lla *lla, int budget)
+{
+    if (lla->job_node && budget > 0 && !(lla->grow && lla->tree[ROOT].size >= lla->tree[ROOT].max_size))
+    {
+        long long before = lla->moved;
+        rebalance_step(lla, move_limit(lla, budget));
+        budget -= (int)(lla->moved - before);
+    }
+    if (lla->grow && (budget > 0 || lla->grow_cursor == lla->N * lla->C))
+    {
+        grow_step(lla, budget > 0 ? budget : lla->job_budget);
+    }
+    return lla->job_node || lla->grow;
+}
+
+// Start the job for a window before it fills up: the first node on x's path that is within a
+// sixteenth of its upper threshold has its parent respread through a job, while the room left
+// takes the inserts that keep coming. Left until the node is full, the job would start with no
+// room for them.
+void anticipate_rebalance(lla *lla, lla_key x)
+{
+    int node = ROOT;
+    while (lla->tree[node].size < lla->tree[node].max_size - lla->tree[node].max_size / 16)
+    {
+        if (node_depth(node) == lla->MAX_DEPTH)
+        {
+            return;
+        }
+        node = 2 * node + route_right(lla, node, x);
+    }
+    if (node != ROOT && lla->tree[node / 2].size >= move_limit(lla, lla->job_budget))
+    {
+        schedule_rebalance(lla, node / 2);
+    }
+}
+
+// Live keys in slots [0, slot), from the counters of the path down to slot's leaf.
+int live_before(lla *lla, int slot)
+{
+    int count = 0;
+    int node = ROOT;
+
+    while (node_depth(node) < lla->MAX_DEPTH)
+    {
+        if (slot > window_end(lla, 2 * node))
+        {
+            count += lla->tree[2 * node].size;
+            node = 2 * node + 1;
+        }
+        else
+        {
+            node = 2 * node;
+        }
+    }
+    int start = window_start(lla, node);
+    return slot > start ? count + count_live_slots(lla, start, slot - 1) : count;
+}
+
+// Start the job on node's window with the elements left of cursor taken as in place.
+static void start_job(lla *lla, int node, int cursor)
+{
+    int start = window_start(lla, node);
+    int end = window_end(lla, node);
+    int range_size = end - start + 1;
+    int count = lla->tree[node].size;
+
+    // Plan for the inserts that land in the window while the job runs, at most one per step. The
+    // steps make half the moves while the array grows, so twice as many inserts may land.
+    long long total = (long long)count + 2 * count / lla->job_budget + 2;
+    lla->job_node = node;
+    lla->job_start = start;
+    lla->job_end = end;
+    lla->job_total = total < range_size ? (int)total : range_size;
+    lla->job_append = lla_append_mode(lla) && next_live_after(lla, node) == -1;
+    lla->job_mode = JOB_SCAN;
+    lla->job_cursor = cursor > start ? cursor : start;
+    LLA_STAT(lla->job_moved = 0);
+}
+
+// 1 if other's window lies inside node's.
+static int covers(int node, int other)
+{
+    return node_depth(other) >= node_depth(node) && other >> (node_depth(other) - node_depth(node)) == node;
+}
+
+// Put the job on node onto the pending list, to resume at cursor.
+static void push_job(lla *lla, int node, int cursor)
+{
+    if (lla->job_queued == lla->job_queue_cap)
+    {
+        lla->job_queue_cap = lla->job_queue_cap ? 2 * lla->job_queue_cap : 16;
+        lla->job_queue = (int *)realloc(lla->job_queue, 2 * sizeof(int) * lla->job_queue_cap);
+        if (!lla->job_queue)
+        {
+            printf("Malloc failed\n");
+            exit(1);
+        }
+    }
+    lla->job_queue[2 * lla->job_queued] = node;
+    lla->job_queue[2 * lla->job_queued + 1] = cursor;
+    lla->job_queued++;
+}
+
+// Respread node's window through a job. A job running below node is superseded. Any other running
+// job, even one above node, is put on the pending list with its cursor and resumes once node's job
+// is done: the latest window to need a respread is the one inserts are crowding now, so it goes
+// first.
+void schedule_rebalance(lla *lla, int node)
+{
+    int job = lla->job_node;
+    if (job == node)
+    {
+        return;
+    }
+
+    // Jobs inside node's window are done by node's
+    int kept = 0;
+    for (int i = 0; i < lla->job_queued; i++)
+    {
+        if (!covers(node, lla->job_queue[2 * i]))
+        {
+            lla->job_queue[2 * kept] = lla->job_queue[2 * i];
+            lla->job_queue[2 * kept + 1] = lla->job_queue[2 * i + 1];
+            kept++;
+        }
+    }
+    lla->job_queued = kept;
+
+    if (job && !covers(node, job))
+    {
+        push_job(lla, job, lla->job_mode == JOB_SCAN ? lla->job_cursor : lla->job_run_lo);
+    }
+    start_job(lla, node, 0);
+}
+
+// Drop the running job and every pending one, after a respread of the whole array.
+void clear_jobs(lla *lla)
+{
+    lla->job_node = 0;
+    lla->job_queued = 0;
+}
+
+// Move the element in slot from to the free slot to, with no live slot in between, and move its
+// count from one leaf path to the other.
+static void job_move(lla *lla, int from, int to)
+{
+    int lo = from < to ? from : to;
+    int hi = from < to ? to : from;
+    stripes_write_begin(lla, lo, lo);
+    persist_begin(lla, lo, lo);
+    stripes_write_begin(lla, hi, hi);
+    persist_begin(lla, hi, hi);
+
+    lla->arr[to] = lla->arr[from];
+    if (LLA_HAS_VALUES)
+    {
+        lla->values[to] = lla->values[from];
+    }
+    clear_slot_live(lla, from);
+    set_slot_live(lla, to);
+    count_moved(lla, 1);
+    LLA_STAT(lla->job_moved++);
+
+    int from_leaf = leaf_of_slot(lla, from);
+    int to_leaf = leaf_of_slot(lla, to);
+    for (int a = from_leaf, b = to_leaf; a != b; a /= 2, b /= 2)
+    {
+        lla->tree[a].size--;
+        lla->tree[b].size++;
+    }
+    if (from_leaf != to_leaf)
+    {
+        update_first_keys(lla, from_leaf);
+        update_first_keys(lla, to_leaf);
+    }
+
+    persist_end(lla);
+    stripes_write_end(lla, lo, lo);
+    stripes_write_end(lla, hi, hi);
+}
+
+// First live slot in [from, to] and last live slot in [from, to]. A job window can hold long gaps
+// mid-job, so only the leaf of the starting slot is scanned and the tree finds the rest.
+static int job_next_live(lla *lla, int from, int to)
+{
+    if (from > to)
+    {
+        return -1;
+    }
+    int leaf = leaf_of_slot(lla, from);
+    int slot = next_live_slot(lla, from, window_end(lla, leaf));
+    if (slot == -1)
+    {
+        slot = next_live_after(lla, leaf);
+    }
+    return slot > to ? -1 : slot;
+}
+
+static int job_prev_live(lla *lla, int from, int to)
+{
+    if (from > to)
+    {
+        return -1;
+    }
+    int leaf = leaf_of_slot(lla, to);
+    int slot = prev_live_slot(lla, window_start(lla, leaf), to);
+    if (slot == -1)
+    {
+        slot = prev_live_before(lla, leaf);
+    }
+    return slot < from ? -1 : slot;
+}
+
+// Slot of the element with rank r in the job's layout. That is the even layout, or during an append
+// run on the rightmost window the one mark_predicted_node() gives it: every left child filled to
+// max_size - 1 before its sibling gets any, so the slack ends up at the tail the run grows into.
+static int job_target(lla *lla, int r)
+{
+    long long range_size = lla->job_end - lla->job_start + 1;
+    if (!lla->job_append)
+    {
+        // Inserts meanwhile land anywhere, so the layout follows the count as it is now
+        return lla->job_start + (int)(r * range_size / lla->tree[lla->job_node].size);
+    }
+    if (r >= lla->job_total)
+    {
+        return lla->job_end;
+    }
+
+    int node = lla->job_node;
+    int count = lla->job_total;
+    while (node_depth(node) < lla->MAX_DEPTH)
+    {
+        lla_node *left = &lla->tree[2 * node];
+        lla_node *right = &lla->tree[2 * node + 1];
+        int cap_left = left->max_size - 1;
+        int cap_right = right->max_size - 1;
+        int lo = count - cap_right > 0 ? count - cap_right : 0;
+        int hi = cap_left < count ? cap_left : count;
+        if (cap_left + cap_right < count)
+        {
+            lo = hi = count / 2;
+        }
+        int split = cap_left < lo ? lo : cap_left > hi ? hi : cap_left;
+
+        if (r < split)
+        {
+            node = 2 * node;
+            count = split;
+        }
+        else
+        {
+            node = 2 * node + 1;
+            r -= split;
+            count -= split;
+        }
+    }
+    int start = window_start(lla, node);
+    return start + (int)((long long)r * (window_end(lla, node) - start + 1) / count);
+}
+
+// Queue a job for every node in node's window above its upper threshold, on the nearest ancestor
+// with room. Inserts that land behind a job's cursor are placed without it and can leave such nodes
+// when the job is done. Their jobs check their own windows in turn; node itself is not redone.
+static void queue_crowded(lla *lla, int job, int node)
+{
+    if (lla->tree[node].size <= lla->tree[node].max_size)
+    {
+        if (node_depth(node) < lla->MAX_DEPTH)
+        {
+            queue_crowded(lla, job, 2 * node);
+            queue_crowded(lla, job, 2 * node + 1);
+        }
+        return;
+    }
+
+    while (node && lla->tree[node].size > lla->tree[node].max_size)
+    {
+        node /= 2;
+    }
+    for (int i = 0; i < lla->job_queued; i++)
+    {
+        if (lla->job_queue[2 * i] == node)
+        {
+            return;
+        }
+    }
+    if (node && node != job)
+    {
+        push_job(lla, node, 0);
+    }
+}
+
+// Do up to budget moves of the job, looking at no more than 8 * budget elements. Left of the
+// cursor the elements are in place. Elements that belong further left are moved there as the
+// cursor reaches them. A run of elements that belong further right is found first and then moved
+// from its right end, so each element moves once and never past a neighbour. Returns 1 while the
+// job has work left.
+int rebalance_step(lla *lla, int budget)
+{
+    int start = lla->job_start;
+    int end = lla->job_end;
+    int base = live_before(lla, start);
+    int moves = 0;
+    int rank = -1; // rank of the element looked at last, -1 until known in this step
+
+    for (long long visits = 0; moves < budget && visits < 8LL * budget; visits++)
+    {
+        if (lla->job_mode == JOB_SCAN)
+        {
+            int p = job_next_live(lla, lla->job_cursor, end);
+            if (p == -1)
+            {
+                LLA_STAT(stats_rebalance(lla, LLA_REBALANCE_JOB, lla->job_node, lla->job_moved));
+                int job = lla->job_node;
+                lla->job_node = 0;
+                queue_crowded(lla, job, job);
+                if (!lla->job_queued)
+                {
+                    return 0;
+                }
+                lla->job_queued--;
+                start_job(lla, lla->job_queue[2 * lla->job_queued], lla->job_queue[2 * lla->job_queued + 1]);
+                start = lla->job_start;
+                end = lla->job_end;
+                base = live_before(lla, start);
+                rank = -1;
+                continue;
+            }
+            rank = rank == -1 ? live_before(lla, p) - base : rank + 1;
+            int target = job_target(lla, rank);
+
+            if (target > p)
+            {
+                lla->job_mode = JOB_FIND_RUN;
+                lla->job_run_lo = p;
+                lla->job_run_scan = p + 1;
+                continue;
+            }
+            if (target < p)
+            {
+                int prev = job_prev_live(lla, start, p - 1);
+                int dst = prev + 1 > target ? prev + 1 : target;
+                if (prev == -1 && dst < start)
+                {
+                    dst = start;
+                }
+                if (dst < p)
+                {
+                    job_move(lla, p, dst);
+                    moves++;
+                }
+            }
+            lla->job_cursor = p + 1;
+        }
+        else if (lla->job_mode == JOB_FIND_RUN)
+        {
+            int p = job_next_live(lla, lla->job_run_scan, end);
+            if (p != -1)
+            {
+                rank = rank == -1 ? live_before(lla, p) - base : rank + 1;
+                if (job_target(lla, rank) > p)
+                {
+                    lla->job_run_scan = p + 1;
+                    continue;
+                }
+            }
+            else if (rank != -1)
+            {
+                rank++;
+            }
+
+            // The run ends before p, move it from its right end
+            lla->job_mode = JOB_MOVE_RUN;
+            lla->job_run_next = p == -1 ? end + 1 : p;
+            lla->job_run_hi = lla->job_run_next - 1;
+        }
+        else
+        {
+            int p = job_prev_live(lla, lla->job_run_lo, lla->job_run_hi);
+            if (p == -1)
+            {
+                lla->job_mode = JOB_SCAN;
+                lla->job_cursor = lla->job_run_next;
+                rank = -1;
+                continue;
+            }
+            rank = rank == -1 ? live_before(lla, p) - base : rank - 1;
+            int next = job_next_live(lla, p + 1, end);
+            int limit = next == -1 ? end : next - 1;
+            int target = job_target(lla, rank);
+            int dst = target < limit ? target : limit;
+            if (dst > p)
+            {
+                job_move(lla, p, dst);
+                moves++;
+            }
+            lla->job_run_hi = p - 1;
+        }
+    }
+    return 1;
+}
+
+// Insert x by shifting the keys between its position and the nearest free slot over by one, when
+// that slot is at most limit slots away. Unlike insert_local_shift() the keys may cross leaves, so
+// every node whose window the shift touched gets its first key redone; only the leaf that gains the
+// free slot changes its count, and when that takes it past an upper threshold a job is scheduled
+// for it. Returns the number of keys written, 0 when no slot is close enough.
+static int insert_shift_to_gap(lla *lla, int leaf, lla_key x, lla_value x_value, int limit)
+{
+    int start = window_start(lla, leaf);
+    int end = window_end(lla, leaf);
+    int capacity = lla->N * lla->C;
+
+    int pred = start - 1;
+    for (int slot = next_live_slot(lla, start, end); slot != -1; slot = next_live_slot(lla, slot + 1, end))
+    {
+        if (LLA_KEY_LESS(x, lla->arr[slot]))
+        {
+            break;
+        }
+        pred = slot;
+    }
+    int right = next_free_slot(lla, pred + 1, pred + limit < capacity - 1 ? pred + limit : capacity - 1);
+    int left = pred < 0 ? -1 : prev_free_slot(lla, pred - limit + 1 > 0 ? pred - limit + 1 : 0, pred);
+    int right_cost = right == -1 ? limit + 1 : right - pred - 1;
+    int left_cost = left == -1 ? limit + 1 : pred - left;
+    if (right_cost > limit && left_cost > limit)
+    {
+        return 0;
+    }
+
+    int lo, hi, slot, shifted;
+    if (right_cost <= left_cost)
+    {
+        lo = pred + 1;
+        hi = right;
+        slot = pred + 1;
+        shifted = right_cost;
+    }
+    else
+    {
+        lo = left;
+        hi = pred;
+        slot = pred;
+        shifted = left_cost;
+    }
+
+    stripes_write_begin(lla, lo, hi);
+    persist_begin(lla, lo, hi);
+    if (slot == lo)
+    {
+        memmove(lla->arr + lo + 1, lla->arr + lo, shifted * sizeof(lla_key));
+        if (LLA_HAS_VALUES)
+        {
+            memmove(lla->values + lo + 1, lla->values + lo, shifted * sizeof(lla_value));
+        }
+    }
+    else
+    {
+        memmove(lla->arr + lo, lla->arr + lo + 1, shifted * sizeof(lla_key));
+        if (LLA_HAS_VALUES)
+        {
+            memmove(lla->values + lo, lla->values + lo + 1, shifted * sizeof(lla_value));
+        }
+    }
+    lla->arr[slot] = x;
+    if (LLA_HAS_VALUES)
+    {
+        lla->values[slot] = x_value;
+    }
+    int gained = slot == lo ? hi : lo;
+    set_slot_live(lla, gained);
+    persist_end(lla);
+    stripes_write_end(lla, lo, hi);
+    count_moved(lla, 1 + shifted);
+
+    int crowded = 0;
+    for (int node = leaf_of_slot(lla, gained); node; node /= 2)
+    {
+        if (++lla->tree[node].size > lla->tree[node].max_size)
+        {
+            crowded = node;
+        }
+    }
+    for (int first = leaf_of_slot(lla, lo), last = leaf_of_slot(lla, hi); first; first /= 2, last /= 2)
+    {
+        for (int node = first; node <= last; node++)
+        {
+            refresh_first_key(lla, node);
+        }
+    }
+
+    // The slot may have been gained in a window the job does not cover
+    while (crowded && lla->tree[crowded].size > lla->tree[crowded].max_size)
+    {
+        crowded /= 2;
+    }
+    if (crowded)
+    {
+        schedule_rebalance(lla, crowded);
+    }
+    return 1 + shifted;
+}
+
+// Insert x while a job takes over the respread of node: put x into its leaf, or into the smallest
+// window around its position that has a free slot and that the budget can respread, or else shift
+// it into the nearest free slot the budget reaches. Nothing larger than the budget is respread on
+// the spot. Returns the number of elements written, the job's included.
+int insert_deamortized(lla *lla, int node, lla_key x, lla_value x_value)
+{
+    long long before = lla->moved;
+    int budget = lla->job_budget;
+    // While the array grows a crowded root waits for the doubled one instead
+    if (node != ROOT || !lla->grow)
+    {
+        schedule_rebalance(lla, node);
+    }
+
+    int leaf = node;
+    while (node_depth(leaf) < lla->MAX_DEPTH)
+    {
+        leaf = 2 * leaf + route_right(lla, leaf, x);
+    }
+
+    int start = window_start(lla, leaf);
+    int end = window_end(lla, leaf);
+    stripes_write_begin(lla, start, end);
+    persist_begin(lla, start, end);
+    int moved = insert_local_shift(lla, leaf, x, x_value);
+    persist_end(lla);
+    stripes_write_end(lla, start, end);
+    if (moved)
+    {
+        insert_commit(lla, leaf);
+        LLA_STAT(stats_insert(lla, 1));
+        return (int)(lla->moved - before);
+    }
+
+    // The failed shift may already have spent moves mirroring the leaf into a growing array
+    for (int window = leaf; window != node; window /= 2)
+    {
+        start = window_start(lla, window);
+        end = window_end(lla, window);
+        if (lla->tree[window].size >= move_limit(lla, budget - (int)(lla->moved - before)))
+        {
+            break;
+        }
+        if (lla->tree[window].size < end - start + 1)
+        {
+            stripes_write_begin(lla, start, end);
+            persist_begin(lla, start, end);
+            insert_and_distribute_array_range_optimized(lla, start, end, x, x_value);
+            persist_end(lla);
+            stripes_write_end(lla, start, end);
+            insert_commit(lla, window);
+            LLA_STAT(stats_insert(lla, window == leaf));
+            LLA_STAT(stats_rebalance(lla, LLA_REBALANCE_INSERT, window, lla->tree[window].size));
+            return (int)(lla->moved - before);
+        }
+    }
+
+    // No window is small enough: shift x into the nearest free slot within the moves left. Failing
+    // that, half of them go to the pending work and the shift is retried with the rest. With no
+    // work pending the smallest window around x with room gets a job, or the array starts to grow
+    // when only the root is left. Once the budget is spent the inserts have outrun the work here:
+    // it goes on in steps of max_moves until a shift costs no more than a sixteenth of the moves
+    // made so far. A spot hit faster than any respread within max_moves spreads it out needs that,
+    // as the Omega(log^2 n) amortized bound of list labeling requires of some inserts; such inserts
+    // count in job_overruns. After eight rounds that move nothing the work has stalled and x is
+    // shifted to the nearest free slot whatever it costs.
+    moved = 0;
+    for (int idle = 0; idle < 8;)
+    {
+        int spent = (int)(lla->moved - before);
+        int left = budget - spent;
+        leaf = ROOT;
+        while (node_depth(leaf) < lla->MAX_DEPTH)
+        {
+            leaf = 2 * leaf + route_right(lla, leaf, x);
+        }
+        moved = insert_shift_to_gap(lla, leaf, x, x_value, left > 2 ? move_limit(lla, left) - 1 : spent / 16);
+        if (moved)
+        {
+            break;
+        }
+
+        if (!lla->job_node && !lla->grow)
+        {
+            int crowded = insert_help_iterative(lla, x);
+            if (crowded)
+            {
+                schedule_rebalance(lla, crowded);
+            }
+            else if (!lla->persist)
+            {
+                grow_start(lla);
+            }
+            else
+            {
+                break;
+            }
+        }
+        long long step = lla->moved;
+        carry_work(lla, left > 2 ? left / 2 : budget);
+        idle = lla->moved == step ? idle + 1 : 0;
+    }
+    if (!moved)
+    {
+        leaf = ROOT;
+        while (node_depth(leaf) < lla->MAX_DEPTH)
+        {
+            leaf = 2 * leaf + route_right(lla, leaf, x);
+        }
+        insert_shift_to_gap(lla, leaf, x, x_value, lla->N * lla->C);
+    }
+    if (lla->moved - before > budget)
+    {
+        lla->job_overruns++;
+    }
+    LLA_STAT(stats_insert(lla, 0));
+    return (int)(lla->moved - before);
+}
+
+// Double the capacity in steps. The doubled arrays and their tree are filled in beside the live
+// ones, which serve every operation until grow_step() swaps them in: a leaf [start, end] is copied
+// as it is to the front of its doubled window [2 * start, 2 * end + 1], so every window ends up
+// with half its slots free and nothing is respread. A mapped lla grows with lla_resize() instead.
+void grow_start(lla *lla)
+{
+    struct lla *grow = (struct lla *)calloc(1, sizeof(struct lla));
+    if (!grow)
+    {
+        printf("Malloc failed\n");
+        exit(1);
+    }
+    grow->N = 2 * lla->N;
+    grow->C = lla->C;
+    grow->policy = lla->policy;
+    set_tree_shape(grow);
+
+    int capacity = grow->N * grow->C;
+    grow->arr = (lla_key *)malloc(sizeof(lla_key) * PADDED_SLOTS(capacity));
+    grow->values = LLA_HAS_VALUES ? (lla_value *)malloc(sizeof(lla_value) * PADDED_SLOTS(capacity)) : null;
+    grow->occupied = (uint64_t *)calloc(OCCUPIED_WORDS(capacity), sizeof(uint64_t));
+    grow->versions = (_Atomic uint64_t *)calloc(STRIPE_COUNT(capacity), sizeof(_Atomic uint64_t));
+    grow->tree = (lla_node *)malloc(sizeof(lla_node) * (2 << grow->MAX_DEPTH));
+    if (!grow->arr || (LLA_HAS_VALUES && !grow->values) || !grow->occupied || !grow->versions || !grow->tree)
+    {
+        printf("Malloc failed\n");
+        exit(1);
+    }
+    lla->grow = grow;
+    lla->grow_cursor = 0;
+    lla->grow_node = 2 << grow->MAX_DEPTH;
+}
+
+// Node of the doubled tree, with the thresholds of its depth and its count taken from the copy.
+static void grow_build_node(lla *lla, int node)
+{
+    struct lla *grow = lla->grow;
+    double frac = grow->MAX_DEPTH ? (double)node_depth(node) / grow->MAX_DEPTH : 1;
+    lla_node *tree = grow->tree;
+
+    init_node(grow, node, policy_threshold(&grow->policy, 1, frac), policy_threshold(&grow->policy, 0, frac));
+    if (node_depth(node) == grow->MAX_DEPTH)
+    {
+        tree[node].size = count_live_slots(grow, window_start(grow, node), window_end(grow, node));
+    }
+    else
+    {
+        tree[node].size = tree[2 * node].size + tree[2 * node + 1].size;
+    }
+    refresh_first_key(grow, node);
+}
+
+// Do up to budget moves of the growth. The live elements are copied first, in slot order, then
+// the doubled tree is built bottom-up, budget nodes per step. Writes to slots copied so far are
+// mirrored meanwhile, see grow_mirror(). Once the root is built the doubled arrays replace the
+// live ones, as in lla_resize().
+void grow_step(lla *lla, int budget)
+{
+    struct lla *grow = lla->grow;
+    int old_capacity = lla->N * lla->C;
+    int moves = 0;
+
+    while (lla->grow_cursor < old_capacity && moves < budget)
+    {
+        int leaf = leaf_of_slot(lla, lla->grow_cursor);
+        int start = window_start(lla, leaf);
+        int end = window_end(lla, leaf);
+        int slot = next_live_slot(lla, lla->grow_cursor, end);
+        for (; slot != -1 && moves < budget; slot = next_live_slot(lla, slot + 1, end))
+        {
+            grow->arr[slot + start] = lla->arr[slot];
+            if (LLA_HAS_VALUES)
+            {
+                grow->values[slot + start] = lla->values[slot];
+            }
+            set_slot_live(grow, slot + start);
+            lla->grow_cursor = slot + 1;
+            moves++;
+        }
+        if (slot == -1)
+        {
+            lla->grow_cursor = end + 1;
+        }
+    }
+    count_moved(lla, moves);
+
+    for (int built = 0; lla->grow_cursor == old_capacity && lla->grow_node > ROOT && built < budget; built++)
+    {
+        grow_build_node(lla, --lla->grow_node);
+    }
+    if (lla->grow_node > ROOT)
+    {
+        return;
+    }
+
+    // Readers retry on the new layout, as they do across lla_resize()
+    uint32_t generation = atomic_load_explicit(&lla->generation, memory_order_relaxed);
+    atomic_store_explicit(&lla->generation, generation + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+
+    lla_key *old_arr = lla->arr;
+    lla_value *old_values = lla->values;
+    uint64_t *old_occupied = lla->occupied;
+    lla_node *old_tree = lla->tree;
+    _Atomic uint64_t *old_versions = lla->versions;
+    lla->arr = grow->arr;
+    lla->values = grow->values;
+    lla->occupied = grow->occupied;
+    lla->versions = grow->versions;
+    lla->tree = grow->tree;
+    lla->N = grow->N;
+    lla->WINDOW_SIZE = grow->WINDOW_SIZE;
+    lla->MAX_DEPTH = grow->MAX_DEPTH;
+    lla->grow = null;
+    free(grow);
+    clear_jobs(lla); // their windows are those of the old tree, crowded ones get new jobs on insert
+    atomic_store_explicit(&lla->generation, generation + 2, memory_order_release);
+    LLA_STAT(stats_rebalance(lla, LLA_REBALANCE_RESIZE, ROOT, lla->tree[ROOT].size));
+
+    lla_synchronize(lla);
+    free(old_arr);
+    free(old_values);
+    free(old_occupied);
+    free(old_tree);
+    free((void *)old_versions);
+
+    if (lla->job_budget < min_budget(lla))
+    {
+        lla->job_budget = min_budget(lla);
+    }
+}
+
+// Copy the writes to slots [from, to] of a growing lla into the doubled arrays, as far as they are
+// copied already. The whole range is copied again, so the mirror costs the live elements in it,
+// counted as moves. Nodes of the doubled tree built so far are recounted.
+void grow_mirror(lla *lla, int from, int to)
+{
+    struct lla *grow = lla->grow;
+    int last = to < lla->grow_cursor ? to : lla->grow_cursor - 1;
+    int moves = 0;
+
+    for (int slot = from; slot <= last;)
+    {
+        int leaf = leaf_of_slot(lla, slot);
+        int start = window_start(lla, leaf);
+        int end = window_end(lla, leaf) < last ? window_end(lla, leaf) : last;
+
+        clear_slot_range(grow, slot + start, end + start);
+        for (int s = next_live_slot(lla, slot, end); s != -1; s = next_live_slot(lla, s + 1, end))
+        {
+            grow->arr[s + start] = lla->arr[s];
+            if (LLA_HAS_VALUES)
+            {
+                grow->values[s + start] = lla->values[s];
+            }
+            set_slot_live(grow, s + start);
+            moves++;
+        }
+
+        int first_leaf = leaf_of_slot(grow, slot + start);
+        int last_leaf = leaf_of_slot(grow, end + start);
+        for (; first_leaf && last_leaf >= lla->grow_node; first_leaf /= 2, last_leaf /= 2)
+        {
+            for (int node = first_leaf > lla->grow_node ? first_leaf : lla->grow_node; node <= last_leaf; node++)
+            {
+                grow_build_node(lla, node);
+            }
+        }
+        slot = end + 1;
+    }
+    count_moved(lla, moves);
+}
+
+// Finish the growth at once, for callers outside the mode's bound.
+void grow_finish(lla *lla)
+{
+    while (lla->grow)
+    {
+        grow_step(lla, lla->N * lla->C);
+    }
+}
+
+// Drop the doubled arrays, before the live ones are replaced or freed.
+void grow_abort(lla *lla)
+{
+    struct lla *grow = lla->grow;
+    if (!grow)
+    {
+        return;
+    }
+    free(grow->arr);
+    free(grow->values);
+    free(grow->occupied);
+    free((void *)grow->versions);
+    free(grow->tree);
+    free(grow);
+    lla->grow = null;
+}
+// ################# EOF DEAMORTIZED FUNCTIONS ###################
+
+// ################# BEGIN PARALLEL FUNCTIONS ###################
+// Respreads and resizes of at least parallel_slots slots are split over a worker pool. The window
+// is cut into word-aligned chunks. Each chunk's live elements are counted in parallel, a prefix sum
+// over the counts gives each chunk its offset in the scratch arena, and the chunks are gathered
+// there in parallel. Then each chunk scatters the elements whose even-spread slot falls inside it.
+// Predicted and append layouts are placed top-down and stay sequential.
+typedef struct lla_pool {
+    int threads; // workers, the caller makes one more
+    pthread_t *workers;
+    pthread_mutex_t mutex;
+    pthread_cond_t work_ready;
+    pthread_cond_t work_done;
+    void (*job)(struct lla *lla, int task);
+    lla *lla;
+    int tasks;
+    atomic_int next_task;
+    int job_id;  // bumped for every job, workers wait for a new one
+    int running; // workers still on the current job
+    int stop;
+    atomic_int busy; // one parallel job at a time, concurrent writers fall back to one thread
+    // The job being run
+    int start;
+    int end;
+    int chunk_words;
+    int *offsets; // first scratch index of every chunk, then the total
+    int offsets_cap;
+    lla_key x;
+    lla_value x_value;
+    int rank;
+    int total;
+    int insert_x;
+} lla_pool;
+
+static void pool_work(lla_pool *pool)
+{
+    for (int task; (task = atomic_fetch_add(&pool->next_task, 1)) < pool->tasks;)
+    {
+        pool->job(pool->lla, task);
+    }
+}
+
+static void *pool_worker(void *arg)
+{
+    lla_pool *pool = (lla_pool *)arg;
+    int seen = 0;
+
+    for (;;)
+    {
+        pthread_mutex_lock(&pool->mutex);
+        while (pool->job_id == seen && !pool->stop)
+        {
+            pthread_cond_wait(&pool->work_ready, &pool->mutex);
+        }
+        if (pool->stop)
+        {
+            pthread_mutex_unlock(&pool->mutex);
+            return null;
+        }
+        seen = pool->job_id;
+        pthread_mutex_unlock(&pool->mutex);
+
+        pool_work(pool);
+
+        pthread_mutex_lock(&pool->mutex);
+        if (--pool->running == 0)
+        {
+            pthread_cond_signal(&pool->work_done);
+        }
+        pthread_mutex_unlock(&pool->mutex);
+    }
+}
+
+// Run job(lla, task) for every task in [0, tasks) on the workers and the calling thread.
+static void pool_run(lla *lla, int tasks, void (*job)(struct lla *lla, int task))
+{
+    lla_pool *pool = lla->pool;
+
+    pool->job = job;
+    pool->lla = lla;
+    pool->tasks = tasks;
+    atomic_store(&pool->next_task, 0);
+
+    pthread_mutex_lock(&pool->mutex);
+    pool->job_id++;
+    pool->running = pool->threads;
+    pthread_cond_broadcast(&pool->work_ready);
+    pthread_mutex_unlock(&pool->mutex);
+
+    pool_work(pool);
+
+    pthread_mutex_lock(&pool->mutex);
+    while (pool->running)
+    {
+        pthread_cond_wait(&pool->work_done, &pool->mutex);
+    }
+    pthread_mutex_unlock(&pool->mutex);
+}
+
+static void pool_stop(lla *lla)
+{
+    lla_pool *pool = lla->pool;
+    if (!pool)
+    {
+        return;
+    }
+
+    pthread_mutex_lock(&pool->mutex);
+    pool->stop = 1;
+    pthread_cond_broadcast(&pool->work_ready);
+    pthread_mutex_unlock(&pool->mutex);
+    for (int i = 0; i < pool->threads; i++)
+    {
+        pthread_join(pool->workers[i], null);
+    }
+    pthread_mutex_destroy(&pool->mutex);
+    pthread_cond_destroy(&pool->work_ready);
+    pthread_cond_destroy(&pool->work_done);
+    free(pool->workers);
+    free(pool->offsets);
+    free(pool);
+    lla->pool = null;
+}
+
+// Use threads threads (the caller included) for respreads and resizes of at least min_slots
+// slots, LLA_PARALLEL_SLOTS when min_slots <= 0. threads <= 1 stops the pool.
+void lla_set_workers(lla *lla, int threads, int min_slots)
+{
+    pool_stop(lla);
+    lla->parallel_slots = min_slots > 0 ? min_slots : LLA_PARALLEL_SLOTS;
+    if (threads <= 1)
+    {
+        return;
+    }
+
+    lla_pool *pool = (lla_pool *)calloc(1, sizeof(lla_pool));
+    if (!pool || !(pool->workers = (pthread_t *)malloc(sizeof(pthread_t) * (threads - 1))))
+    {
+        printf("Malloc failed\n");
+        exit(1);
+    }
+    pool->threads = threads - 1;
+    pthread_mutex_init(&pool->mutex, null);
+    pthread_cond_init(&pool->work_ready, null);
+    pthread_cond_init(&pool->work_done, null);
+    atomic_init(&pool->next_task, 0);
+    atomic_init(&pool->busy, 0);
+    lla_simd_level();
+    for (int i = 0; i < pool->threads; i++)
+    {
+        if (pthread_create(&pool->workers[i], null, pool_worker, pool))
+        {
+            printf("Thread creation failed\n");
+            exit(1);
+        }
+    }
+    lla->pool = pool;
+}
+
+// 1 when a window of range_size slots should go to the pool, which is then held until
+// pool_release().
+int pool_acquire(lla *lla, int range_size)
+{
+    if (!lla->pool || range_size < lla->parallel_slots || lla->predictor || lla_append_mode(lla))
+    {
+        return 0;
+    }
+    int expected = 0;
+    return atomic_compare_exchange_strong(&lla->pool->busy, &expected, 1);
+}
+
+void pool_release(lla *lla)
+{
+    atomic_store(&lla->pool->busy, 0);
+}
+
+// Cut [start, end] into chunks of whole words, about four per thread so uneven chunks even out.
+static int pool_chunks(lla *lla, int start, int end)
+{
+    lla_pool *pool = lla->pool;
+    int words = (end >> 6) - (start >> 6) + 1;
+    int chunks = 4 * (pool->threads + 1);
+    pool->start = start;
+    pool->end = end;
+    pool->chunk_words = (words + chunks - 1) / chunks;
+    chunks = (words + pool->chunk_words - 1) / pool->chunk_words;
+
+    if (chunks + 1 > pool->offsets_cap)
+    {
+        free(pool->offsets);
+        pool->offsets_cap = chunks + 1;
+        pool->offsets = (int *)malloc(sizeof(int) * pool->offsets_cap);
+        if (!pool->offsets)
+        {
+            printf("Malloc failed\n");
+            exit(1);
+        }
+    }
+    return chunks;
+}
+
+static void chunk_bounds(lla_pool *pool, int task, int *from, int *to)
+{
+    int first = ((pool->start >> 6) + task * pool->chunk_words) << 6;
+    int last = first + (pool->chunk_words << 6) - 1;
+    *from = first > pool->start ? first : pool->start;
+    *to = last < pool->end ? last : pool->end;
+}
+
+static void count_chunk(lla *lla, int task)
+{
+    int from, to;
+    chunk_bounds(lla->pool, task, &from, &to);
+    lla->pool->offsets[task + 1] = count_live_slots(lla, from, to);
+}
+
+static void gather_chunk(lla *lla, int task)
+{
+    lla_pool *pool = lla->pool;
+    int from, to;
+    lla_key none = {0};
+    lla_value none_value = {0};
+    chunk_bounds(pool, task, &from, &to);
+    int offset = pool->offsets[task];
+    gather_range(lla, from, to, lla->scratch + offset, LLA_HAS_VALUES ? lla->scratch_values + offset : null, none, none_value, 0);
+}
+
+// Copy the live elements of [start, end] into the scratch arena in order, returns their number.
+int parallel_gather(lla *lla, int start, int end)
+{
+    lla_pool *pool = lla->pool;
+    int chunks = pool_chunks(lla, start, end);
+
+    pool_run(lla, chunks, count_chunk);
+    pool->offsets[0] = 0;
+    for (int c = 0; c < chunks; c++)
+    {
+        pool->offsets[c + 1] += pool->offsets[c];
+    }
+
+    // One spare entry so respread_parallel() can size for x as well
+    reserve_scratch(lla, pool->offsets[chunks] + 1);
+    pool_run(lla, chunks, gather_chunk);
+    return pool->offsets[chunks];
+}
+
+// First element of an even spread of total over range_size slots that lands at or after offset:
+// element e goes to offset floor(e * spacing / 2^16), as in mark_spread_slots().
+static int first_element_at(long long spacing_fixed, int offset, int total)
+{
+    long long e = (((long long)offset << 16) + spacing_fixed - 1) / spacing_fixed;
+    return e < total ? (int)e : total;
+}
+
+static void scatter_chunk(lla *lla, int task)
+{
+    lla_pool *pool = lla->pool;
+    int from, to;
+    chunk_bounds(pool, task, &from, &to);
+    clear_slot_range(lla, from, to);
+    if (pool->total == 0)
+    {
+        return;
+    }
+
+    long long spacing_fixed = ((long long)(pool->end - pool->start + 1) << 16) / pool->total;
+    int last = first_element_at(spacing_fixed, to + 1 - pool->start, pool->total);
+    for (int e = first_element_at(spacing_fixed, from - pool->start, pool->total); e < last; e++)
+    {
+        int slot = pool->start + (int)((e * spacing_fixed) >> 16);
+        set_slot_live(lla, slot);
+
+        if (pool->insert_x && e == pool->rank)
+        {
+            lla->arr[slot] = pool->x;
+            if (LLA_HAS_VALUES)
+            {
+                lla->values[slot] = pool->x_value;
+            }
+            continue;
+        }
+
+        int src = e - (pool->insert_x && e > pool->rank);
+        lla->arr[slot] = lla->scratch[src];
+        if (LLA_HAS_VALUES)
+        {
+            lla->values[slot] = lla->scratch_values[src];
+        }
+    }
+}
+
+// Spread count elements of the scratch arena evenly over [start, end], with x placed at rank when
+// insert_x is set.
+void parallel_spread(lla *lla, int start, int end, int count, lla_key x, lla_value x_value, int rank, int insert_x)
+{
+    lla_pool *pool = lla->pool;
+    int chunks = pool_chunks(lla, start, end);
+
+    pool->x = x;
+    pool->x_value = x_value;
+    pool->rank = rank;
+    pool->insert_x = insert_x;
+    pool->total = count + (insert_x ? 1 : 0);
+    count_moved(lla, pool->total);
+    pool_run(lla, chunks, scatter_chunk);
+}
+
+// respread_range() on the pool: gather, find x's rank, scatter.
+void respread_parallel(lla *lla, int start_index, int end_index, lla_key x, lla_value x_value, int insert_x)
+{
+    int count = parallel_gather(lla, start_index, end_index);
+
+    // x goes after its equals, at the first gathered key greater than it
+    int rank = count;
+    if (insert_x)
+    {
+        int lo = 0, hi = count;
+        while (lo < hi)
+        {
+            int mid = lo + (hi - lo) / 2;
+            if (LLA_KEY_LESS(x, lla->scratch[mid]))
+            {
+                hi = mid;
+            }
+            else
+            {
+                lo = mid + 1;
+            }
+        }
+        rank = lo;
+    }
+    parallel_spread(lla, start_index, end_index, count, x, x_value, rank, insert_x);
+}
+// ################# EOF PARALLEL FUNCTIONS ###################
+
+// ################# BEGIN PERSISTENCE FUNCTIONS ###################
+// lla_open_mapped() keeps the tree, the occupancy bitmap, the keys and the values in one file
+// mapped with MAP_SHARED, so a restart maps the file again instead of rebuilding anything. A
+// header page records the configuration and the key and value types, the regions follow at
+// 64-byte aligned offsets, and an undo area as large as the arrays comes last.
+//
+// Every write path brackets the slots it changes with persist_begin() / persist_end(), which
+// first copies their old contents to the undo area. A process that dies mid-respread leaves the
+// record open, and the next open copies the old slots back and recounts the tree from the bitmap.
+// Resizes write a complete new file next to the old one and rename() it into place.
+#define LLA_FILE_MAGIC 0x31414c4c50414d4dULL // "MMAPLLA1"
+#define LLA_FILE_VERSION 1
+#define LLA_FILE_CLEAN 1 // closed by cleanup_lla(), the tree can be trusted as it is
+#define LLA_FILE_DIRTY 2 // open, or left open by a crash
+#define LLA_FILE_HEADER_SIZE 4096
+#define LLA_STR(x) #x
+#define LLA_XSTR(x) LLA_STR(x)
+#ifdef LLA_VALUE_TYPE
+#define LLA_VALUE_NAME LLA_XSTR(LLA_VALUE_TYPE)
+#else
+#define LLA_VALUE_NAME "none"
+#endif
+
+typedef struct lla_file_header
+{
+    uint64_t magic;
+    uint32_t version;
+    uint32_t state;
+    char key_type[32];
+    char value_type[32];
+    uint32_t key_size;
+    uint32_t value_size;
+    uint32_t node_size;
+    int32_t N;
+    int32_t C;
+    int32_t INITIAL_N;
+    int32_t MAX_DEPTH;
+    int32_t WINDOW_SIZE;
+    double TAU_0;
+    double TAU_D;
+    lla_policy policy;
+    uint64_t checkpoints; // lla_checkpoint() calls that reached the disk
+    uint64_t file_size;
+    uint64_t tree_offset;
+    uint64_t occupied_offset;
+    uint64_t arr_offset;
+    uint64_t values_offset;
+    uint64_t undo_words_offset; // the open undo record: occupancy words, keys and values
+    uint64_t undo_keys_offset;
+    uint64_t undo_values_offset;
+    uint32_t undo_segments; // 0 unless a write path is between persist_begin() and persist_end()
+    int32_t undo_first_word[2];
+    int32_t undo_last_word[2];
+} lla_file_header;
+
+typedef struct lla_persist
+{
+    int fd;
+    char *path;
+    char *map;
+    size_t map_size;
+    lla_file_header *header;
+} lla_persist;
+
+static uint64_t align_up(uint64_t offset, uint64_t alignment)
+{
+    return (offset + alignment - 1) & ~(alignment - 1);
+}
+
+// Fill in everything but the state and the magic for a file of N * C slots
+static void file_layout(lla_file_header *h, int N, const lla_policy *policy, int initial_n)
+{
+    int window_size, max_depth;
+    tree_shape(policy, N, &window_size, &max_depth);
+    uint64_t slots = PADDED_SLOTS(N * policy->C);
+    uint64_t words = OCCUPIED_WORDS(N * policy->C);
+
+    memset(h, 0, sizeof(*h));
+    h->version = LLA_FILE_VERSION;
+    strncpy(h->key_type, LLA_XSTR(LLA_KEY_TYPE), sizeof(h->key_type) - 1);
+    strncpy(h->value_type, LLA_VALUE_NAME, sizeof(h->value_type) - 1);
+    h->key_size = sizeof(lla_key);
+    h->value_size = LLA_HAS_VALUES ? sizeof(lla_value) : 0;
+    h->node_size = sizeof(lla_node);
+    h->N = N;
+    h->C = policy->C;
+    h->INITIAL_N = initial_n;
+    h->MAX_DEPTH = max_depth;
+    h->WINDOW_SIZE = window_size;
+    h->TAU_0 = policy->TAU_0;
+    h->TAU_D = policy->TAU_D;
+    h->policy = *policy;
+
+    // job_move() saves two single words besides the largest window, the whole array
+    uint64_t offset = LLA_FILE_HEADER_SIZE;
+    h->tree_offset = offset;
+    offset = align_up(offset + sizeof(lla_node) * (2ULL << max_depth), 64);
+    h->occupied_offset = offset;
+    offset = align_up(offset + sizeof(uint64_t) * words, 64);
+    h->arr_offset = offset;
+    offset = align_up(offset + sizeof(lla_key) * slots, 64);
+    h->values_offset = offset;
+    offset = align_up(offset + h->value_size * slots, 64);
+    h->undo_words_offset = offset;
+    offset = align_up(offset + sizeof(uint64_t) * (words + 2), 64);
+    h->undo_keys_offset = offset;
+    offset = align_up(offset + sizeof(lla_key) * (slots + 128), 64);
+    h->undo_values_offset = offset;
+    offset = align_up(offset + h->value_size * (slots + 128), 64);
+    h->file_size = align_up(offset, LLA_FILE_HEADER_SIZE);
+}
+
+// Size fd for header and map it. Returns NULL when the file cannot be sized or mapped.
+static lla_persist *map_file(const char *path, int fd, uint64_t size)
+{
+    if (ftruncate(fd, (off_t)size))
+    {
+        return null;
+    }
+    char *map = (char *)mmap(null, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED)
+    {
+        return null;
+    }
+
+    lla_persist *persist = (lla_persist *)malloc(sizeof(lla_persist));
+    char *path_copy = strdup(path);
+    if (!persist || !path_copy)
+    {
+        printf("Malloc failed\n");
+        exit(1);
+    }
+    persist->fd = fd;
+    persist->path = path_copy;
+    persist->map = map;
+    persist->map_size = size;
+    persist->header = (lla_file_header *)map;
+    return persist;
+}
+
+static void unmap_file(lla_persist *persist)
+{
+    munmap(persist->map, persist->map_size);
+    close(persist->fd);
+    free(persist->path);
+    free(persist);
+}
+
+// Point the lla's tree and arrays into the mapping
+static void attach_file(lla *lla, lla_persist *persist)
+{
+    lla_file_header *h = persist->header;
+
+    lla->persist = persist;
+    lla->tree = (lla_node *)(persist->map + h->tree_offset);
+    lla->occupied = (uint64_t *)(persist->map + h->occupied_offset);
+    lla->arr = (lla_key *)(persist->map + h->arr_offset);
+    lla->values = LLA_HAS_VALUES ? (lla_value *)(persist->map + h->values_offset) : null;
+    lla->N = h->N;
+    lla->MAX_DEPTH = h->MAX_DEPTH;
+    lla->WINDOW_SIZE = h->WINDOW_SIZE;
+}
+
+// Create a file for an empty lla of N * C slots and map it
+static lla_persist *create_file(const char *path, int N, const lla_policy *policy, int initial_n)
+{
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+    {
+        return null;
+    }
+
+    lla_file_header layout;
+    file_layout(&layout, N, policy, initial_n);
+    lla_persist *persist = map_file(path, fd, layout.file_size);
+    if (!persist)
+    {
+        close(fd);
+        return null;
+    }
+    *persist->header = layout;
+    persist->header->state = LLA_FILE_DIRTY;
+    return persist;
+}
+
+lla *lla_open_mapped(const char *path, int N, const lla_policy *policy)
+{
+    int fd = open(path, O_RDWR);
+    if (fd < 0)
+    {
+        // A new file: an empty lla, written out once before it is handed back
+        lla_policy default_policy = lla_policy_preset(LLA_PRESET_DEFAULT);
+        policy = policy ? policy : &default_policy;
+        lla *my_lla = new_lla_handle(N, policy);
+        lla_persist *persist = create_file(path, N, policy, N);
+        if (!persist)
+        {
+            printf("Cannot create %s\n", path);
+            free_lla(my_lla);
+            return null;
+        }
+        attach_file(my_lla, persist);
+        init_balancing_tree(my_lla);
+        persist->header->magic = LLA_FILE_MAGIC;
+        lla_checkpoint(my_lla);
+        return my_lla;
+    }
+
+    struct stat st;
+    lla_file_header h;
+    if (fstat(fd, &st) || (size_t)st.st_size < sizeof(h) || pread(fd, &h, sizeof(h), 0) != (ssize_t)sizeof(h) ||
+        h.magic != LLA_FILE_MAGIC || h.version != LLA_FILE_VERSION || h.file_size != (uint64_t)st.st_size)
+    {
+        printf("%s is not an lla file\n", path);
+        close(fd);
+        return null;
+    }
+    if (h.key_size != sizeof(lla_key) || h.value_size != (LLA_HAS_VALUES ? sizeof(lla_value) : 0) ||
+        h.node_size != sizeof(lla_node) || strncmp(h.key_type, LLA_XSTR(LLA_KEY_TYPE), sizeof(h.key_type)) ||
+        strncmp(h.value_type, LLA_VALUE_NAME, sizeof(h.value_type)))
     {
-        arr[i] = 0;
+        printf("%s holds %s keys and %s values, this build uses %s and %s\n", path, h.key_type, h.value_type, LLA_XSTR(LLA_KEY_TYPE), LLA_VALUE_NAME);
+        close(fd);
+        return null;
     }
-}
 
-void print_tree_helper(lla_node *node, int depth)
-{
-    if (!node)
+    lla *my_lla = new_lla_handle(h.N, &h.policy);
+    lla_persist *persist = map_file(path, fd, h.file_size);
+    if (!persist)
     {
-        return;
+        printf("Cannot map %s\n", path);
+        close(fd);
+        free_lla(my_lla);
+        return null;
     }
+    attach_file(my_lla, persist);
+    my_lla->INITIAL_N = h.INITIAL_N;
 
-    printf("is_leaf: %d, size: %d, depth: %d, tau: %.4f, tau_k: %.4f, win_start: %d, win_end: %d\n", node->is_leaf, node->size, depth, node->tau, node->TAU_K, node->window_start, node->window_end);
-    if (node->parent)
+    if (h.state != LLA_FILE_CLEAN && !recover_file(my_lla))
     {
-        // printf("parent: s: %d, e: %d\n", node->parent->window_start, node->parent->window_end);
+        // Left as it is on disk, free_lla() would mark it clean
+        printf("%s is corrupt\n", path);
+        unmap_file(persist);
+        my_lla->persist = null;
+        my_lla->tree = null;
+        my_lla->arr = null;
+        my_lla->values = null;
+        my_lla->occupied = null;
+        free_lla(my_lla);
+        return null;
     }
 
-    print_tree_helper(node->left, depth + 1);
-    print_tree_helper(node->right, depth + 1);
+    // Marked dirty on disk before anything else changes
+    persist->header->state = LLA_FILE_DIRTY;
+    msync(persist->map, LLA_FILE_HEADER_SIZE, MS_SYNC);
+    return my_lla;
 }
 
-void print_lla(lla *my_lla)
+// After a crash: put back the slots of an interrupted write path, recount the tree and check
+// that the keys are in order. Returns 0 when they are not.
+int recover_file(lla *lla)
 {
-    lla_node *root = my_lla->root;
-    if (root == null)
+    lla_file_header *h = lla->persist->header;
+    uint64_t *undo_words = (uint64_t *)(lla->persist->map + h->undo_words_offset);
+    lla_key *undo_keys = (lla_key *)(lla->persist->map + h->undo_keys_offset);
+    lla_value *undo_values = (lla_value *)(lla->persist->map + h->undo_values_offset);
+
+    for (int k = (int)h->undo_segments - 1; k >= 0; k--)
     {
-        printf("The LLA is empty.\n");
-        return;
+        int first = h->undo_first_word[k];
+        int words = h->undo_last_word[k] - first + 1;
+        int offset = k ? h->undo_last_word[0] - h->undo_first_word[0] + 1 : 0;
+        memcpy(lla->occupied + first, undo_words + offset, sizeof(uint64_t) * words);
+        memcpy(lla->arr + 64 * first, undo_keys + 64 * offset, sizeof(lla_key) * 64 * words);
+        if (LLA_HAS_VALUES)
+        {
+            memcpy(lla->values + 64 * first, undo_values + 64 * offset, sizeof(lla_value) * 64 * words);
+        }
     }
-    printf("Array snapshot:\n");
-    int arr_size = my_lla->N * my_lla->C;
-    print_array(my_lla->arr, arr_size);
+    h->undo_segments = 0;
 
-    print_tree_helper(root, 0);
+    recount_subtree(lla, ROOT);
 
-    return;
-}
-
-int log_base_2(int n)
-{
-    int result = 0;
-    while (n >>= 1)
+    int prev = next_live_slot(lla, 0, lla->N * lla->C - 1);
+    for (int slot = prev; slot != -1; prev = slot)
     {
-        result++;
+        slot = next_live_slot(lla, prev + 1, lla->N * lla->C - 1);
+        if (slot != -1 && LLA_KEY_LESS(lla->arr[slot], lla->arr[prev]))
+        {
+            return 0;
+        }
     }
-    return result;
+    return 1;
 }
-// ################# EOF HELPER FUNCTIONS ##############
 
-// ################# BEGIN MAIN FUNCTIONS ###################
-lla_node *create_lla_node(lla_node *parent, int start, int end)
+// Save the words of slots [start, end] before a write path changes them. Up to two ranges may be
+// open at once, they are packed one after the other.
+void undo_save(lla *lla, int start, int end)
 {
-    lla_node *node = (lla_node *)malloc(sizeof(lla_node));
-    if (!node)
+    lla_file_header *h = lla->persist->header;
+    char *map = lla->persist->map;
+    int k = h->undo_segments;
+    int first = start >> 6;
+    int words = (end >> 6) - first + 1;
+    int offset = k ? h->undo_last_word[0] - h->undo_first_word[0] + 1 : 0;
+
+    memcpy((uint64_t *)(map + h->undo_words_offset) + offset, lla->occupied + first, sizeof(uint64_t) * words);
+    memcpy((lla_key *)(map + h->undo_keys_offset) + 64 * offset, lla->arr + 64 * first, sizeof(lla_key) * 64 * words);
+    if (LLA_HAS_VALUES)
     {
-        printf("Malloc failed\n");
-        exit(1);
+        memcpy((lla_value *)(map + h->undo_values_offset) + 64 * offset, lla->values + 64 * first, sizeof(lla_value) * 64 * words);
     }
+    h->undo_first_word[k] = first;
+    h->undo_last_word[k] = first + words - 1;
 
-    node->window_start = start;
-    node->window_end = end;
-    node->left = NULL;     // to be init later in init_balancing_tree()
-    node->right = NULL;    // to be init later in init_balancing_tree()
-    node->size = 0;        // set as zero before any insertions happen
-    node->tau = 0;         // set as zero before any insertions happen
-    node->TAU_K = 0;       // to be init later in init_balancing_tree()
-    node->is_leaf = false; // initially set as false, and set later true only for leafs in init_balancing_tree()
-    node->parent = parent;
-
-    return node;
+    // The saved words must be in place before the record counts them
+    atomic_thread_fence(memory_order_release);
+    h->undo_segments = k + 1;
+    atomic_thread_fence(memory_order_release);
 }
 
-void init_balancing_tree(lla_node *node, int depth, int MAX_DEPTH, int WINDOW_SIZE, double TAU_0, double TAU_D)
+void undo_clear(lla *lla)
 {
-    if (!node)
-        return;
-
-    int parent_window_start = node->window_start;
-    int parent_window_end = node->window_end;
-    int mid_point = (parent_window_start + parent_window_end) / 2;
-
-    // printf("%d, %d, %d\n", parent_window_end, parent_window_start, mid_point, depth);
-    // printf("WINDOW_SIZE = %d, TAU_K = %.2f, depth = %d, MAX_DEPTH = %d, start = %d, end = %d\n", WINDOW_SIZE, node->TAU_K, depth, MAX_DEPTH, parent_window_start, parent_window_end);
+    atomic_thread_fence(memory_order_release);
+    lla->persist->header->undo_segments = 0;
+}
 
-    // Base case: if window size reached, stop recursion
-    // if (parent_window_end - parent_window_start + 1 <= WINDOW_SIZE)
-    if (depth == MAX_DEPTH)
+int lla_checkpoint(lla *lla)
+{
+    lla_persist *persist = lla->persist;
+    if (!persist || msync(persist->map, persist->map_size, MS_SYNC))
     {
-        // Set tau_k = tau_d
-        node->TAU_K = TAU_D;
-        node->is_leaf = true;
-        // printf("tau_k: %.2f\n", TAU_D);
-        return;
+        return 0;
     }
-
-    double TAU_K = TAU_0 + ((TAU_D - TAU_0) * ((double)depth / MAX_DEPTH));
-    // printf("tau_k = %f + ((%f - %f) * (%d / %d))\n", TAU_0, TAU_D, TAU_0, depth, MAX_DEPTH);
-    node->TAU_K = TAU_K;
-    // printf("tau_k: %.2f\n", TAU_K);
-
-    node->left = create_lla_node(node, parent_window_start, mid_point);
-    node->right = create_lla_node(node, mid_point + 1, parent_window_end);
-
-    init_balancing_tree(node->left, depth + 1, MAX_DEPTH, WINDOW_SIZE, TAU_0, TAU_D);
-    init_balancing_tree(node->right, depth + 1, MAX_DEPTH, WINDOW_SIZE, TAU_0, TAU_D);
+    persist->header->checkpoints++;
+    return msync(persist->map, LLA_FILE_HEADER_SIZE, MS_SYNC) == 0;
 }
 
-lla *create_lla(int N, int C, double TAU_0, double TAU_D)
+// lla_resize() of a mapped lla: spread the elements over a new file of N * C slots, make it
+// durable, then rename it over the old one. A crash before the rename leaves the old file.
+int persist_resize(lla *my_lla, int N)
 {
-    if (C <= 0 || C >= N || TAU_0 > TAU_D)
+    lla_persist *old = my_lla->persist;
+    int old_capacity = my_lla->N * my_lla->C;
+    int new_capacity = N * my_lla->C;
+
+    size_t length = strlen(old->path);
+    char *tmp_path = (char *)malloc(length + sizeof(".resize"));
+    if (!tmp_path)
     {
-        printf("Illegal coefficients: C <= 0 or C >= N or TAU_0 > TAU_D \n");
+        printf("Malloc failed\n");
         exit(1);
     }
+    memcpy(tmp_path, old->path, length);
+    memcpy(tmp_path + length, ".resize", sizeof(".resize"));
 
-    lla *my_lla = (lla *)malloc(sizeof(lla));
-    if (!my_lla)
+    lla_persist *persist = create_file(tmp_path, N, &my_lla->policy, my_lla->INITIAL_N);
+    _Atomic uint64_t *new_versions = (_Atomic uint64_t *)calloc(STRIPE_COUNT(new_capacity), sizeof(_Atomic uint64_t));
+    if (!persist || !new_versions)
     {
-        printf("Malloc failed\n");
+        printf("Cannot resize %s\n", old->path);
         exit(1);
     }
 
-    my_lla->arr = (int *)malloc(sizeof(int) * N * C);
-    if (!my_lla->arr)
+    // The old mapping stays readable until the new one is published
+    lla_key none = {0};
+    lla_value none_value = {0};
+    reserve_scratch(my_lla, my_lla->tree[ROOT].size);
+    int count = gather_range(my_lla, 0, old_capacity - 1, my_lla->scratch, my_lla->scratch_values, none, none_value, 0);
+
+    uint32_t generation = atomic_load_explicit(&my_lla->generation, memory_order_relaxed);
+    atomic_store_explicit(&my_lla->generation, generation + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+
+    _Atomic uint64_t *old_versions = my_lla->versions;
+    my_lla->versions = new_versions;
+    attach_file(my_lla, persist);
+    init_balancing_tree(my_lla);
+    spread_elements(my_lla, 0, new_capacity, my_lla->scratch, my_lla->scratch_values, count);
+    recount_subtree(my_lla, ROOT);
+    clear_jobs(my_lla);
+    persist->header->magic = LLA_FILE_MAGIC;
+    msync(persist->map, persist->map_size, MS_SYNC);
+    if (rename(tmp_path, old->path))
     {
-        printf("Malloc failed\n");
+        printf("Cannot replace %s\n", old->path);
         exit(1);
     }
+    free(persist->path);
+    persist->path = old->path;
+    old->path = null;
+    free(tmp_path);
 
-    my_lla->N = N;
-    my_lla->C = C;
-    my_lla->TAU_0 = TAU_0;
-    my_lla->TAU_D = TAU_D;
+    atomic_store_explicit(&my_lla->generation, generation + 2, memory_order_release);
+    LLA_STAT(stats_rebalance(my_lla, LLA_REBALANCE_RESIZE, ROOT, count));
 
-    // Init array first
-    zero_array(my_lla->arr, N * C);
-
-    // Create balancing tree
-    lla_node *root = create_lla_node(null, 0, (N * C) - 1);
-    my_lla->root = root;
+    lla_synchronize(my_lla);
+    unmap_file(old);
+    free((void *)old_versions);
+    return 1;
+}
 
-    // Init the balancing tree on the array
-    int WINDOW_SIZE = log_base_2(N);
-    int num_leaves = (C * N) / WINDOW_SIZE;
-    int MAX_DEPTH = log_base_2(num_leaves);
+// Write everything out and mark the file clean, so the next open trusts the tree as it is
+void persist_close(lla *lla)
+{
+    lla_persist *persist = lla->persist;
 
-    my_lla->WINDOW_SIZE = WINDOW_SIZE;
-    my_lla->MAX_DEPTH = MAX_DEPTH;
-    // printf("window size: %d\n", window_size);
-    init_balancing_tree(root, 0, MAX_DEPTH, WINDOW_SIZE, TAU_0, TAU_D);
+    lla_checkpoint(lla);
+    persist->header->state = LLA_FILE_CLEAN;
+    msync(persist->map, LLA_FILE_HEADER_SIZE, MS_SYNC);
+    unmap_file(persist);
 
-    return my_lla;
+    lla->persist = null;
+    lla->tree = null;
+    lla->arr = null;
+    lla->values = null;
+    lla->occupied = null;
 }
+// ################# EOF PERSISTENCE FUNCTIONS ###################
 
-// Should return first ansestor in threshhold or a leaf indicating that insertion is legal.
-lla_node *insert_help_recursive(lla_node *node, int *arr, int depth, int MAX_DEPTH, int x)
-{
-    if (!node)
-    {
-        return null;
-    }
+// ################# BEGIN SERIALIZATION FUNCTIONS ###################
+// lla_serialize() writes only the live elements, so the stream is independent of N, C and the
+// gaps. Layout: the magic "LLAS", then varints for the version, the key and value type names and
+// sizes, the policy (doubles as 8 little-endian bytes), N, INITIAL_N and the element count. Then
+// come the keys as zigzag varints of the difference to the previous key's LLA_KEY_TO_BITS image,
+// and finally the values as raw bytes in host byte order. Sorted integer keys mostly take one or
+// two bytes each. Loading spreads the decoded keys over the array in one pass.
+#define LLA_STREAM_MAGIC "LLAS"
+#define LLA_STREAM_VERSION 1
+#define LLA_STREAM_CHUNK (1 << 16)
+#define LLA_MAX_VARINT 10
 
-    int window_start = node->window_start;
-    int window_end = node->window_end;
-    int partition_size = window_end - window_start + 1;
-    int element_at_window_end = arr[window_end];
-    int new_size = node->size + 1;
-    double new_tau = ((double)new_size / (partition_size));
+#ifdef LLA_KEY_BITS_DEFAULT
+_Static_assert(sizeof(lla_key) <= sizeof(uint64_t), "define LLA_KEY_TO_BITS and LLA_KEY_FROM_BITS for keys wider than 64 bits");
+#define LLA_KEY_IS_FLOAT _Generic((lla_key)0, float: 1, double: 1, default: 0)
+#define LLA_KEY_TO_BITS(key) key_to_bits(key)
+#define LLA_KEY_FROM_BITS(bits) key_from_bits(bits)
 
-    if (new_tau > node->TAU_K)
+static inline uint64_t key_to_bits(lla_key key)
+{
+    if (LLA_KEY_IS_FLOAT && sizeof(lla_key) == sizeof(uint32_t))
     {
-        // printf("exceeded threshhold, return nearest anscestor in threshhold\n");
-        return node->parent; // should be node->parent
+        uint32_t bits;
+        memcpy(&bits, &key, sizeof(bits));
+        return bits;
     }
-
-    // Set new size and density after insertion
-    node->size = new_size;
-    node->tau = new_tau;
-
-    if (depth == MAX_DEPTH)
+    if (LLA_KEY_IS_FLOAT)
     {
-        return node;
+        uint64_t bits;
+        memcpy(&bits, &key, sizeof(bits));
+        return bits;
     }
+    return (uint64_t)key;
+}
 
-    if (x > element_at_window_end)
-    { /* traverse right */
-        return insert_help_recursive(node->right, arr, depth + 1, MAX_DEPTH, x);
+static inline lla_key key_from_bits(uint64_t bits)
+{
+    lla_key key;
+    if (LLA_KEY_IS_FLOAT && sizeof(lla_key) == sizeof(uint32_t))
+    {
+        uint32_t low = (uint32_t)bits;
+        memcpy(&key, &low, sizeof(low));
+        return key;
     }
-    else
-    { /* traverse left */
-        return insert_help_recursive(node->left, arr, depth + 1, MAX_DEPTH, x);
+    if (LLA_KEY_IS_FLOAT)
+    {
+        memcpy(&key, &bits, sizeof(bits));
+        return key;
     }
+    return (lla_key)bits;
 }
-lla_node *insert_help_iterative(lla_node *node, int *arr, int depth, int MAX_DEPTH, int x)
+#endif
+
+// A file descriptor behind a chunk buffer, or a caller's buffer (fd < 0)
+typedef struct byte_stream
 {
-    if(!node || !arr){
-        printf("Insert help failed, node is null");
-        exit(1);
-    }
-    while (node && depth < MAX_DEPTH)
-    {
-        int window_start = node->window_start;
-        int window_end = node->window_end;
-        int partition_size = window_end - window_start + 1;
-        int new_size = node->size + 1;
-        double new_tau = (double)new_size / partition_size;
+    int fd;
+    unsigned char *buf;
+    size_t cap;    // size of buf
+    size_t pos;    // next byte of buf to write or read
+    size_t len;    // reading: bytes of buf that hold data
+    long long total; // bytes passed through, past cap for a buffer that is too small
+    int failed;
+} byte_stream;
 
-        if (new_tau > node->TAU_K)
+static void stream_flush(byte_stream *s)
+{
+    size_t done = 0;
+    while (s->fd >= 0 && done < s->pos && !s->failed)
+    {
+        ssize_t n = write(s->fd, s->buf + done, s->pos - done);
+        if (n < 0 && errno != EINTR)
         {
-            return node->parent;
+            s->failed = 1;
         }
+        done += n > 0 ? (size_t)n : 0;
+    }
+    s->pos = 0;
+}
 
-        node->size = new_size;
-        node->tau = new_tau;
-
-        int element_at_window_end = arr[window_end];
-
-        if (x > element_at_window_end)
+static void stream_put(byte_stream *s, const void *src, size_t n)
+{
+    const unsigned char *p = (const unsigned char *)src;
+    s->total += n;
+    while (n)
+    {
+        if (s->fd >= 0 && s->pos == s->cap)
         {
-            node = node->right;
+            stream_flush(s);
         }
-        else
+        size_t room = s->pos < s->cap ? s->cap - s->pos : 0;
+        size_t take = n < room ? n : room;
+        if (s->fd < 0 && take < n)
         {
-            node = node->left;
+            // A buffer that is too small only counts the rest
+            if (take)
+            {
+                memcpy(s->buf + s->pos, p, take);
+            }
+            s->pos += n;
+            return;
         }
+        memcpy(s->buf + s->pos, p, take);
+        s->pos += take;
+        p += take;
+        n -= take;
+    }
+}
 
-        depth++;
+static void put_varint(byte_stream *s, uint64_t v)
+{
+    unsigned char tmp[LLA_MAX_VARINT];
+    int n = 0;
+    while (v >= 0x80)
+    {
+        tmp[n++] = (unsigned char)(v | 0x80);
+        v >>= 7;
     }
+    tmp[n++] = (unsigned char)v;
 
-    return node;
+    if (s->pos + n <= s->cap)
+    {
+        memcpy(s->buf + s->pos, tmp, n);
+        s->pos += n;
+        s->total += n;
+        return;
+    }
+    stream_put(s, tmp, n);
 }
 
-// a very long sorted array, and an element
-// You get the whole array, the start index where to start spreading out, the end index where to stop spreading out, the element to be inserted.
-// input arr=[......, 1, 5, 0, 0, 0, ......], start_index, end_index, x = 2
-// insert the element between start_index, end_index and include them, and then do the spreading out
-// output: [......, 1, 0, 2, 0, 5, .......] // sorted and spread out
-//
-void insert_and_distribute_array_range(int *arr, int start_index, int end_index, int x)
+static void put_double(byte_stream *s, double d)
+{
+    uint64_t bits;
+    unsigned char bytes[8];
+    memcpy(&bits, &d, sizeof(bits));
+    for (int i = 0; i < 8; i++)
+    {
+        bytes[i] = (unsigned char)(bits >> (8 * i));
+    }
+    stream_put(s, bytes, 8);
+}
+
+static void put_string(byte_stream *s, const char *str)
 {
+    size_t n = strlen(str);
+    put_varint(s, n);
+    stream_put(s, str, n);
+}
 
-    int range_size = end_index - start_index + 1;
-    int non_zero_count = 0;
-    int *temp = (int *)malloc(range_size * sizeof(int));
-    if (!temp)
+// Refill buf from the file descriptor, 0 at the end of the stream
+static int stream_fill(byte_stream *s)
+{
+    if (s->fd < 0 || s->failed)
     {
-        printf("Malloc failed\n");
-        exit(1);
+        return 0;
+    }
+    for (;;)
+    {
+        ssize_t n = read(s->fd, s->buf, s->cap);
+        if (n > 0)
+        {
+            s->pos = 0;
+            s->len = n;
+            return 1;
+        }
+        if (n == 0 || errno != EINTR)
+        {
+            s->failed = 1;
+            return 0;
+        }
     }
-    int temp_idx = 0;
-    int x_inserted = 0;
+}
 
-    for (int i = start_index; i <= end_index; i++)
+static int stream_get(byte_stream *s, void *dst, size_t n)
+{
+    unsigned char *p = (unsigned char *)dst;
+    while (n)
     {
-        if (arr[i] != 0)
+        if (s->pos == s->len && !stream_fill(s))
         {
-            if (!x_inserted && x < arr[i])
-            {
-                temp[temp_idx++] = x;
-                x_inserted = 1;
-                non_zero_count++;
-            }
-            temp[temp_idx++] = arr[i];
-            non_zero_count++;
+            return 0;
         }
+        size_t take = s->len - s->pos < n ? s->len - s->pos : n;
+        memcpy(p, s->buf + s->pos, take);
+        s->pos += take;
+        p += take;
+        n -= take;
     }
+    return 1;
+}
 
-    if (!x_inserted)
+static int get_varint(byte_stream *s, uint64_t *v)
+{
+    uint64_t result = 0;
+    for (int shift = 0; shift < 7 * LLA_MAX_VARINT; shift += 7)
     {
-        temp[temp_idx++] = x;
-        non_zero_count++;
+        if (s->pos == s->len && !stream_fill(s))
+        {
+            return 0;
+        }
+        unsigned char byte = s->buf[s->pos++];
+        result |= (uint64_t)(byte & 0x7f) << shift;
+        if (!(byte & 0x80))
+        {
+            *v = result;
+            return 1;
+        }
     }
+    return 0;
+}
 
-    for (int i = start_index; i <= end_index; i++)
+static int get_double(byte_stream *s, double *d)
+{
+    unsigned char bytes[8];
+    uint64_t bits = 0;
+    if (!stream_get(s, bytes, 8))
+    {
+        return 0;
+    }
+    for (int i = 0; i < 8; i++)
     {
-        arr[i] = 0;
+        bits |= (uint64_t)bytes[i] << (8 * i);
     }
+    memcpy(d, &bits, sizeof(bits));
+    return 1;
+}
 
-    if (non_zero_count > 0)
+// Compare a length-prefixed string of the stream against str
+static int get_string_is(byte_stream *s, const char *str, char *out, size_t out_size)
+{
+    uint64_t n;
+    if (!get_varint(s, &n) || n >= out_size || !stream_get(s, out, n))
     {
-        int spacing = range_size / non_zero_count;
-        int remainder = range_size % non_zero_count;
-        int pos = 0;
+        return 0;
+    }
+    out[n] = '\0';
+    return strcmp(out, str) == 0;
+}
 
-        for (int i = 0; i < non_zero_count; i++)
-        {
-            arr[start_index + pos] = temp[i];
+static long long serialize_to(lla *lla, byte_stream *s)
+{
+    const lla_policy *policy = &lla->policy;
+    int capacity = lla->N * lla->C;
+    int count = lla->tree[ROOT].size;
 
-            int step = spacing;
-            if (i < remainder)
-            {
-                step++;
-            }
-            pos += step;
+    stream_put(s, LLA_STREAM_MAGIC, 4);
+    put_varint(s, LLA_STREAM_VERSION);
+    put_string(s, LLA_XSTR(LLA_KEY_TYPE));
+    put_string(s, LLA_VALUE_NAME);
+    put_varint(s, sizeof(lla_key));
+    put_varint(s, LLA_HAS_VALUES ? sizeof(lla_value) : 0);
+    put_varint(s, policy->C);
+    put_varint(s, policy->leaf_size);
+    put_varint(s, policy->curve);
+    put_varint(s, policy->table_size);
+    put_double(s, policy->TAU_0);
+    put_double(s, policy->TAU_D);
+    put_double(s, policy->RHO_0);
+    put_double(s, policy->RHO_D);
+    for (int i = 0; i < policy->table_size; i++)
+    {
+        put_double(s, policy->tau_table[i]);
+        put_double(s, policy->rho_table[i]);
+    }
+    put_varint(s, lla->N);
+    put_varint(s, lla->INITIAL_N);
+    put_varint(s, count);
 
-            if (pos >= range_size && i < non_zero_count - 1)
+    uint64_t prev = 0;
+    for (int w = 0; w < OCCUPIED_WORDS(capacity); w++)
+    {
+        uint64_t bits = lla->occupied[w];
+        while (bits)
+        {
+            uint64_t key = LLA_KEY_TO_BITS(lla->arr[(w << 6) + __builtin_ctzll(bits)]);
+            int64_t delta = (int64_t)(key - prev);
+            put_varint(s, ((uint64_t)delta << 1) ^ (uint64_t)(delta >> 63));
+            prev = key;
+            bits &= bits - 1;
+        }
+    }
+    if (LLA_HAS_VALUES)
+    {
+        for (int w = 0; w < OCCUPIED_WORDS(capacity); w++)
+        {
+            uint64_t bits = lla->occupied[w];
+            while (bits)
             {
-                pos = range_size - (non_zero_count - 1 - i);
+                stream_put(s, &lla->values[(w << 6) + __builtin_ctzll(bits)], sizeof(lla_value));
+                bits &= bits - 1;
             }
         }
     }
+    stream_flush(s);
+    return s->total;
+}
+
+// Writers must not run during the call, concurrent readers may
+long long lla_serialize(lla *lla, int fd)
+{
+    unsigned char *chunk = (unsigned char *)malloc(LLA_STREAM_CHUNK);
+    if (!chunk)
+    {
+        printf("Malloc failed\n");
+        exit(1);
+    }
 
-    free(temp);
+    byte_stream s = {fd, chunk, LLA_STREAM_CHUNK, 0, 0, 0, 0};
+    long long written = serialize_to(lla, &s);
+    free(chunk);
+    return s.failed ? -1 : written;
 }
 
-// High-performance optimized version
-void insert_and_distribute_array_range_optimized(int *arr, int start_index, int end_index, int x)
+size_t lla_serialize_buffer(lla *lla, void *buf, size_t cap)
 {
-    int range_size = end_index - start_index + 1;
-    
-    // Stack allocation for small ranges to avoid malloc overhead
-    const int STACK_THRESHOLD = 1024;
-    int *temp;
-    int stack_temp[STACK_THRESHOLD];
-    
-    if (range_size <= STACK_THRESHOLD) {
-        temp = stack_temp;
-    } else {
-        temp = (int *)malloc(range_size * sizeof(int));
-        if (__builtin_expect(!temp, 0)) {
-            printf("Malloc failed\n");
-            exit(1);
-        }
+    byte_stream s = {-1, (unsigned char *)buf, buf ? cap : 0, 0, 0, 0, 0};
+    return (size_t)serialize_to(lla, &s);
+}
+
+static lla *deserialize_from(byte_stream *s)
+{
+    char magic[4], name[64];
+    uint64_t version, key_size, value_size, C, leaf_size, curve, table_size, N, INITIAL_N, count;
+    lla_policy policy;
+    memset(&policy, 0, sizeof(policy));
+
+    if (!stream_get(s, magic, 4) || memcmp(magic, LLA_STREAM_MAGIC, 4) || !get_varint(s, &version) || version != LLA_STREAM_VERSION)
+    {
+        printf("Not an lla stream\n");
+        return null;
     }
-    
-    // Single pass: collect non-zeros and insert x in sorted position
-    int temp_idx = 0;
-    int x_inserted = 0;
-    int *arr_ptr = arr + start_index;  // Pointer arithmetic optimization
-    
-    // Unroll loop for better performance
-    int i = 0;
-    int loop_end = range_size & ~3;  // Process 4 at a time
-    
-    for (; i < loop_end; i += 4) {
-        // Process 4 elements at once with manual unrolling
-        int val0 = arr_ptr[i];
-        int val1 = arr_ptr[i+1]; 
-        int val2 = arr_ptr[i+2];
-        int val3 = arr_ptr[i+3];
-        
-        // Branchless non-zero check and insertion
-        if (val0 != 0) {
-            if (!x_inserted && x < val0) {
-                temp[temp_idx++] = x;
-                x_inserted = 1;
-            }
-            temp[temp_idx++] = val0;
-        }
-        if (val1 != 0) {
-            if (!x_inserted && x < val1) {
-                temp[temp_idx++] = x;
-                x_inserted = 1;
-            }
-            temp[temp_idx++] = val1;
-        }
-        if (val2 != 0) {
-            if (!x_inserted && x < val2) {
-                temp[temp_idx++] = x;
-                x_inserted = 1;
-            }
-            temp[temp_idx++] = val2;
-        }
-        if (val3 != 0) {
-            if (!x_inserted && x < val3) {
-                temp[temp_idx++] = x;
-                x_inserted = 1;
-            }
-            temp[temp_idx++] = val3;
-        }
+    if (!get_string_is(s, LLA_XSTR(LLA_KEY_TYPE), name, sizeof(name)) || !get_string_is(s, LLA_VALUE_NAME, name, sizeof(name)) ||
+        !get_varint(s, &key_size) || key_size != sizeof(lla_key) ||
+        !get_varint(s, &value_size) || value_size != (LLA_HAS_VALUES ? sizeof(lla_value) : 0))
+    {
+        printf("The lla stream holds other key or value types than %s and %s\n", LLA_XSTR(LLA_KEY_TYPE), LLA_VALUE_NAME);
+        return null;
     }
-    
-    // Handle remaining elements
-    for (; i < range_size; i++) {
-        int val = arr_ptr[i];
-        if (val != 0) {
-            if (!x_inserted && x < val) {
-                temp[temp_idx++] = x;
-                x_inserted = 1;
-            }
-            temp[temp_idx++] = val;
-        }
+
+    int ok = get_varint(s, &C) && get_varint(s, &leaf_size) && get_varint(s, &curve) && curve <= LLA_CURVE_TABLE && get_varint(s, &table_size) &&
+             table_size <= LLA_POLICY_TABLE_SIZE && get_double(s, &policy.TAU_0) && get_double(s, &policy.TAU_D) &&
+             get_double(s, &policy.RHO_0) && get_double(s, &policy.RHO_D);
+    for (uint64_t i = 0; ok && i < table_size; i++)
+    {
+        ok = get_double(s, &policy.tau_table[i]) && get_double(s, &policy.rho_table[i]);
     }
-    
-    if (!x_inserted) {
-        temp[temp_idx++] = x;
+    ok = ok && get_varint(s, &N) && get_varint(s, &INITIAL_N) && get_varint(s, &count);
+    if (ok)
+    {
+        policy.C = (int)C;
+        policy.leaf_size = (int)leaf_size;
+        policy.curve = (lla_curve)curve;
+        policy.table_size = (int)table_size;
     }
-    
-    int non_zero_count = temp_idx;
-    
-    // Fast zero-fill using memset
-    memset(arr_ptr, 0, range_size * sizeof(int));
-    
-    // Optimized distribution with integer arithmetic
-    if (non_zero_count > 0) {
-        // Use fixed-point arithmetic to avoid repeated division
-        int spacing_fixed = (range_size << 16) / non_zero_count;  // 16-bit fixed point
-        int pos_fixed = 0;
-        
-        for (int i = 0; i < non_zero_count; i++) {
-            int pos = pos_fixed >> 16;
-            
-            // Bounds check to prevent overflow
-            if (__builtin_expect(pos >= range_size, 0)) {
-                pos = range_size - (non_zero_count - i);
-            }
-            
-            arr_ptr[pos] = temp[i];
-            pos_fixed += spacing_fixed;
-        }
+    if (!ok || C == 0 || C >= N || N > INT32_MAX / C || count > policy.TAU_0 * N * C || !lla_policy_valid(&policy))
+    {
+        printf("Corrupt lla stream\n");
+        return null;
     }
-    
-    // Only free if we used malloc
-    if (range_size > STACK_THRESHOLD) {
-        free(temp);
+
+    lla *my_lla = create_lla_with_policy((int)N, &policy);
+    my_lla->INITIAL_N = (int)INITIAL_N;
+    reserve_scratch(my_lla, (int)count);
+
+    // Decode straight into the scratch arena, then spread it like a resize would
+    uint64_t prev = 0;
+    for (uint64_t i = 0; ok && i < count; i++)
+    {
+        uint64_t zigzag;
+        ok = get_varint(s, &zigzag);
+        prev += (zigzag >> 1) ^ (0 - (zigzag & 1));
+        my_lla->scratch[i] = LLA_KEY_FROM_BITS(prev);
+        ok = ok && !(i && LLA_KEY_LESS(my_lla->scratch[i], my_lla->scratch[i - 1]));
+    }
+    if (ok && LLA_HAS_VALUES)
+    {
+        ok = stream_get(s, my_lla->scratch_values, count * sizeof(lla_value));
+    }
+    if (!ok)
+    {
+        printf("Corrupt lla stream\n");
+        free_lla(my_lla);
+        return null;
     }
+
+    spread_elements(my_lla, 0, (int)(N * C), my_lla->scratch, my_lla->scratch_values, (int)count);
+    recount_subtree(my_lla, ROOT);
+    return my_lla;
 }
 
-void insert(lla *lla, int x)
+lla *lla_deserialize(int fd)
 {
-    lla_node *root = lla->root;
-    int *arr = lla->arr;
-
-    if (root->tau >= lla->TAU_0)
-    { /* Don't insert when the array's density exceeds TAU_0 */
-        printf("insert failed: Root exceeded treshhold density. Increase N!");
+    unsigned char *chunk = (unsigned char *)malloc(LLA_STREAM_CHUNK);
+    if (!chunk)
+    {
+        printf("Malloc failed\n");
         exit(1);
     }
 
-    lla_node *node = insert_help_iterative(root, arr, 0, lla->MAX_DEPTH, x); // either a leaf, or nearest ancestor in threshhold
+    byte_stream s = {fd, chunk, LLA_STREAM_CHUNK, 0, 0, 0, 0};
+    lla *my_lla = deserialize_from(&s);
 
-    if (!node)
+    // Give back what was read past the end, so a seekable fd is left right after the lla
+    if (s.len > s.pos)
     {
-        printf("insert failed");
-        exit(1);
+        lseek(fd, -(off_t)(s.len - s.pos), SEEK_CUR);
     }
+    free(chunk);
+    return my_lla;
+}
 
-    if (node->is_leaf)
-    { // we succeeded, got a leaf
-        insert_and_distribute_array_range_optimized(arr, node->window_start, node->window_end, x);
-        // printf("insert %d, and redistribute range [%d, %d]\n", x, node->window_start, node->window_end);
-    }
-    else
-    { // we need to rebalance, got first ansestor in threshhold
-        lla_node *parent = node->parent;
+lla *lla_deserialize_buffer(const void *buf, size_t len)
+{
+    byte_stream s = {-1, (unsigned char *)buf, len, 0, len, 0, 0};
+    return deserialize_from(&s);
+}
+// ################# EOF SERIALIZATION FUNCTIONS ###################
 
-        if (!parent)
-        {
-            printf("insert failed");
-            exit(1);
-        }
+// ################# BEGIN INSTRUMENTATION FUNCTIONS ###################
+double lla_fill_ratio(lla *lla)
+{
+    lla_node *root = &lla->tree[ROOT];
+    return root->max_size ? (double)root->size / root->max_size : 1.0;
+}
 
-        insert_and_distribute_array_range_optimized(arr, parent->window_start, parent->window_end, x);
-        // printf("insert %d, and redistribute range [%d, %d]\n", x, parent->window_start, parent->window_end);
+// One CSV row per node: where its window lies, how full it is and its thresholds. Rows come in
+// BFS order, so a depth's rows form one line of a density heatmap over the array.
+void lla_export_heatmap(lla *lla, FILE *out, int max_depth)
+{
+    if (max_depth < 0 || max_depth > lla->MAX_DEPTH)
+    {
+        max_depth = lla->MAX_DEPTH;
+    }
+
+    fprintf(out, "node,depth,start,end,size,min_size,max_size,density\n");
+    for (int node = ROOT; node < (2 << max_depth); node++)
+    {
+        lla_node *n = &lla->tree[node];
+        int start = window_start(lla, node);
+        int end = window_end(lla, node);
+        fprintf(out, "%d,%d,%d,%d,%d,%d,%d,%.4f\n", node, node_depth(node), start, end, n->size, n->min_size, n->max_size,
+                (double)n->size / (end - start + 1));
     }
-    return;
 }
-// ################# EOF MAIN FUNCTIONS ###################
 
-// ################# BEGIN CLEANUP FUNCTIONS ###################
-void free_lla_tree(lla_node *node)
+#ifdef LLA_STATS
+void lla_stats_get(lla *lla, lla_stats *out)
 {
-    if (!node)
-        return;
+    *out = lla->stats;
+}
 
-    free_lla_tree(node->left);
-    free_lla_tree(node->right);
+void lla_stats_reset(lla *lla)
+{
+    memset(&lla->stats, 0, sizeof(lla->stats));
+}
 
-    free(node);
+void lla_set_rebalance_hook(lla *lla, lla_rebalance_hook hook, void *ctx)
+{
+    lla->rebalance_hook = hook;
+    lla->rebalance_ctx = ctx;
 }
+#endif
+// ################# EOF INSTRUMENTATION FUNCTIONS ###################
 
+// ################# BEGIN CLEANUP FUNCTIONS ###################
 void free_lla(lla *my_lla)
 {
     if (!my_lla)
         return;
 
-    free_lla_tree(my_lla->root);
+    pool_stop(my_lla);
+    grow_abort(my_lla);
+    if (my_lla->persist)
+    {
+        persist_close(my_lla);
+    }
+
+    if (my_lla->tree)
+        free(my_lla->tree);
 
     if (my_lla->arr)
         free(my_lla->arr);
 
+    if (my_lla->values)
+        free(my_lla->values);
+
+    if (my_lla->occupied)
+        free(my_lla->occupied);
+
+    free(my_lla->scratch);
+    free(my_lla->scratch_values);
+    free(my_lla->cdf_keys);
+    free(my_lla->cdf_ranks);
+    free((void *)my_lla->versions);
+    free(my_lla->readers);
+    free(my_lla->locks);
+    free(my_lla->job_queue);
+    free(my_lla->route_right_min);
+    free(my_lla->route_left_max);
+    free(my_lla->route_flags);
+
     free(my_lla);
 }
 
@@ -3,55 +3,362 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <stdatomic.h>
+
+// A build can pick its key/value types and comparator in a header named by LLA_CONFIG_HEADER,
+// or directly with -DLLA_KEY_TYPE=... etc.
+#ifdef LLA_CONFIG_HEADER
+#include LLA_CONFIG_HEADER
+#endif
+
+// ################# KEY / VALUE TYPES ###################
+// Keys, values and the comparator are fixed at compile time so every build gets a monomorphic
+// hot path. Keys and values live in separate arrays, so searches and gathers only touch keys.
+#ifndef LLA_KEY_TYPE
+#define LLA_KEY_TYPE int
+#ifndef LLA_KEY_LESS
+#define LLA_INT32_KEYS 1 // plain int keys ordered by <, so the kernels may use signed vector compares
+#endif
+#endif
+typedef LLA_KEY_TYPE lla_key;
+
+#ifndef LLA_KEY_LESS
+#define LLA_KEY_LESS(a, b) ((a) < (b))
+#endif
+
+// Position of a key on the real line, used by the learned CDF of lla_fit_predictor()
+#ifndef LLA_KEY_TO_DOUBLE
+#define LLA_KEY_TO_DOUBLE(key) ((double)(key))
+#endif
+
+// Lossless 64-bit image of a key for lla_serialize(), which stores the zigzag varint of the
+// difference between neighbouring images. The default takes integers as they are and float or
+// double keys by their bit pattern. Struct keys define both macros.
+#ifndef LLA_KEY_TO_BITS
+#define LLA_KEY_BITS_DEFAULT 1
+#endif
+
+#ifndef LLA_PRINT_KEY
+#define LLA_PRINT_KEY(key) printf("%lld, ", (long long)(key))
+#endif
+
+// Without LLA_VALUE_TYPE the structure is a sorted set of keys, lla->values stays NULL and every
+// value branch is compiled out.
+#ifdef LLA_VALUE_TYPE
+#define LLA_HAS_VALUES 1
+typedef LLA_VALUE_TYPE lla_value;
+#else
+#define LLA_HAS_VALUES 0
+typedef char lla_value;
+#endif
 
 // ################# MACROS ###################
 #define null NULL
 #define true 0
 #define false 1
+#define ROOT 1 // index of the root in lla->tree, the children of node i are 2i and 2i + 1
+#define LLA_APPEND_RUN 32 // inserts in a row at or past the maximum key that start an append run
+#define OCCUPIED_WORDS(slots) (((slots) + 63) / 64)
+// arr and values are allocated to whole bitmap words so a scan can load a full word of slots
+#define PADDED_SLOTS(slots) (OCCUPIED_WORDS(slots) * 64)
+// Concurrent reads: slots are versioned in stripes of 1 << LLA_STRIPE_SHIFT (a multiple of a bitmap
+// word), and at most LLA_MAX_READERS reader handles can be registered at once
+#define LLA_STRIPE_SHIFT 8
+#define STRIPE_COUNT(slots) ((PADDED_SLOTS(slots) >> LLA_STRIPE_SHIFT) + 1)
+#define LLA_MAX_READERS 64
+// Concurrent writers lock LLA_LOCKS_PER_CPU subtrees per online CPU, at most 1 << LLA_LOCK_DEPTH
+#define LLA_LOCK_DEPTH 12
+#define LLA_LOCKS_PER_CPU 8
+#define ROUTE_RIGHT_MIN 1 // route_flags bits: route_right_min / route_left_max hold a key
+#define ROUTE_LEFT_MAX 2
+// Default smallest window respread by the worker pool, see lla_set_workers()
+#define LLA_PARALLEL_SLOTS (1 << 18)
+
+// SIMD levels of the scan kernels in lla_simd.c, picked at runtime from the CPU
+#define LLA_SIMD_SCALAR 0
+#define LLA_SIMD_SSE4 1
+#define LLA_SIMD_AVX2 2
+#define LLA_SIMD_AVX512 3
+// The gather/spread kernels move 4-byte keys and values as raw 32-bit lanes
+#define LLA_SIMD_KEYS (sizeof(lla_key) == 4)
+#define LLA_SIMD_VALUES (!LLA_HAS_VALUES || sizeof(lla_value) == 4)
 
 // ################# STRUCTS ###################
+// Density policy: how large the leaves are and how the upper (TAU_K) and lower (RHO_K) density
+// thresholds move from the root (depth 0) to the leaves (depth MAX_DEPTH).
+typedef enum lla_curve {
+    LLA_CURVE_LINEAR,    // TAU_K / RHO_K linear in the depth, as in the original design
+    LLA_CURVE_GEOMETRIC, // a constant factor per level
+    LLA_CURVE_TABLE      // interpolated from tau_table / rho_table
+} lla_curve;
+
+#define LLA_POLICY_TABLE_SIZE 16
+
+typedef struct lla_policy {
+    int C;         // initial slots per unit of N, the array starts at N * C slots
+    int leaf_size; // slots per leaf window, 0 for log2(N)
+    double TAU_0;
+    double TAU_D;
+    double RHO_0;
+    double RHO_D;
+    lla_curve curve;
+    int table_size; // LLA_CURVE_TABLE: entry i holds the thresholds at depth i / (table_size - 1) * MAX_DEPTH
+    double tau_table[LLA_POLICY_TABLE_SIZE];
+    double rho_table[LLA_POLICY_TABLE_SIZE];
+} lla_policy;
+
+typedef enum lla_preset {
+    LLA_PRESET_DEFAULT,      // C = 8, TAU 0.5 -> 0.75 linear
+    LLA_PRESET_MEMORY_LEAN,  // C = 2, dense thresholds and long leaves
+    LLA_PRESET_INSERT_HEAVY, // C = 8, sparse upper levels
+    LLA_PRESET_SCAN_HEAVY    // C = 4, dense leaves of one occupancy word
+} lla_preset;
+
+// The balancing tree is implicit: nodes are stored in BFS order in one flat array and a node's
+// window is computed from its index, so a node only holds its counters, thresholds and first key.
+// The density thresholds TAU_K / RHO_K are precomputed as element counts for the node's window.
 typedef struct lla_node {
-    int window_start;
-    int window_end;
-    double tau;
-    double TAU_K;
     int size;
-    struct lla_node *left;
-    struct lla_node *right;
-    struct lla_node *parent;
-    int is_leaf;
+    int max_size; // most elements the window may hold, TAU_K * window length
+    int min_size; // fewest elements before a delete merges the window, RHO_K * window length
+    lla_key first; // smallest key in the window while size > 0, routes searches without a scan
 } lla_node;
 
+// Handle of one reader thread, see lla_reader_register(). Each handle sits on its own cache line so
+// readers on different cores never write to a shared line.
+typedef struct lla_reader {
+    _Alignas(64) _Atomic uint64_t epoch; // lla epoch seen when the current read started, 0 between reads
+    atomic_int used;
+    struct lla *lla;
+    int *seen_stripes;       // stripes read by the current attempt, with the versions seen on entry
+    uint64_t *seen_versions;
+    int seen_count;
+    int seen_cap;
+} lla_reader;
+
+// Insertion predictor: the fraction of upcoming keys expected to be <= key, non-decreasing in key
+typedef double (*lla_predictor)(void *ctx, lla_key key);
+
+// Instrumentation, compiled in with -DLLA_STATS only. Without it the counters, the hook and their
+// updates on the insert path do not exist.
+#ifdef LLA_STATS
+#define LLA_STATS_LEVELS 32        // tree depths counted, deeper rebalances count at the last one
+#define LLA_STATS_MOVED_BUCKETS 32 // bucket b counts rebalances that moved [2^b, 2^(b+1)) elements
+
+typedef enum lla_rebalance_kind {
+    LLA_REBALANCE_INSERT, // a window respread to make room for an insert
+    LLA_REBALANCE_DELETE, // an ancestor of a leaf that fell below its lower threshold
+    LLA_REBALANCE_BATCH,  // a window merged with part of a batch
+    LLA_REBALANCE_RESIZE, // the whole array, grown or shrunk
+    LLA_REBALANCE_JOB     // a deamortized rebalance job that has finished
+} lla_rebalance_kind;
+
+typedef struct lla_rebalance_event {
+    lla_rebalance_kind kind;
+    int node;  // window that was respread, ROOT for a resize
+    int depth;
+    int start;
+    int end;
+    int size;  // elements in the window afterwards
+    long long moved; // elements written
+} lla_rebalance_event;
+
+typedef void (*lla_rebalance_hook)(void *ctx, const lla_rebalance_event *event);
+
+typedef struct lla_stats {
+    long long inserts;
+    long long leaf_inserts;  // placed within their leaf, by a shift or a leaf respread
+    long long escalations;   // needed a window above their leaf
+    long long rebalances[LLA_STATS_LEVELS]; // by depth of the window, 0 is the root
+    long long moved_hist[LLA_STATS_MOVED_BUCKETS];
+    long long resizes;
+} lla_stats;
+#endif
+
 typedef struct lla {
-    lla_node *root;
-    int *arr;
-    int N;
+    lla_node *tree; // 2 << MAX_DEPTH nodes, index 0 unused
+    lla_key *arr;
+    lla_value *values;  // payload of arr[i] in values[i], NULL unless LLA_VALUE_TYPE is set
+    uint64_t *occupied; // one bit per slot of arr, set when the slot holds a key
+    int N;         // current capacity is N * C slots, doubled/halved as the array fills/empties
     int C;
+    int INITIAL_N; // capacity passed to create_lla(), never shrunk below
+    lla_policy policy; // C and the thresholds below are copied out of it
     double TAU_0;
     double TAU_D;
+    double RHO_0; // lower density threshold at the root
+    double RHO_D; // lower density threshold at the leaves
     int MAX_DEPTH;
     int WINDOW_SIZE;
+    lla_key *scratch;         // reusable buffer for batch merges, see reserve_scratch()
+    lla_value *scratch_values;
+    int scratch_cap;
+    lla_predictor predictor; // NULL for even spacing, see lla_set_predictor()
+    void *predictor_ctx;
+    double predict_mix;      // share of the free slots placed by the predictor, the rest evenly
+    double *cdf_keys;        // knots of the CDF fitted by lla_fit_predictor()
+    double *cdf_ranks;
+    int cdf_knots;
+    lla_key max_key;  // largest key, valid while max_valid is set
+    int max_valid;
+    int append_run;   // inserts in a row at or past max_key, capped at LLA_APPEND_RUN
+    _Atomic uint64_t *versions;   // seqlock per stripe of slots, see stripes_write_begin()
+    _Atomic uint32_t generation;  // seqlock on the layout (arrays, N, tree), odd during a resize
+    _Atomic uint64_t epoch;       // bumped by lla_synchronize() before freeing replaced arrays
+    lla_reader *readers;          // LLA_MAX_READERS handles
+    int lock_depth;               // concurrent writers: depth of the locked subtrees
+    int lock_target;              // lock_depth once the leaves are deep enough, from the CPU count
+    atomic_int *locks;            // one per node down to lock_depth, NULL until concurrent writers are enabled
+    lla_key *route_right_min;     // per routing node: smallest key sent right
+    lla_key *route_left_max;      // per routing node: largest key sent left
+    unsigned char *route_flags;
+    int route_dirty;              // under the exclusive layout lock: lowest node whose window holds every change, 0 if none
+    atomic_int layout_shared;     // inserts in flight
+    atomic_int layout_waiting;    // set while a writer holds or waits for the layout exclusively
+    struct lla_pool *pool;        // worker threads for large respreads, NULL without lla_set_workers()
+    int parallel_slots;           // smallest window the pool takes
+    int job_budget;   // deamortized mode: most element moves per insert, 0 when off
+    int job_node;     // window of the pending rebalance job, 0 when there is none
+    int job_start;
+    int job_end;
+    int job_total;    // elements an append layout job plans for, with room for inserts meanwhile
+    int job_mode;
+    int job_append;   // lays out like a respread during an append run, see job_target()
+    int job_cursor;   // elements left of it are in place
+    int job_run_lo;   // run of elements that move right: first slot, scan position, slot after it
+    int job_run_scan;
+    int job_run_next;
+    int job_run_hi;   // next run element to move is the last one at or before this slot
+    int *job_queue;   // pending jobs pushed aside by a newer one: node and cursor each
+    int job_queued;
+    int job_queue_cap;
+    long long job_overruns; // deamortized inserts that moved more than job_budget, see insert_deamortized()
+    struct lla *grow; // doubled arrays and tree filled in step by step, NULL unless growing
+    int grow_cursor;  // slots below it are copied into grow, see grow_step()
+    int grow_node;    // nodes of grow's tree from this index up are built
+    long long moved;  // elements written into slots by inserts, respreads, resizes and jobs
+    struct lla_persist *persist; // file the arrays and the tree live in, NULL unless lla_open_mapped()
+#ifdef LLA_STATS
+    lla_stats stats;
+    lla_rebalance_hook rebalance_hook;
+    void *rebalance_ctx;
+    long long job_moved; // moves of the pending job so far
+#endif
 } lla;
 
+// Forward iterator over the live keys in sorted order. slot is the first slot not yet visited,
+// N * C once exhausted. Like slot indices, an iterator is only valid until the next insert/delete.
+typedef struct lla_iter {
+    lla *lla;
+    int slot;
+} lla_iter;
+
+typedef void (*lla_scan_fn)(void *ctx, const lla_key *keys, size_t count);
+
 // ################# FUNCTION DECLARATIONS ###################
+// The public interface. Helpers that move elements or touch the tree without keeping it
+// consistent are declared in lla_internal.h.
 
 // Helpers
-void print_array(int *arr, int size);
-void zero_array(int *arr, int size);
+void print_array(lla_key *arr, int size);
+void zero_array(lla_key *arr, int size);
 void print_lla(lla *my_lla);
 int log_base_2(int n);
 
+// Density policy
+lla_policy lla_policy_linear(int C, double TAU_0, double TAU_D);
+lla_policy lla_policy_preset(lla_preset preset);
+int lla_policy_valid(const lla_policy *policy);
+
 // Tree setup
-lla_node *create_lla_node(lla_node *parent, int start, int end);
-void init_balancing_tree(lla_node *node, int depth, int MAX_DEPTH, int WINDOW_SIZE, double TAU_0, double TAU_D);
-lla *create_lla(int N, int C, double TAU_0, double TAU_D);
+lla *create_lla(int N, int C, double TAU_0, double TAU_D); // lla_policy_linear(C, TAU_0, TAU_D)
+lla *create_lla_with_policy(int N, const lla_policy *policy);
+int lla_resize(lla *my_lla, int N); // 1 on success, 0 if the live elements would exceed TAU_0 or N rounds to the current size (concurrent writers)
 
 // Insertions
-void insert_and_distribute_array_range(int *arr, int start_index, int end_index, int x);
-void insert(lla *lla, int x);
+void insert(lla *lla, lla_key x);                                  // value is zero-initialised
+void lla_insert_value(lla *lla, lla_key x, lla_value x_value);
+
+// Deletions
+int lla_delete(lla *lla, lla_key x); // 1 if x was removed, 0 if it was not present
+
+// Predictions
+void lla_set_predictor(lla *lla, lla_predictor predictor, void *ctx, double mix); // NULL predictor spaces evenly
+void lla_fit_predictor(lla *lla, const lla_key *sample, size_t n, int knots, double mix);
+
+// Batch insertion
+void lla_insert_batch(lla *lla, const lla_key *keys, size_t n);
+void lla_insert_batch_values(lla *lla, const lla_key *keys, const lla_value *values, size_t n);
+lla *lla_build_from_sorted(const lla_key *keys, size_t n, int C, double TAU_0, double TAU_D, double density);
+lla *lla_build_from_sorted_values(const lla_key *keys, const lla_value *values, size_t n, int C, double TAU_0, double TAU_D, double density);
+lla *lla_build_from_sorted_policy(const lla_key *keys, const lla_value *values, size_t n, const lla_policy *policy, double density);
+
+// Search
+// All lookups return a slot index into lla->arr (and lla->values), or -1 when no such key exists.
+// Slot indices are only valid until the next insert.
+int lla_find(lla *lla, lla_key x);          // slot holding x
+int lla_lower_bound(lla *lla, lla_key x);   // first key >= x
+int lla_successor(lla *lla, lla_key x);     // first key > x
+int lla_predecessor(lla *lla, lla_key x);   // last key < x
+
+// Range scans
+void lla_iter_seek(lla *lla, lla_iter *it, lla_key lo); // position at the first key >= lo
+int lla_iter_next(lla_iter *it);                        // slot of the next key, -1 when exhausted
+size_t lla_iter_fill(lla_iter *it, lla_key hi, lla_key *out, lla_value *out_values, size_t cap);
+size_t lla_scan_range(lla *lla, lla_key lo, lla_key hi, lla_key *out, size_t cap, lla_scan_fn fn, void *ctx);
+
+// Concurrent reads: any number of reader threads alongside the writers, without locks. Results are copies, since slots move under the reader.
+lla_reader *lla_reader_register(lla *lla); // NULL when LLA_MAX_READERS handles are taken
+void lla_reader_unregister(lla_reader *reader);
+int lla_read_find(lla_reader *reader, lla_key x, lla_value *value_out);                       // 1 if x is present
+int lla_read_lower_bound(lla_reader *reader, lla_key x, lla_key *key_out, lla_value *value_out); // 1 if a key >= x exists
+size_t lla_read_range(lla_reader *reader, lla_key lo, lla_key hi, lla_key *out, lla_value *out_values, size_t cap);
+size_t lla_read_scan(lla_reader *reader, lla_key lo, lla_key hi, lla_key *out, size_t cap, lla_scan_fn fn, void *ctx);
+void lla_synchronize(lla *lla); // writer side: wait until every read that started earlier has ended
+
+// Concurrent writes: after lla_enable_concurrent_writers(), insert() and lla_insert_value() may be
+// called from any number of threads at once; lla_delete() and batches take the whole structure.
+// Enable them before the writer threads start.
+void lla_enable_concurrent_writers(lla *lla);
+
+// Deamortized rebalancing: with lla_set_deamortized(lla, max_moves) an insert or delete moves at most
+// max_moves elements as long as the jobs keep up, which holds for sequential keys with max_moves >= 64
+// and for uniform ones but for a rare insert while the array grows; a hot spot needs more. An insert
+// that outruns the job in its window moves more and counts in job_overruns, but never respreads it
+// on the spot. Growing the array is spread over the operations too, see grow_step(); a mapped lla
+// still grows with lla_resize(). The array does not shrink while the mode is on. 0 finishes the
+// pending work and turns the mode off.
+void lla_set_deamortized(lla *lla, int max_moves);
+int lla_rebalance_step(lla *lla);                  // 1 while a rebalance job or the growth has work left
+
+// Persistence: the arrays and the tree live in a file mapped with mmap, see lla_open_mapped()
+lla *lla_open_mapped(const char *path, int N, const lla_policy *policy); // NULL if the file cannot be used
+int lla_checkpoint(lla *lla); // 1 once everything written so far is on disk
+
+// Serialization: live keys and values with the configuration, see lla_serialize()
+long long lla_serialize(lla *lla, int fd);                       // bytes written, -1 on a write error
+size_t lla_serialize_buffer(lla *lla, void *buf, size_t cap);   // encoded size, complete in buf if <= cap
+lla *lla_deserialize(int fd);                                   // NULL if the stream holds no valid lla
+lla *lla_deserialize_buffer(const void *buf, size_t len);
+
+// Instrumentation
+double lla_fill_ratio(lla *lla); // root size over its TAU_0 limit, the array doubles when it reaches 1
+void lla_export_heatmap(lla *lla, FILE *out, int max_depth); // CSV row per node down to max_depth, < 0 for all
+#ifdef LLA_STATS
+void lla_stats_get(lla *lla, lla_stats *out);
+void lla_stats_reset(lla *lla);
+void lla_set_rebalance_hook(lla *lla, lla_rebalance_hook hook, void *ctx); // NULL removes it
+#endif
+
+// Parallel respreads
+void lla_set_workers(lla *lla, int threads, int min_slots); // threads <= 1 stops the workers
+
+// SIMD kernels (lla_simd.c)
+int lla_set_simd_level(int level); // -1 picks the best supported level, returns the level in use; safe while kernels run
+int lla_simd_level(void);
 
 // Cleanup
-void free_lla_tree(lla_node *node);
 void free_lla(lla *my_lla);
 void cleanup_lla(lla **my_lla);
 
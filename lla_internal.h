@@ -0,0 +1,163 @@
+#ifndef LLA_INTERNAL_H
+#define LLA_INTERNAL_H
+
+// Helpers shared by lla.c, lla_simd.c and the white-box checks in main.c. They work on windows,
+// slots and tree nodes and leave keeping the tree consistent to the caller, so they are not part
+// of the interface in lla.h.
+#include "lla.h"
+
+// ################# TREE INDEXING ###################
+static inline int node_depth(int node)
+{
+    return 31 - __builtin_clz(node);
+}
+
+// Node at depth d and position p covers [p * slots / 2^d, (p + 1) * slots / 2^d), so siblings
+// split their parent's window exactly and the leaves differ in size by at most one slot.
+static inline int window_start(lla *lla, int node)
+{
+    int depth = node_depth(node);
+    long long pos = node - (1 << depth);
+    return (int)((pos * lla->N * lla->C) >> depth);
+}
+
+static inline int window_end(lla *lla, int node)
+{
+    int depth = node_depth(node);
+    long long pos = node - (1 << depth) + 1;
+    return (int)((pos * lla->N * lla->C) >> depth) - 1;
+}
+
+static inline int slot_is_live(lla *lla, int slot)
+{
+    return (lla->occupied[slot >> 6] >> (slot & 63)) & 1;
+}
+
+static inline void set_slot_live(lla *lla, int slot)
+{
+    lla->occupied[slot >> 6] |= 1ULL << (slot & 63);
+}
+
+static inline void clear_slot_live(lla *lla, int slot)
+{
+    lla->occupied[slot >> 6] &= ~(1ULL << (slot & 63));
+}
+
+// Leaf whose window contains slot, the inverse of window_start() at depth MAX_DEPTH.
+static inline int leaf_of_slot(lla *lla, int slot)
+{
+    long long pos = ((((long long)slot + 1) << lla->MAX_DEPTH) - 1) / ((long long)lla->N * lla->C);
+    return (1 << lla->MAX_DEPTH) + (int)pos;
+}
+
+// Respreads switch to the append layout while the last LLA_APPEND_RUN inserts were appends
+static inline int lla_append_mode(lla *lla)
+{
+    return lla->append_run >= LLA_APPEND_RUN;
+}
+
+// ################# FUNCTION DECLARATIONS ###################
+
+// Helpers
+int count_live_slots(lla *lla, int from, int to);
+void clear_slot_range(lla *lla, int from, int to);
+void reserve_scratch(lla *lla, int n);
+
+// Density policy
+double policy_threshold(const lla_policy *policy, int upper, double frac);
+
+// Tree setup
+void init_balancing_tree(lla *my_lla);
+lla *new_lla_handle(int N, const lla_policy *policy);
+void set_tree_shape(lla *my_lla);
+void tree_shape(const lla_policy *policy, int N, int *window_size, int *max_depth);
+void build_balancing_tree(lla *my_lla);
+
+// Insertions
+int route_right(lla *lla, int node, lla_key x);
+int insert_help_iterative(lla *lla, lla_key x);
+int insert_descend(lla *lla, int node, lla_key x);
+void insert_commit(lla *lla, int node);
+int gather_range(lla *lla, int start_index, int end_index, lla_key *dst, lla_value *dst_values, lla_key x, lla_value x_value, int insert_x);
+int gather_range_simd(lla *lla, int start_index, int end_index, lla_key *dst, lla_value *dst_values, lla_key x, lla_value x_value, int insert_x);
+void mark_spread_slots(lla *lla, int start, int range_size, int count);
+int compact_range(lla *lla, int start_index, int end_index);
+void spread_elements(lla *lla, int start, int range_size, const lla_key *src, const lla_value *src_values, int count);
+void respread_range(lla *lla, int start_index, int end_index, lla_key x, lla_value x_value, int insert_x);
+void insert_and_distribute_array_range_optimized(lla *lla, int start_index, int end_index, lla_key x, lla_value x_value);
+int insert_local_shift(lla *lla, int leaf, lla_key x, lla_value x_value);
+void note_insert(lla *lla, lla_key x);
+int insert_entry(lla *lla, lla_key x, lla_value x_value);
+
+// Deletions
+void distribute_array_range(lla *lla, int start_index, int end_index);
+int recount_subtree(lla *lla, int node);
+void update_first_keys(lla *lla, int node);
+int delete_entry(lla *lla, lla_key x);
+
+// Predictions
+double cdf_model_predict(void *ctx, lla_key key);
+double append_predict(void *ctx, lla_key key);
+void mark_predicted_slots(lla *lla, int node, const lla_key *keys, int count, int rank, lla_key x, int insert_x);
+int node_of_range(lla *lla, int start, int end);
+
+// Batch insertion
+void sort_entries(lla_key *keys, lla_value *values, size_t n);
+void merge_into_window(lla *lla, int node, const lla_key *keys, const lla_value *values, int k);
+void insert_batch_help(lla *lla, int node, const lla_key *keys, const lla_value *values, int k);
+void insert_batch_entry(lla *lla, const lla_key *keys, const lla_value *values, size_t n);
+
+// Search
+int next_live_slot(lla *lla, int from, int to);
+int prev_live_slot(lla *lla, int from, int to);
+int next_free_slot(lla *lla, int from, int to);
+int prev_free_slot(lla *lla, int from, int to);
+int first_live_slot(lla *lla, int node);
+int last_live_slot(lla *lla, int node);
+int next_live_after(lla *lla, int node);
+int prev_live_before(lla *lla, int node);
+int search_descend(lla *lla, lla_key x, int strict);
+int search_bound(lla *lla, lla_key x, int strict);
+
+// Concurrent writes
+void insert_concurrent(lla *lla, lla_key x, lla_value x_value);
+int lock_aligned_n(lla *lla, int N);
+void build_routing(lla *lla);
+void build_routing_node(lla *lla, int node);
+void layout_lock_exclusive(lla *lla);
+void layout_unlock_exclusive(lla *lla);
+
+// Deamortized rebalancing
+int live_before(lla *lla, int slot);
+void anticipate_rebalance(lla *lla, lla_key x);
+void schedule_rebalance(lla *lla, int node);
+void clear_jobs(lla *lla);
+int rebalance_step(lla *lla, int budget);
+int insert_deamortized(lla *lla, int node, lla_key x, lla_value x_value);
+int carry_work(lla *lla, int budget);
+void grow_start(lla *lla);
+void grow_step(lla *lla, int budget);
+void grow_mirror(lla *lla, int from, int to);
+void grow_finish(lla *lla);
+void grow_abort(lla *lla);
+
+// Persistence
+void undo_save(lla *lla, int start, int end);
+void undo_clear(lla *lla);
+int recover_file(lla *lla);
+int persist_resize(lla *lla, int N);
+void persist_close(lla *lla);
+
+// Parallel respreads
+int pool_acquire(lla *lla, int range_size);
+void pool_release(lla *lla);
+int parallel_gather(lla *lla, int start, int end);
+void parallel_spread(lla *lla, int start, int end, int count, lla_key x, lla_value x_value, int rank, int insert_x);
+void respread_parallel(lla *lla, int start_index, int end_index, lla_key x, lla_value x_value, int insert_x);
+
+// SIMD kernels (lla_simd.c)
+int lla_compact64(const uint32_t *src, uint64_t bits, uint32_t *dst);
+int lla_expand64(const uint32_t *src, uint64_t bits, uint32_t *dst);
+int lla_rank32(const int32_t *keys, int n, int32_t x);
+
+#endif
@@ -0,0 +1,420 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include "lla_internal.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define LLA_X86 1
+#else
+#define LLA_X86 0
+#endif
+
+// ################# BEGIN SCALAR KERNELS ###################
+// Copy the 32-bit lanes of src whose bit is set in bits to the front of dst, in order, and return
+// how many were written. Nothing past that count is touched, and dst may alias src as long as it
+// does not start after src's first set lane.
+static int compact64_scalar(const uint32_t *src, uint64_t bits, uint32_t *dst)
+{
+    int count = 0;
+    while (bits)
+    {
+        dst[count++] = src[__builtin_ctzll(bits)];
+        bits &= bits - 1;
+    }
+    return count;
+}
+
+// Inverse of compact64: the i-th lane of src goes to the slot of the i-th set bit of bits. Reads
+// and returns popcount(bits) lanes of src. The vector versions also write the unset lanes of every
+// non-empty 8-lane group, so dst must be a whole word of slots whose unset lanes are free.
+static int expand64_scalar(const uint32_t *src, uint64_t bits, uint32_t *dst)
+{
+    int count = 0;
+    while (bits)
+    {
+        dst[__builtin_ctzll(bits)] = src[count++];
+        bits &= bits - 1;
+    }
+    return count;
+}
+
+// Number of keys in keys[0, n) that are <= x, i.e. where x goes after its equals.
+static int rank32_scalar(const int32_t *keys, int n, int32_t x)
+{
+    int rank = 0;
+    for (int i = 0; i < n; i++)
+    {
+        rank += keys[i] <= x;
+    }
+    return rank;
+}
+// ################# EOF SCALAR KERNELS ###################
+
+// ################# BEGIN X86 KERNELS ###################
+#if LLA_X86
+// Left-pack permutations: row m lists the lanes whose bit is set in m, lowest first
+static uint32_t avx2_pack_table[256][8] __attribute__((aligned(32)));
+static uint8_t sse_pack_table[16][16] __attribute__((aligned(16)));
+// Expand permutations: lane j of row m takes source lane popcount(m & ((1 << j) - 1))
+static uint32_t avx2_unpack_table[256][8] __attribute__((aligned(32)));
+
+static void init_pack_tables(void)
+{
+    for (int m = 0; m < 256; m++)
+    {
+        int k = 0;
+        for (int lane = 0; lane < 8; lane++)
+        {
+            if (m & (1 << lane))
+            {
+                avx2_pack_table[m][k++] = lane;
+            }
+        }
+        while (k < 8)
+        {
+            avx2_pack_table[m][k++] = 0;
+        }
+
+        for (int lane = 0; lane < 8; lane++)
+        {
+            avx2_unpack_table[m][lane] = __builtin_popcount(m & ((1 << lane) - 1));
+        }
+    }
+
+    for (int m = 0; m < 16; m++)
+    {
+        int k = 0;
+        for (int lane = 0; lane < 4; lane++)
+        {
+            if (m & (1 << lane))
+            {
+                for (int b = 0; b < 4; b++)
+                {
+                    sse_pack_table[m][4 * k + b] = (uint8_t)(4 * lane + b);
+                }
+                k++;
+            }
+        }
+        for (int b = 4 * k; b < 16; b++)
+        {
+            sse_pack_table[m][b] = 0x80;
+        }
+    }
+}
+
+// The whole word is loaded before anything is stored, and a group whose full vector would run past
+// the word's live lanes is stored with a lane mask, so dst may alias src as in compact_range()
+__attribute__((target("avx2")))
+static int compact64_avx2(const uint32_t *src, uint64_t bits, uint32_t *dst)
+{
+    __m256i lanes[8];
+    for (int group = 0; group < 8; group++)
+    {
+        lanes[group] = _mm256_loadu_si256((const __m256i *)(src + 8 * group));
+    }
+
+    const __m256i lane_index = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+    int total = __builtin_popcountll(bits);
+    int count = 0;
+    for (int group = 0; bits; group++, bits >>= 8)
+    {
+        unsigned mask = bits & 0xff;
+        if (!mask)
+        {
+            continue;
+        }
+
+        __m256i perm = _mm256_load_si256((const __m256i *)avx2_pack_table[mask]);
+        __m256i packed = _mm256_permutevar8x32_epi32(lanes[group], perm);
+        int n = __builtin_popcount(mask);
+        if (count + 8 <= total)
+        {
+            _mm256_storeu_si256((__m256i *)(dst + count), packed);
+        }
+        else
+        {
+            __m256i keep = _mm256_cmpgt_epi32(_mm256_set1_epi32(n), lane_index);
+            _mm256_maskstore_epi32((int *)(dst + count), keep, packed);
+        }
+        count += n;
+    }
+    return count;
+}
+
+__attribute__((target("avx2")))
+static int expand64_avx2(const uint32_t *src, uint64_t bits, uint32_t *dst)
+{
+    int count = 0;
+    for (int group = 0; bits; group++, bits >>= 8)
+    {
+        unsigned mask = bits & 0xff;
+        if (!mask)
+        {
+            continue;
+        }
+
+        __m256i lanes = _mm256_loadu_si256((const __m256i *)(src + count));
+        __m256i perm = _mm256_load_si256((const __m256i *)avx2_unpack_table[mask]);
+        _mm256_storeu_si256((__m256i *)(dst + 8 * group), _mm256_permutevar8x32_epi32(lanes, perm));
+        count += __builtin_popcount(mask);
+    }
+    return count;
+}
+
+__attribute__((target("avx2")))
+static int rank32_avx2(const int32_t *keys, int n, int32_t x)
+{
+    __m256i pivot = _mm256_set1_epi32(x);
+    int greater = 0;
+    int i = 0;
+    for (; i + 8 <= n; i += 8)
+    {
+        __m256i gt = _mm256_cmpgt_epi32(_mm256_loadu_si256((const __m256i *)(keys + i)), pivot);
+        greater += __builtin_popcount(_mm256_movemask_ps(_mm256_castsi256_ps(gt)));
+    }
+    return i - greater + rank32_scalar(keys + i, n - i, x);
+}
+
+// AVX-512 has the compress/expand instructions themselves, and its masked stores write exactly
+// the live lanes
+__attribute__((target("avx512f")))
+static int compact64_avx512(const uint32_t *src, uint64_t bits, uint32_t *dst)
+{
+    int count = 0;
+    for (int group = 0; bits; group++, bits >>= 16)
+    {
+        __mmask16 mask = bits & 0xffff;
+        if (!mask)
+        {
+            continue;
+        }
+
+        __m512i lanes = _mm512_loadu_si512((const void *)(src + 16 * group));
+        _mm512_mask_compressstoreu_epi32((void *)(dst + count), mask, lanes);
+        count += __builtin_popcount(mask);
+    }
+    return count;
+}
+
+__attribute__((target("avx512f")))
+static int expand64_avx512(const uint32_t *src, uint64_t bits, uint32_t *dst)
+{
+    int count = 0;
+    for (int group = 0; bits; group++, bits >>= 16)
+    {
+        __mmask16 mask = bits & 0xffff;
+        if (!mask)
+        {
+            continue;
+        }
+
+        __m512i lanes = _mm512_maskz_expandloadu_epi32(mask, (const void *)(src + count));
+        _mm512_mask_storeu_epi32((void *)(dst + 16 * group), mask, lanes);
+        count += __builtin_popcount(mask);
+    }
+    return count;
+}
+
+__attribute__((target("sse4.1")))
+static int compact64_sse4(const uint32_t *src, uint64_t bits, uint32_t *dst)
+{
+    __m128i lanes[16];
+    for (int group = 0; group < 16; group++)
+    {
+        lanes[group] = _mm_loadu_si128((const __m128i *)(src + 4 * group));
+    }
+
+    int total = __builtin_popcountll(bits);
+    int count = 0;
+    for (int group = 0; bits; group++, bits >>= 4)
+    {
+        unsigned mask = bits & 0xf;
+        if (!mask)
+        {
+            continue;
+        }
+
+        __m128i shuffle = _mm_load_si128((const __m128i *)sse_pack_table[mask]);
+        __m128i packed = _mm_shuffle_epi8(lanes[group], shuffle);
+        int n = __builtin_popcount(mask);
+        if (count + 4 <= total)
+        {
+            _mm_storeu_si128((__m128i *)(dst + count), packed);
+        }
+        else
+        {
+            uint32_t last[4];
+            _mm_storeu_si128((__m128i *)last, packed);
+            memcpy(dst + count, last, n * sizeof(uint32_t));
+        }
+        count += n;
+    }
+    return count;
+}
+#endif
+// ################# EOF X86 KERNELS ###################
+
+// ################# BEGIN DISPATCH ###################
+// One table per level. lla_set_simd_level() publishes a table with a single atomic store, so a
+// kernel call racing with it runs entirely on either the old or the new level.
+typedef struct simd_kernels
+{
+    int level;
+    int (*compact64)(const uint32_t *, uint64_t, uint32_t *);
+    int (*expand64)(const uint32_t *, uint64_t, uint32_t *);
+    int (*rank32)(const int32_t *, int, int32_t);
+} simd_kernels;
+
+static const simd_kernels kernel_tables[] = {
+    {LLA_SIMD_SCALAR, compact64_scalar, expand64_scalar, rank32_scalar},
+#if LLA_X86
+    {LLA_SIMD_SSE4, compact64_sse4, expand64_scalar, rank32_scalar},
+    {LLA_SIMD_AVX2, compact64_avx2, expand64_avx2, rank32_avx2},
+    {LLA_SIMD_AVX512, compact64_avx512, expand64_avx512, rank32_avx2},
+#endif
+};
+
+static _Atomic(const simd_kernels *) kernels = NULL;
+static pthread_once_t pack_tables_once = PTHREAD_ONCE_INIT;
+
+// The kernel table in use, picking the best supported level on first use
+static inline const simd_kernels *current_kernels(void)
+{
+    const simd_kernels *k = atomic_load_explicit(&kernels, memory_order_acquire);
+    if (__builtin_expect(!k, 0))
+    {
+        lla_set_simd_level(-1);
+        k = atomic_load_explicit(&kernels, memory_order_acquire);
+    }
+    return k;
+}
+
+static int detect_simd_level(void)
+{
+    const char *forced = getenv("LLA_SIMD");
+    int best = LLA_SIMD_SCALAR;
+
+#if LLA_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse4.1"))
+    {
+        best = LLA_SIMD_SSE4;
+    }
+    if (__builtin_cpu_supports("avx2"))
+    {
+        best = LLA_SIMD_AVX2;
+    }
+    if (__builtin_cpu_supports("avx512f"))
+    {
+        best = LLA_SIMD_AVX512;
+    }
+#endif
+
+    // LLA_SIMD=scalar|sse4|avx2|avx512 caps the level, e.g. to compare against the scalar kernels
+    static const char *names[] = {"scalar", "sse4", "avx2", "avx512"};
+    for (int level = 0; forced && level < best; level++)
+    {
+        if (strcmp(forced, names[level]) == 0)
+        {
+            best = level;
+        }
+    }
+    return best;
+}
+
+int lla_set_simd_level(int level)
+{
+    int supported = detect_simd_level();
+    if (level < 0 || level > supported)
+    {
+        level = supported;
+    }
+
+#if LLA_X86
+    pthread_once(&pack_tables_once, init_pack_tables);
+#endif
+
+    atomic_store_explicit(&kernels, &kernel_tables[level], memory_order_release);
+    return level;
+}
+
+int lla_simd_level(void)
+{
+    return current_kernels()->level;
+}
+
+#ifdef LLA_CHECK_KERNELS
+// Debug builds (-DLLA_CHECK_KERNELS) rerun every vector call with the scalar kernel and abort on
+// the first difference in the lanes the caller may read
+static void check_lanes(const char *kernel, int level, const uint32_t *got, const uint32_t *want, uint64_t bits, int by_bit, int count, int want_count)
+{
+    int ok = count == want_count;
+    for (int i = 0; ok && i < 64; i++)
+    {
+        if (by_bit ? (int)((bits >> i) & 1) : i < count)
+        {
+            ok = got[i] == want[i];
+        }
+    }
+    if (!ok)
+    {
+        printf("%s kernel at level %d disagrees with the scalar kernel\n", kernel, level);
+        fflush(stdout);
+        abort();
+    }
+}
+#endif
+
+int lla_compact64(const uint32_t *src, uint64_t bits, uint32_t *dst)
+{
+    const simd_kernels *k = current_kernels();
+#ifdef LLA_CHECK_KERNELS
+    // The scalar result is taken first since lla_resize() compacts in place
+    uint32_t want[64];
+    int want_count = compact64_scalar(src, bits, want);
+    int count = k->compact64(src, bits, dst);
+    check_lanes("compact", k->level, dst, want, bits, 0, count, want_count);
+    return count;
+#else
+    return k->compact64(src, bits, dst);
+#endif
+}
+
+int lla_expand64(const uint32_t *src, uint64_t bits, uint32_t *dst)
+{
+    const simd_kernels *k = current_kernels();
+#ifdef LLA_CHECK_KERNELS
+    // Callers never let src overlap the word being written (respread_range() expands from a packed
+    // run that ends below it), so src is unchanged by the vector call and the scalar reference can
+    // be taken afterwards. Only the set lanes are compared, since the vector kernels also write the
+    // unset lanes of every non-empty group.
+    uint32_t want[64];
+    int count = k->expand64(src, bits, dst);
+    int want_count = expand64_scalar(src, bits, want);
+    check_lanes("expand", k->level, dst, want, bits, 1, count, want_count);
+    return count;
+#else
+    return k->expand64(src, bits, dst);
+#endif
+}
+
+int lla_rank32(const int32_t *keys, int n, int32_t x)
+{
+    const simd_kernels *k = current_kernels();
+#ifdef LLA_CHECK_KERNELS
+    int rank = k->rank32(keys, n, x);
+    if (rank != rank32_scalar(keys, n, x))
+    {
+        printf("rank kernel at level %d disagrees with the scalar kernel\n", k->level);
+        fflush(stdout);
+        abort();
+    }
+    return rank;
+#else
+    return k->rank32(keys, n, x);
+#endif
+}
+// ################# EOF DISPATCH ###################
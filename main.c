@@ -1,224 +1,1836 @@
-#include "lla.h"
+#include "lla_internal.h"
 #include <time.h>
-#include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/wait.h>
+
+// Correctness checks, run by `make test`. Timings live in bench.c behind `make bench`.
+
+static int failures = 0;
+
+static int check(int ok, const char *test, const char *what)
+{
+    if (!ok)
+    {
+        printf("FAILED %s: %s\n", test, what);
+        failures++;
+    }
+    return ok;
+}
+
+static int compare_ints(const void *a, const void *b)
+{
+    int x = *(const int *)a, y = *(const int *)b;
+    return (x > y) - (x < y);
+}
+
+// Keys in order, every node's size and first key match the bitmap and the root holds expected elements
+int check_structure(lla *my_lla, int expected, const char *test)
+{
+    int capacity = my_lla->N * my_lla->C;
+    int live = 0;
+    lla_key prev = 0;
+    int ok = 1;
+
+    for (int slot = 0; slot < capacity; slot++)
+    {
+        if (slot_is_live(my_lla, slot))
+        {
+            ok &= live == 0 || my_lla->arr[slot] >= prev;
+            prev = my_lla->arr[slot];
+            live++;
+        }
+    }
+    for (int node = ROOT; node < (2 << my_lla->MAX_DEPTH); node++)
+    {
+        int start = window_start(my_lla, node);
+        int end = window_end(my_lla, node);
+        int first = next_live_slot(my_lla, start, end);
+        ok &= my_lla->tree[node].size == count_live_slots(my_lla, start, end);
+        ok &= first == -1 || my_lla->tree[node].first == my_lla->arr[first];
+    }
+    check(ok, test, "keys out of order or node sizes off");
+    return check(live == expected && my_lla->tree[ROOT].size == expected, test, "wrong element count") && ok;
+}
+
+// The live keys of my_lla equal the sorted keys[0..n)
+int check_contents(lla *my_lla, int *keys, int n, const char *test)
+{
+    int capacity = my_lla->N * my_lla->C;
+    int i = 0;
+
+    qsort(keys, n, sizeof(int), compare_ints);
+    for (int slot = 0; slot < capacity && i <= n; slot++)
+    {
+        if (slot_is_live(my_lla, slot) && (i == n || my_lla->arr[slot] != keys[i++]))
+        {
+            return check(0, test, "contents differ from the inserted keys");
+        }
+    }
+    return check(i == n, test, "contents differ from the inserted keys");
+}
+
+// lla_find, lla_lower_bound, lla_successor and lla_predecessor of x agree with the sorted keys
+// ref[0..n)
+int check_bounds(lla *my_lla, const int *ref, int n, int x, const char *test)
+{
+    int lo = 0;
+    int hi = n;
+    while (lo < hi)
+    {
+        int mid = (lo + hi) / 2;
+        ref[mid] < x ? (lo = mid + 1) : (hi = mid);
+    }
+    int lower = lo; // first key >= x
+    hi = n;
+    while (lo < hi)
+    {
+        int mid = (lo + hi) / 2;
+        ref[mid] <= x ? (lo = mid + 1) : (hi = mid);
+    }
+    int upper = lo; // first key > x
+
+    int slot = lla_lower_bound(my_lla, x);
+    int ok = lower == n ? slot == -1 : slot != -1 && my_lla->arr[slot] == ref[lower];
+    slot = lla_successor(my_lla, x);
+    ok &= upper == n ? slot == -1 : slot != -1 && my_lla->arr[slot] == ref[upper];
+    slot = lla_predecessor(my_lla, x);
+    ok &= lower == 0 ? slot == -1 : slot != -1 && my_lla->arr[slot] == ref[lower - 1];
+    slot = lla_find(my_lla, x);
+    ok &= upper > lower ? slot != -1 && my_lla->arr[slot] == x : slot == -1;
+    return check(ok, test, "lookup disagrees with the sorted keys");
+}
+
+// Insert n random keys from [0, 4n), each with the value key * 3 + 7, and delete a random live one
+// after every delete_every inserts (0 for none). keys gets the live keys; returns their count.
+int fill_random(lla *my_lla, int *keys, int n, int delete_every)
+{
+    int count = 0;
+    for (int i = 0; i < n; i++)
+    {
+        keys[count] = rand() % (4 * n);
+        lla_insert_value(my_lla, keys[count], (lla_value)(keys[count] * 3 + 7));
+        count++;
+        if (delete_every && i % delete_every == delete_every - 1)
+        {
+            int victim = rand() % count;
+            lla_delete(my_lla, keys[victim]);
+            keys[victim] = keys[--count];
+        }
+    }
+    return count;
+}
+
+void test_insert_delete(void)
+{
+    const int n = 100000;
+    lla *my_lla = create_lla(64, 8, 0.5, 0.75);
+    int *keys = malloc(n * sizeof(int));
+    int count = 0;
+
+    for (int i = 0; i < n; i++)
+    {
+        keys[count] = rand() % (4 * n);
+        insert(my_lla, keys[count++]);
+        if (i % 3 == 2)
+        {
+            int victim = rand() % count;
+            check(lla_delete(my_lla, keys[victim]) == 1, "insert_delete", "delete of a present key failed");
+            keys[victim] = keys[--count];
+        }
+    }
+    check_structure(my_lla, count, "insert_delete");
+    int within = 1;
+    for (int node = ROOT; node < (2 << my_lla->MAX_DEPTH); node++)
+    {
+        within &= my_lla->tree[node].size <= my_lla->tree[node].max_size;
+    }
+    check(within, "insert_delete", "node above its max_size");
+    for (int i = 0; i < count; i += 97)
+    {
+        check(lla_find(my_lla, keys[i]) >= 0, "insert_delete", "inserted key not found");
+    }
+    check_contents(my_lla, keys, count, "insert_delete");
+
+    // Lookups against the sorted keys, which hold duplicates at this density: random keys, keys
+    // around the ends, and keys around the first key of every leaf, where the search crosses from
+    // one window to the next
+    for (int i = 0; i < 20000; i++)
+    {
+        if (!check_bounds(my_lla, keys, count, rand() % (4 * n + 20) - 10, "insert_delete"))
+        {
+            break;
+        }
+    }
+    int ends[] = {keys[0] - 1, keys[0], keys[0] + 1, keys[count - 1] - 1, keys[count - 1], keys[count - 1] + 1};
+    for (int i = 0; i < 6; i++)
+    {
+        check_bounds(my_lla, keys, count, ends[i], "insert_delete");
+    }
+    for (int leaf = 1 << my_lla->MAX_DEPTH; leaf < 2 << my_lla->MAX_DEPTH; leaf += 7)
+    {
+        int slot = next_live_slot(my_lla, window_start(my_lla, leaf), window_end(my_lla, leaf));
+        if (slot != -1)
+        {
+            check_bounds(my_lla, keys, count, my_lla->arr[slot] - 1, "insert_delete");
+            check_bounds(my_lla, keys, count, my_lla->arr[slot], "insert_delete");
+        }
+    }
+
+    // Emptying the array shrinks it back to its initial size
+    while (count)
+    {
+        lla_delete(my_lla, keys[--count]);
+    }
+    check(my_lla->N == 64, "insert_delete", "array not shrunk back after deleting every key");
+    check_structure(my_lla, 0, "insert_delete");
+
+    free(keys);
+    cleanup_lla(&my_lla);
+
+    // In an array sparser than every lower threshold, at its initial size, deletes respread
+    // nothing, so deleting every key of a leaf leaves it empty and the searches have to cross it.
+    // Every key of the range is looked up.
+    const int few = 100;
+    my_lla = create_lla(1024, 8, 0.5, 0.75);
+    int sparse[100];
+    for (int i = 0; i < few; i++)
+    {
+        sparse[i] = rand() % 1000;
+        insert(my_lla, sparse[i]);
+    }
+    check_contents(my_lla, sparse, few, "insert_delete");
+    int leaf = leaf_of_slot(my_lla, lla_find(my_lla, sparse[few / 2]));
+    int start = window_start(my_lla, leaf);
+    int end = window_end(my_lla, leaf);
+    count = few;
+    for (int slot = next_live_slot(my_lla, start, end); slot != -1; slot = next_live_slot(my_lla, start, end))
+    {
+        int x = my_lla->arr[slot];
+        lla_delete(my_lla, x);
+        for (int i = 0; i < count; i++)
+        {
+            if (sparse[i] == x)
+            {
+                sparse[i] = sparse[--count];
+                break;
+            }
+        }
+    }
+    check(my_lla->tree[leaf].size == 0, "insert_delete", "leaf not emptied by its deletes");
+    check_structure(my_lla, count, "insert_delete");
+    check_contents(my_lla, sparse, count, "insert_delete");
+    for (int x = -2; x <= 1002; x++)
+    {
+        if (!check_bounds(my_lla, sparse, count, x, "insert_delete"))
+        {
+            break;
+        }
+    }
+    cleanup_lla(&my_lla);
+}
+
+// Keys handed to lla_scan_range()'s callback, chunk by chunk
+typedef struct scan_log
+{
+    lla_key *keys;
+    size_t count;
+    size_t cap;  // chunk size asked for
+    int bad;     // a chunk was empty or larger than cap
+} scan_log;
+
+static void log_chunk(void *ctx, const lla_key *keys, size_t count)
+{
+    scan_log *log = ctx;
+    log->bad |= count == 0 || count > log->cap;
+    memcpy(log->keys + log->count, keys, count * sizeof(lla_key));
+    log->count += count;
+}
+
+// lla_scan_range() and lla_iter_next() over random [lo, hi] against the sorted keys, with chunk
+// sizes from 1 up so that chunks end inside and between occupancy words, and empty ranges: lo past
+// hi, below the smallest key, above the largest and between two neighbouring keys
+void test_range_scan(void)
+{
+    const int n = 50000;
+    lla *my_lla = create_lla(64, 8, 0.5, 0.75);
+    int *keys = malloc(n * sizeof(int));
+    lla_key *out = malloc(n * sizeof(lla_key));
+    scan_log log = {malloc(n * sizeof(lla_key)), 0, 0, 0};
+    const size_t caps[] = {1, 3, 64, 100, 1000, 50000};
+
+    for (int i = 0; i < n; i++)
+    {
+        keys[i] = rand() % (4 * n);
+        insert(my_lla, keys[i]);
+    }
+    check_contents(my_lla, keys, n, "range_scan");
+
+    for (int round = 0; round < 400; round++)
+    {
+        int lo = rand() % (4 * n + 20) - 10;
+        int hi = round % 4 == 0 ? lo + rand() % 64 : rand() % (4 * n + 20) - 10;
+        if (round % 50 == 1)
+        {
+            int i = rand() % (n - 1);
+            lo = keys[i] + 1;
+            hi = keys[i + 1] - 1; // empty unless the two keys are further apart
+        }
+        lo = round == 2 ? -20 : round == 3 ? 4 * n : lo;
+        hi = round == 2 ? -10 : round == 3 ? 4 * n + 10 : hi;
+
+        int first = 0;
+        while (first < n && keys[first] < lo)
+        {
+            first++;
+        }
+        int last = first;
+        while (last < n && keys[last] <= hi)
+        {
+            last++;
+        }
+        size_t expected = lo <= hi ? (size_t)(last - first) : 0;
+
+        log.count = 0;
+        log.cap = caps[round % 6];
+        log.bad = 0;
+        size_t visited = lla_scan_range(my_lla, lo, hi, out, log.cap, log_chunk, &log);
+        int ok = visited == expected && log.count == expected && !log.bad;
+        for (size_t i = 0; ok && i < expected; i++)
+        {
+            ok = log.keys[i] == keys[first + i];
+        }
+        size_t head = lla_scan_range(my_lla, lo, hi, out, log.cap, null, null);
+        ok &= head == (expected < log.cap ? expected : log.cap);
+        for (size_t i = 0; ok && i < head; i++)
+        {
+            ok = out[i] == keys[first + i];
+        }
+
+        lla_iter it;
+        lla_iter_seek(my_lla, &it, lo);
+        size_t stepped = 0;
+        for (int slot = lla_iter_next(&it); slot != -1 && my_lla->arr[slot] <= hi; slot = lla_iter_next(&it))
+        {
+            ok &= stepped < expected && my_lla->arr[slot] == keys[first + stepped];
+            stepped++;
+        }
+        ok &= stepped == expected;
+        if (!check(ok, "range_scan", "scan or iterator disagrees with the sorted keys"))
+        {
+            break;
+        }
+    }
+
+    // A full pass with the iterator ends exactly at the last key and stays exhausted
+    lla_iter it;
+    lla_iter_seek(my_lla, &it, keys[0]);
+    int steps = 0;
+    while (lla_iter_next(&it) != -1)
+    {
+        steps++;
+    }
+    check(steps == n && lla_iter_next(&it) == -1, "range_scan", "iterator did not visit every key once");
+
+    free(log.keys);
+    free(out);
+    free(keys);
+    cleanup_lla(&my_lla);
+}
+
+void test_policy_table(void)
+{
+    lla_policy policy = lla_policy_linear(8, 0.5, 0.75);
+    double tau[4] = {0.5, 0.6, 0.7, 0.75};
+    double rho[4] = {0.1, 0.08, 0.06, 0.05};
+
+    policy.curve = LLA_CURVE_TABLE;
+    policy.table_size = 4;
+    policy.RHO_0 = 0.1;
+    policy.RHO_D = 0.05;
+    memcpy(policy.tau_table, tau, sizeof(tau));
+    memcpy(policy.rho_table, rho, sizeof(rho));
+    check(lla_policy_valid(&policy), "policy_table", "valid table rejected");
+
+    policy.tau_table[3] = 0.9;
+    check(!lla_policy_valid(&policy), "policy_table", "table not ending at TAU_D accepted");
+    policy.tau_table[3] = 0.75;
+    policy.tau_table[2] = 0.55;
+    check(!lla_policy_valid(&policy), "policy_table", "falling tau_table accepted");
+    policy.tau_table[2] = 0.7;
+    policy.rho_table[2] = 0.09;
+    check(!lla_policy_valid(&policy), "policy_table", "rising rho_table accepted");
+
+    // A geometric curve rises by the same factor at every level, from TAU_0 at the root to TAU_D at
+    // the leaves, and the node thresholds follow it
+    policy = lla_policy_preset(LLA_PRESET_SCAN_HEAVY);
+    lla *my_lla = create_lla_with_policy(1 << 14, &policy);
+    int depth_max = my_lla->MAX_DEPTH;
+    double factor = pow(policy.TAU_D / policy.TAU_0, 1.0 / depth_max);
+    int ok = policy_threshold(&policy, 1, 0) == policy.TAU_0 && fabs(policy_threshold(&policy, 1, 1) - policy.TAU_D) < 1e-12;
+    for (int depth = 0; depth <= depth_max; depth++)
+    {
+        double tau = policy_threshold(&policy, 1, (double)depth / depth_max);
+        int node = 1 << depth;
+        ok &= tau >= policy.TAU_0 && tau <= policy.TAU_D + 1e-12;
+        ok &= depth == 0 || fabs(tau / policy_threshold(&policy, 1, (double)(depth - 1) / depth_max) - factor) < 1e-9;
+        ok &= my_lla->tree[node].max_size == (int)(tau * (window_end(my_lla, node) - window_start(my_lla, node) + 1));
+    }
+    check(ok, "policy_table", "geometric thresholds do not rise by a constant factor from TAU_0 to TAU_D");
+    cleanup_lla(&my_lla);
+
+    // Every preset builds and keeps each node between its thresholds: inserts never take a node
+    // past max_size, and a delete that takes its leaf below min_size respreads the nearest
+    // ancestor at or above its own, which lifts the leaf back to within one element of it (min_size
+    // rounds up, the even spread may round down). Only a leaf without such an ancestor stays below.
+    for (lla_preset preset = LLA_PRESET_DEFAULT; preset <= LLA_PRESET_SCAN_HEAVY; preset++)
+    {
+        const int n = 40000;
+        policy = lla_policy_preset(preset);
+        check(lla_policy_valid(&policy), "policy_table", "preset rejected by lla_policy_valid");
+        my_lla = create_lla_with_policy(1 << 10, &policy);
+        int *keys = malloc(n * sizeof(int));
+        int count = 0;
+        ok = 1;
+        for (int i = 0; i < 2 * n && ok; i++)
+        {
+            if (i < n)
+            {
+                keys[count] = rand() % (4 * n);
+                insert(my_lla, keys[count++]);
+            }
+            if (i >= n / 2 && i % 2)
+            {
+                int victim = rand() % count;
+                int leaf = leaf_of_slot(my_lla, lla_find(my_lla, keys[victim]));
+                int N = my_lla->N;
+                lla_delete(my_lla, keys[victim]);
+                keys[victim] = keys[--count];
+
+                int dense = 0;
+                for (int node = leaf / 2; node && N == my_lla->N; node /= 2)
+                {
+                    dense |= my_lla->tree[node].size >= my_lla->tree[node].min_size;
+                }
+                ok &= N != my_lla->N || !dense || my_lla->tree[leaf].size >= my_lla->tree[leaf].min_size - 1;
+            }
+            for (int node = ROOT; i % 1000 == 999 && node < (2 << my_lla->MAX_DEPTH); node++)
+            {
+                ok &= my_lla->tree[node].size <= my_lla->tree[node].max_size;
+            }
+        }
+        check(ok, "policy_table", "node outside its thresholds under a preset");
+        check_structure(my_lla, count, "policy_table");
+        check_contents(my_lla, keys, count, "policy_table");
+        free(keys);
+        cleanup_lla(&my_lla);
+    }
+}
+
+// Batches of any size, unsorted and with repeated keys, hold the same keys as inserting them one
+// at a time
+void test_insert_batch(void)
+{
+    const int n = 60000;
+    lla *batched = create_lla(64, 8, 0.5, 0.75);
+    lla *single = create_lla(64, 8, 0.5, 0.75);
+    int *keys = malloc(n * sizeof(int));
+    lla_key *batch = malloc(n * sizeof(lla_key));
+
+    for (int i = 0; i < n; i++)
+    {
+        keys[i] = rand() % (2 * n);
+        batch[i] = keys[i];
+    }
+    for (int done = 0, size = 1; done < n; done += size, size = size * 3 % 4999 + 1)
+    {
+        int k = done + size <= n ? size : n - done;
+        lla_insert_batch(batched, batch + done, k);
+        for (int i = done; i < done + k; i++)
+        {
+            insert(single, keys[i]);
+        }
+    }
+    check_structure(batched, n, "insert_batch");
+    check_structure(single, n, "insert_batch");
+    check_contents(batched, keys, n, "insert_batch");
+    check_contents(single, keys, n, "insert_batch");
+    for (int i = 0; i < n; i += 89)
+    {
+        check(lla_find(batched, keys[i]) >= 0, "insert_batch", "batched key not found");
+    }
+
+    free(keys);
+    free(batch);
+    cleanup_lla(&batched);
+    cleanup_lla(&single);
+}
+
+// A built lla holds the keys, sorted or not, keeps every node within its upper threshold and takes
+// inserts afterwards like one filled key by key
+void test_build_from_sorted(void)
+{
+    const int n = 50000;
+    int *keys = malloc((n + n / 5) * sizeof(int));
+    lla_key *input = malloc(n * sizeof(lla_key));
+
+    for (int shuffled = 0; shuffled < 2; shuffled++)
+    {
+        for (int i = 0; i < n; i++)
+        {
+            keys[i] = shuffled ? rand() % n : i / 3 * 2 - n / 2;
+            input[i] = keys[i];
+        }
+        lla *my_lla = lla_build_from_sorted(input, n, 8, 0.5, 0.75, 0);
+        check_structure(my_lla, n, "build_from_sorted");
+        check_contents(my_lla, keys, n, "build_from_sorted");
+
+        int ok = 1;
+        for (int node = ROOT; node < (2 << my_lla->MAX_DEPTH); node++)
+        {
+            ok &= my_lla->tree[node].size <= my_lla->tree[node].max_size;
+        }
+        check(ok, "build_from_sorted", "node above its upper threshold");
+
+        for (int i = n; i < n + n / 5; i++)
+        {
+            keys[i] = rand() % (2 * n) - n;
+            insert(my_lla, keys[i]);
+        }
+        check_structure(my_lla, n + n / 5, "build_from_sorted");
+        check_contents(my_lla, keys, n + n / 5, "build_from_sorted");
+        cleanup_lla(&my_lla);
+    }
+
+    lla *empty = lla_build_from_sorted(input, 0, 8, 0.5, 0.75, 0);
+    check_structure(empty, 0, "build_from_sorted");
+    check(lla_lower_bound(empty, 0) == -1, "build_from_sorted", "empty lla returned a key");
+    cleanup_lla(&empty);
+
+    free(keys);
+    free(input);
+}
+
+// Every SIMD level the CPU supports gives the scalar kernels' results, on empty, full and random
+// occupancy words and on rank arrays of every length up to 64
+void test_simd_kernels(void)
+{
+    int best = lla_set_simd_level(-1);
+    uint32_t src[64], want[64], got[64];
+    int32_t keys[64];
+
+    for (int i = 0; i < 64; i++)
+    {
+        src[i] = rand();
+    }
+    for (int round = 0; round < 2000; round++)
+    {
+        uint64_t bits = (uint64_t)rand() << 62 ^ (uint64_t)rand() << 31 ^ rand();
+        if (round % 4 == 0)
+        {
+            bits = round % 8 ? ~0ULL : 0;
+        }
+        else if (round % 4 == 1)
+        {
+            bits &= (uint64_t)rand() << 33 ^ rand();
+        }
+        int n = round % 65;
+        for (int i = 0; i < n; i++)
+        {
+            keys[i] = rand() % 64 - 32;
+        }
+        int32_t x = round % 16 == 3 ? INT32_MIN : round % 16 == 7 ? INT32_MAX : rand() % 80 - 40;
+
+        lla_set_simd_level(LLA_SIMD_SCALAR);
+        int want_count = lla_compact64(src, bits, want);
+        int want_rank = lla_rank32(keys, n, x);
+        for (int level = LLA_SIMD_SCALAR + 1; level <= best; level++)
+        {
+            check(lla_set_simd_level(level) == level, "simd_kernels", "supported level refused");
+            memset(got, 0, sizeof(got));
+            int ok = lla_compact64(src, bits, got) == want_count;
+            ok &= memcmp(got, want, want_count * sizeof(uint32_t)) == 0;
+            check(ok, "simd_kernels", "compact64 differs from the scalar kernel");
+
+            ok = lla_expand64(want, bits, got) == want_count;
+            for (int i = 0; i < 64; i++)
+            {
+                ok &= !((bits >> i) & 1) || got[i] == src[i];
+            }
+            check(ok, "simd_kernels", "expand64 differs from the scalar kernel");
+            check(lla_rank32(keys, n, x) == want_rank, "simd_kernels", "rank32 differs from the scalar kernel");
+        }
+    }
+    lla_set_simd_level(-1);
+}
+
+// Respreading a window in place leaves the same layout as gathering it into a buffer and spreading
+// it back, with and without a new key
+void test_respread_in_place(void)
+{
+    const int n = 20000, rounds = 300;
+    lla *in_place = create_lla(64, 8, 0.5, 0.75);
+    lla *buffered = create_lla(64, 8, 0.5, 0.75);
+    int *keys = malloc((n + rounds) * sizeof(int));
+    int count = 0;
+
+    for (; count < n; count++)
+    {
+        keys[count] = rand() % (4 * n);
+        insert(in_place, keys[count]);
+        insert(buffered, keys[count]);
+    }
+
+    int capacity = in_place->N * in_place->C;
+    lla_key *buffer = malloc((capacity + 64) * sizeof(lla_key));
+    lla_value *buffer_values = LLA_HAS_VALUES ? malloc((capacity + 64) * sizeof(lla_value)) : NULL;
+    int ok = capacity == buffered->N * buffered->C;
+    for (int round = 0; ok && round < rounds; round++)
+    {
+        int node = ROOT + rand() % ((2 << in_place->MAX_DEPTH) - 1);
+        int start = window_start(in_place, node), end = window_end(in_place, node);
+        // x repeats a key of the window, so the window stays in order with it
+        int live = next_live_slot(in_place, start + rand() % (end - start + 1), end);
+        int insert_x = live != -1 && in_place->tree[node].size < end - start + 1 && round % 2;
+        lla_key x = live != -1 ? in_place->arr[live] : 0;
+        lla_value x_value = {0};
+
+        respread_range(in_place, start, end, x, x_value, insert_x);
+        int total = gather_range(buffered, start, end, buffer, buffer_values, x, x_value, insert_x);
+        spread_elements(buffered, start, end - start + 1, buffer, buffer_values, total);
+
+        for (int slot = start; ok && slot <= end; slot++)
+        {
+            ok = slot_is_live(in_place, slot) == slot_is_live(buffered, slot);
+            ok = ok && (!slot_is_live(in_place, slot) || in_place->arr[slot] == buffered->arr[slot]);
+#if LLA_HAS_VALUES
+            ok = ok && (!slot_is_live(in_place, slot) || in_place->values[slot] == buffered->values[slot]);
+#endif
+        }
+        if (insert_x)
+        {
+            keys[count++] = x;
+        }
+        // A respread moves elements between the window's children
+        recount_subtree(in_place, ROOT);
+        recount_subtree(buffered, ROOT);
+    }
+    check(ok, "respread_in_place", "in-place respread differs from the buffered one");
+    check_structure(in_place, count, "respread_in_place");
+    check_structure(buffered, count, "respread_in_place");
+    check_contents(in_place, keys, count, "respread_in_place");
+
+    free(keys);
+    free(buffer);
+    free(buffer_values);
+    cleanup_lla(&in_place);
+    cleanup_lla(&buffered);
+}
+
+// A leaf with room takes x by writing at most nine slots of its own window, leaves it untouched
+// when the nearest free slot is too far, and keeps its keys in order either way
+void test_local_shift(void)
+{
+    const int n = 40000;
+    lla *my_lla = create_lla(64, 8, 0.5, 0.75);
+    int *keys = malloc(2 * n * sizeof(int));
+    lla_key before[64], after[64];
+    int count = 0, leaf_inserts = 0, shifted = 0;
+    int ok = 1;
+
+    for (; count < n; count++)
+    {
+        keys[count] = rand() % (4 * n);
+        insert(my_lla, keys[count]);
+    }
+    for (int i = 0; i < n; i++)
+    {
+        lla_key x = rand() % (4 * n);
+        lla_value x_value = {0};
+        int leaf = insert_help_iterative(my_lla, x);
+        keys[count++] = x;
+        if (my_lla->tree[ROOT].size >= my_lla->tree[ROOT].max_size || node_depth(leaf) != my_lla->MAX_DEPTH ||
+            window_end(my_lla, leaf) - window_start(my_lla, leaf) >= 64)
+        {
+            insert(my_lla, x);
+            continue;
+        }
+        leaf_inserts++;
+
+        int start = window_start(my_lla, leaf), end = window_end(my_lla, leaf);
+        int size = 0;
+        for (int slot = start; slot <= end; slot++)
+        {
+            before[slot - start] = my_lla->arr[slot];
+            size += slot_is_live(my_lla, slot);
+        }
+
+        int moved = insert_local_shift(my_lla, leaf, x, x_value);
+        int changed = 0, live = 0;
+        for (int slot = start; slot <= end; slot++)
+        {
+            changed += my_lla->arr[slot] != before[slot - start];
+            if (slot_is_live(my_lla, slot))
+            {
+                ok &= live == 0 || my_lla->arr[slot] >= after[live - 1];
+                after[live++] = my_lla->arr[slot];
+            }
+        }
+        if (moved)
+        {
+            ok &= moved <= 9 && changed <= moved && live == size + 1;
+            insert_commit(my_lla, leaf);
+            shifted++;
+        }
+        else
+        {
+            ok &= changed == 0 && live == size;
+            insert(my_lla, x);
+        }
+    }
+    check(ok, "local_shift", "shift wrote outside its bound or broke the leaf's order");
+    check(shifted > leaf_inserts / 2, "local_shift", "most leaf inserts missed the shift");
+    check_structure(my_lla, count, "local_shift");
+    check_contents(my_lla, keys, count, "local_shift");
+
+    free(keys);
+    cleanup_lla(&my_lla);
+}
+
+// Keys drawn from a skewed distribution, for the predictor checks
+static int skewed_key(int range)
+{
+    long long r = rand() % range;
+    return (int)(r * r / range);
+}
+
+// A user predictor that breaks the contract: values far outside [0, 1], and in some modes falling
+// or jumping around as the key grows
+typedef struct wild_predictor
+{
+    int mode;
+    long long calls;
+} wild_predictor;
+
+static double wild_predict(void *ctx, lla_key key)
+{
+    wild_predictor *wild = (wild_predictor *)ctx;
+    double k = (double)key;
+    wild->calls++;
+    switch (wild->mode)
+    {
+    case 0:
+        return k / 1000 - 50; // monotone, from far below 0 to far above 1
+    case 1:
+        return 3 - k / 1000; // falling
+    default:
+        return (double)((key * 7919) % 1000) / 100 - 2; // jumps around in [-2, 8]
+    }
+}
+
+// A fitted predictor is a CDF, a layout made with it keeps every node within its upper threshold,
+// and an lla using it holds the same keys as one spaced evenly while moving fewer of them for
+// keys from the fitted distribution. An empty sample turns it off. A user predictor out of range
+// or not monotone is clamped and still lays out a valid structure.
+void test_predictor(void)
+{
+    const int n = 60000, range = 1 << 20;
+    lla *predicted = create_lla(64, 8, 0.5, 0.75);
+    lla *even = create_lla(64, 8, 0.5, 0.75);
+    int *keys = malloc(2 * n * sizeof(int));
+    lla_key *sample = malloc(n * sizeof(lla_key));
+
+    for (int i = 0; i < n; i++)
+    {
+        sample[i] = skewed_key(range);
+    }
+    lla_fit_predictor(predicted, sample, n, 64, 0.8);
+    check(predicted->predictor != NULL, "predictor", "fitted predictor not set");
+    int ok = 1;
+    double prev = 0;
+    for (int k = -1; k <= range; k += 997)
+    {
+        double cdf = predicted->predictor(predicted->predictor_ctx, k);
+        ok &= cdf >= prev && cdf <= 1;
+        prev = cdf;
+    }
+    check(ok && predicted->predictor(predicted->predictor_ctx, range) == 1, "predictor", "fitted CDF not non-decreasing from 0 to 1");
+
+    long long moved_predicted = 0, moved_even = 0;
+    for (int i = 0; i < 2 * n; i++)
+    {
+        keys[i] = skewed_key(range);
+        long long p = predicted->moved, e = even->moved;
+        insert(predicted, keys[i]);
+        insert(even, keys[i]);
+        if (i >= n)
+        {
+            moved_predicted += predicted->moved - p;
+            moved_even += even->moved - e;
+        }
+        if (i == n - 1)
+        {
+            // The whole array laid out by the predictor, as a resize does
+            lla_value none = {0};
+            respread_range(predicted, 0, predicted->N * predicted->C - 1, 0, none, 0);
+            recount_subtree(predicted, ROOT);
+            ok = 1;
+            for (int node = ROOT; node < (2 << predicted->MAX_DEPTH); node++)
+            {
+                ok &= predicted->tree[node].size <= predicted->tree[node].max_size;
+            }
+            check(ok, "predictor", "predicted layout put a node above its upper threshold");
+        }
+    }
+    check(moved_predicted < moved_even, "predictor", "predicted layout moved more than even spacing");
+    check_structure(predicted, 2 * n, "predictor");
+    check_structure(even, 2 * n, "predictor");
+    check_contents(predicted, keys, 2 * n, "predictor");
+    check_contents(even, keys, 2 * n, "predictor");
+
+    lla_fit_predictor(predicted, sample, 0, 64, 0.8);
+    check(predicted->predictor == NULL, "predictor", "empty sample left the predictor on");
+
+    lla_set_predictor(predicted, wild_predict, NULL, 3);
+    check(predicted->predict_mix == 1, "predictor", "mix above 1 not clamped");
+    lla_set_predictor(predicted, wild_predict, NULL, -1);
+    check(predicted->predict_mix == 0, "predictor", "mix below 0 not clamped");
+    for (int mode = 0; mode < 3; mode++)
+    {
+        const int m = 20000;
+        wild_predictor wild = {mode, 0};
+        lla *my_lla = create_lla(64, 8, 0.5, 0.75);
+        lla_set_predictor(my_lla, wild_predict, &wild, 0.8);
+        int count = fill_random(my_lla, keys, m, 4);
+        lla_value none = {0};
+        respread_range(my_lla, 0, my_lla->N * my_lla->C - 1, 0, none, 0);
+        recount_subtree(my_lla, ROOT);
+        ok = 1;
+        for (int node = ROOT; node < (2 << my_lla->MAX_DEPTH); node++)
+        {
+            ok &= my_lla->tree[node].size <= my_lla->tree[node].max_size;
+        }
+        check(wild.calls > 0, "predictor", "user predictor never called");
+        check(ok, "predictor", "user predictor out of range put a node above its upper threshold");
+        check_structure(my_lla, count, "predictor");
+        check_contents(my_lla, keys, count, "predictor");
+        cleanup_lla(&my_lla);
+    }
+
+    free(keys);
+    free(sample);
+    cleanup_lla(&predicted);
+    cleanup_lla(&even);
+}
+
+// Ascending keys switch to the append layout after LLA_APPEND_RUN inserts and move O(1) elements
+// each, resizes included. A respread during the run packs every left child and leaves the tail
+// empty for the run to grow into. A smaller key ends the run, and keys in the middle still find
+// room.
+void test_append_run(void)
+{
+    const int n = 100000;
+    lla *my_lla = create_lla(64, 8, 0.5, 0.75);
+    int *keys = malloc((n + n / 10) * sizeof(int));
+    long long moved_half = 0;
+    int ok = 1;
+
+    for (int i = 0; i < n; i++)
+    {
+        keys[i] = i / 2;
+        insert(my_lla, keys[i]);
+        ok &= lla_append_mode(my_lla) == (i >= LLA_APPEND_RUN - 1);
+        if (i == n / 2 - 1)
+        {
+            moved_half = my_lla->moved;
+        }
+    }
+    check(ok, "append_run", "append mode not entered after LLA_APPEND_RUN ascending inserts");
+    // Twice the keys, twice the moves: a respread per level of the tail would add a move per
+    // insert with every doubling
+    check(my_lla->moved <= 8LL * n && my_lla->moved - moved_half <= moved_half + n / 8, "append_run", "append run moved more than O(1) elements per insert");
+    check_structure(my_lla, n, "append_run");
+    check_contents(my_lla, keys, n, "append_run");
+
+    lla_value none = {0};
+    respread_range(my_lla, 0, my_lla->N * my_lla->C - 1, 0, none, 0);
+    recount_subtree(my_lla, ROOT);
+    // Down the path to the largest key, a left child is packed whenever its sibling holds keys
+    int node = ROOT;
+    while (node_depth(node) < my_lla->MAX_DEPTH)
+    {
+        lla_node *left = &my_lla->tree[2 * node];
+        int right = my_lla->tree[2 * node + 1].size > 0;
+        ok &= !right || left->size == left->max_size - 1;
+        node = 2 * node + right;
+    }
+    int last_leaf = (2 << my_lla->MAX_DEPTH) - 1;
+    check(ok && !my_lla->tree[last_leaf].size, "append_run", "append layout left keys in the tail");
+    check_structure(my_lla, n, "append_run");
+
+    insert(my_lla, -1);
+    check(!lla_append_mode(my_lla), "append_run", "smaller key did not end the run");
+    keys[n] = -1;
+    for (int i = n + 1; i < n + n / 10; i++)
+    {
+        keys[i] = rand() % (n / 2);
+        insert(my_lla, keys[i]);
+    }
+    check_structure(my_lla, n + n / 10, "append_run");
+    check_contents(my_lla, keys, n + n / 10, "append_run");
 
-double get_time_us()
+    free(keys);
+    cleanup_lla(&my_lla);
+}
+
+// Values of a mapped lla follow their keys, see test_persistence()
+static int values_follow_keys(lla *my_lla)
 {
-    struct timespec ts;
-    clock_gettime(CLOCK_MONOTONIC, &ts);
-    return (ts.tv_sec * 1000000.0) + (ts.tv_nsec / 1000.0);
+    int ok = 1;
+#if LLA_HAS_VALUES
+    for (int slot = 0; slot < my_lla->N * my_lla->C; slot++)
+    {
+        ok &= !slot_is_live(my_lla, slot) || my_lla->values[slot] == (lla_value)(my_lla->arr[slot] * 3 + 7);
+    }
+#else
+    (void)my_lla;
+#endif
+    return ok;
 }
 
-// Proper complexity testing function
-void test_complexity_at_size(int size, int num_trials, double *avg_time, double *log_size, double *log2_size)
+// A mapped lla reopens with what it held: after a clean close, and after a process that died
+// between undo_save() and the end of a respread. Files of other key or value types are refused.
+void test_persistence(void)
 {
-    const int N = 1000000; // Large enough to accommodate all tests
-    const int C = 8;
-    const double TAU_0 = 0.5;
-    const double TAU_D = 0.75;
-    
-    double total_time = 0.0;
-    
-    for (int trial = 0; trial < num_trials; trial++)
+    const int n = 20000;
+    char path[] = "/tmp/lla_persist_XXXXXX";
+    int fd = mkstemp(path);
+    close(fd);
+    unlink(path);
+    int *keys = malloc(n * sizeof(int));
+
+    // Enough keys to resize the file a few times, with deletes among them
+    lla *my_lla = lla_open_mapped(path, 64, NULL);
+    check(my_lla != NULL, "persistence", "new file not created");
+    int count = fill_random(my_lla, keys, n, 4);
+    int N = my_lla->N;
+    cleanup_lla(&my_lla);
+
+    my_lla = lla_open_mapped(path, 64, NULL);
+    check(my_lla != NULL && my_lla->N == N, "persistence", "clean file not reopened as it was");
+    check_structure(my_lla, count, "persistence");
+    check_contents(my_lla, keys, count, "persistence");
+    check(values_follow_keys(my_lla), "persistence", "values differ after reopening");
+    cleanup_lla(&my_lla);
+
+    // A child inserts, saves the undo record of the root's window, scrambles it as a respread cut
+    // short would, and dies without closing the file
+    pid_t child = fork();
+    if (child == 0)
+    {
+        lla *crashing = lla_open_mapped(path, 64, NULL);
+        for (int i = 0; i < n / 10; i++)
+        {
+            lla_insert_value(crashing, -1 - i, (lla_value)((-1 - i) * 3 + 7));
+        }
+        int end = crashing->N * crashing->C - 1;
+        undo_save(crashing, 0, end);
+        for (int slot = 0; slot <= end; slot += 3)
+        {
+            crashing->arr[slot] = end - slot;
+            crashing->occupied[slot >> 6] ^= 1ULL << (slot & 63);
+        }
+        _exit(0);
+    }
+    waitpid(child, NULL, 0);
+    for (int i = 0; i < n / 10; i++)
+    {
+        keys[count++] = -1 - i;
+    }
+    my_lla = lla_open_mapped(path, 64, NULL);
+    check(my_lla != NULL, "persistence", "file left open by a crash not reopened");
+    if (my_lla)
+    {
+        check_structure(my_lla, count, "persistence");
+        check_contents(my_lla, keys, count, "persistence");
+        check(values_follow_keys(my_lla), "persistence", "values differ after recovery");
+        // and keeps working from there
+        lla_delete(my_lla, keys[0]);
+        keys[0] = 4 * n;
+        lla_insert_value(my_lla, keys[0], (lla_value)(keys[0] * 3 + 7));
+        check_structure(my_lla, count, "persistence");
+        check_contents(my_lla, keys, count, "persistence");
+        cleanup_lla(&my_lla);
+    }
+
+    // A child inserts, checkpoints and dies without closing the file: the reopen finds its keys
+    child = fork();
+    if (child == 0)
     {
-        // Create fresh LLA for each trial
-        lla *test_lla = create_lla(N, C, TAU_0, TAU_D);
-        
-        // Fill with 'size' elements first
-        for (int i = 0; i < size; i++)
+        lla *crashing = lla_open_mapped(path, 64, NULL);
+        for (int i = 0; i < n / 10; i++)
         {
-            insert(test_lla, rand() % (size * 10)); // Random values
+            lla_insert_value(crashing, 4 * n + 1 + i, (lla_value)((4 * n + 1 + i) * 3 + 7));
         }
-        
-        // Now measure insertion time into structure of size 'size'
-        int test_value = rand() % (size * 10);
-        
-        double start_time = get_time_us();
-        insert(test_lla, test_value);
-        double end_time = get_time_us();
-        
-        total_time += (end_time - start_time);
-        
-        cleanup_lla(&test_lla);
+        _exit(lla_checkpoint(crashing) ? 0 : 1);
+    }
+    int status = 0;
+    waitpid(child, &status, 0);
+    check(WIFEXITED(status) && WEXITSTATUS(status) == 0, "persistence", "lla_checkpoint() failed");
+    for (int i = 0; i < n / 10; i++)
+    {
+        keys[count++] = 4 * n + 1 + i;
     }
-    
-    *avg_time = total_time / num_trials;
-    *log_size = log2((double)size);
-    *log2_size = (*log_size) * (*log_size); // log²(n)
+    my_lla = lla_open_mapped(path, 64, NULL);
+    check(my_lla != NULL, "persistence", "file not reopened after a checkpoint");
+    if (my_lla)
+    {
+        check_structure(my_lla, count, "persistence");
+        check_contents(my_lla, keys, count, "persistence");
+        check(values_follow_keys(my_lla), "persistence", "values differ after a checkpoint");
+        cleanup_lla(&my_lla);
+    }
+
+    // A child resizes the file up and down until it is killed, most likely in the middle of writing
+    // path.resize or of renaming it: the reopen finds either file whole, and the next resize
+    // writes over a path.resize left behind
+    int ready[2];
+    check(pipe(ready) == 0, "persistence", "pipe not created");
+    child = fork();
+    if (child == 0)
+    {
+        lla *crashing = lla_open_mapped(path, 64, NULL);
+        int base = crashing->N;
+        char byte = 1;
+        close(ready[0]);
+        if (write(ready[1], &byte, 1) != 1)
+        {
+            _exit(1);
+        }
+        for (int i = 0;; i++)
+        {
+            lla_resize(crashing, i % 2 ? base : 2 * base);
+        }
+    }
+    close(ready[1]);
+    char byte = 0;
+    check(read(ready[0], &byte, 1) == 1, "persistence", "resizing child did not start");
+    close(ready[0]);
+    usleep(20000 + rand() % 20000);
+    kill(child, SIGKILL);
+    waitpid(child, NULL, 0);
+    my_lla = lla_open_mapped(path, 64, NULL);
+    check(my_lla != NULL, "persistence", "file not reopened after a crash during a resize");
+    if (my_lla)
+    {
+        check_structure(my_lla, count, "persistence");
+        check_contents(my_lla, keys, count, "persistence");
+        check(values_follow_keys(my_lla), "persistence", "values differ after a crash during a resize");
+        check(lla_resize(my_lla, 2 * my_lla->N), "persistence", "no resize after a crash during one");
+        check_structure(my_lla, count, "persistence");
+        check_contents(my_lla, keys, count, "persistence");
+        cleanup_lla(&my_lla);
+    }
+    char resize_path[sizeof(path) + sizeof(".resize")];
+    snprintf(resize_path, sizeof(resize_path), "%s.resize", path);
+    check(access(resize_path, F_OK) != 0, "persistence", "path.resize left after a resize");
+
+    // The key type follows the magic, the version and the state in the header
+    fd = open(path, O_RDWR);
+    char key_type[32] = "some other key";
+    char saved[32];
+    check(pread(fd, saved, sizeof(saved), 16) == sizeof(saved), "persistence", "header not read");
+    check(pwrite(fd, key_type, sizeof(key_type), 16) == sizeof(key_type), "persistence", "header not written");
+    check(lla_open_mapped(path, 64, NULL) == NULL, "persistence", "file of another key type opened");
+    check(pwrite(fd, saved, sizeof(saved), 16) == sizeof(saved), "persistence", "header not restored");
+    my_lla = lla_open_mapped(path, 64, NULL);
+    check(my_lla != NULL, "persistence", "file not reopened after a refused open");
+    cleanup_lla(&my_lla);
+    close(fd);
+
+    unlink(path);
+    free(keys);
+}
+
+// Same N, same live keys and values slot order aside
+static int same_elements(lla *a, lla *b)
+{
+    int ok = a->N == b->N && a->C == b->C && a->tree[ROOT].size == b->tree[ROOT].size;
+    int j = 0;
+    for (int i = 0; ok && i < a->N * a->C; i++)
+    {
+        if (!slot_is_live(a, i))
+        {
+            continue;
+        }
+        while (!slot_is_live(b, j))
+        {
+            j++;
+        }
+        ok = a->arr[i] == b->arr[j];
+#if LLA_HAS_VALUES
+        ok = ok && a->values[i] == b->values[j];
+#endif
+        j++;
+    }
+    return ok;
+}
+
+// Rejected streams print why; keep the loops below from flooding the output
+static int mute_stdout(int saved)
+{
+    fflush(stdout);
+    if (saved >= 0)
+    {
+        dup2(saved, STDOUT_FILENO);
+        close(saved);
+        return -1;
+    }
+    saved = dup(STDOUT_FILENO);
+    int null_fd = open("/dev/null", O_WRONLY);
+    dup2(null_fd, STDOUT_FILENO);
+    close(null_fd);
+    return saved;
+}
+
+// Round trips through a buffer and a file descriptor, and streams that must not load: cut short
+// at every length, corrupt, or written for other key types
+void test_serialization(void)
+{
+    const int n = 3000;
+    lla *my_lla = create_lla(64, 8, 0.5, 0.75);
+    int *keys = malloc(n * sizeof(int));
+
+    // Negative keys and duplicates, with deletes among them
+    int count = 0;
+    for (int i = 0; i < n; i++)
+    {
+        keys[count] = i % 5 == 0 && count ? keys[rand() % count] : rand() % n - n / 2;
+        lla_insert_value(my_lla, keys[count], (lla_value)(keys[count] * 3 + 7));
+        count++;
+        if (i % 4 == 3)
+        {
+            int victim = rand() % count;
+            lla_delete(my_lla, keys[victim]);
+            keys[victim] = keys[--count];
+        }
+    }
+
+    // cap = 0 sizes the buffer, a buffer that is too small still reports the full size
+    size_t size = lla_serialize_buffer(my_lla, NULL, 0);
+    unsigned char *buf = malloc(size);
+    check(lla_serialize_buffer(my_lla, buf, size / 2) == size, "serialization", "short buffer reported another size");
+    check(lla_serialize_buffer(my_lla, buf, size) == size, "serialization", "sizing call and write differ");
+
+    lla *loaded = lla_deserialize_buffer(buf, size);
+    check(loaded != NULL, "serialization", "buffer not loaded");
+    if (loaded)
+    {
+        check_structure(loaded, count, "serialization");
+        check_contents(loaded, keys, count, "serialization");
+        check(same_elements(my_lla, loaded), "serialization", "buffer round trip changed N or the elements");
+        // and keeps working from there
+        lla_insert_value(loaded, -n, (lla_value)(-n * 3 + 7));
+        keys[count] = -n;
+        check_structure(loaded, count + 1, "serialization");
+        check_contents(loaded, keys, count + 1, "serialization");
+        cleanup_lla(&loaded);
+    }
+
+    // Two streams back to back in a file: the first load leaves the fd at the second
+    lla *empty = create_lla(64, 8, 0.5, 0.75);
+    char path[] = "/tmp/lla_stream_XXXXXX";
+    int fd = mkstemp(path);
+    unlink(path);
+    check(lla_serialize(my_lla, fd) == (long long)size, "serialization", "fd write returned another size");
+    long long empty_size = lla_serialize(empty, fd);
+    check(empty_size == (long long)lla_serialize_buffer(empty, NULL, 0), "serialization", "empty lla sized differently");
+    unsigned char *written = malloc(size);
+    check(pread(fd, written, size, 0) == (ssize_t)size && memcmp(written, buf, size) == 0, "serialization", "fd and buffer streams differ");
+    lseek(fd, 0, SEEK_SET);
+    loaded = lla_deserialize(fd);
+    check(loaded != NULL && same_elements(my_lla, loaded), "serialization", "fd round trip changed N or the elements");
+    cleanup_lla(&loaded);
+    check(lseek(fd, 0, SEEK_CUR) == (off_t)size, "serialization", "fd not left after the first lla");
+    loaded = lla_deserialize(fd);
+    check(loaded != NULL && same_elements(empty, loaded), "serialization", "empty lla not loaded from the fd");
+    if (loaded)
+    {
+        check_structure(loaded, 0, "serialization");
+        cleanup_lla(&loaded);
+    }
+    close(fd);
+    free(written);
+
+    // Every proper prefix is refused
+    int saved = mute_stdout(-1);
+    int prefixes_loaded = 0;
+    for (size_t len = 0; len < size; len++)
+    {
+        loaded = lla_deserialize_buffer(buf, len);
+        prefixes_loaded += loaded != NULL;
+        cleanup_lla(&loaded);
+    }
+    mute_stdout(saved);
+    check(prefixes_loaded == 0, "serialization", "truncated stream loaded");
+
+    // Consecutive keys from 0 take one byte each (zigzag 2) right before the values
+    lla *dense = create_lla(64, 8, 0.5, 0.75);
+    for (int i = 0; i < 200; i++)
+    {
+        lla_insert_value(dense, i, (lla_value)(i * 3 + 7));
+    }
+    size_t dense_size = lla_serialize_buffer(dense, buf, size);
+    size_t keys_start = dense_size - 200 * (LLA_HAS_VALUES ? sizeof(lla_value) : 0) - 200;
+    check(dense_size <= size && buf[keys_start] == 0 && buf[keys_start + 100] == 2, "serialization", "unexpected key encoding");
+
+    // Stdout stays muted until the rejections are counted, so check() runs after
+    saved = mute_stdout(-1);
+    buf[keys_start + 100] = 9; // a step of -5 puts the keys out of order
+    lla *unsorted = lla_deserialize_buffer(buf, dense_size);
+    buf[keys_start + 100] = 2;
+    buf[0] = 'X';
+    lla *bad_magic = lla_deserialize_buffer(buf, dense_size);
+    buf[0] = 'L';
+    buf[4] = 2; // version 1 is the only one
+    lla *other_version = lla_deserialize_buffer(buf, dense_size);
+    buf[4] = 1;
+    // The key type name follows the magic, the version and its length
+    buf[6] ^= 0x20;
+    lla *other_type = lla_deserialize_buffer(buf, dense_size);
+    buf[6] ^= 0x20;
+    mute_stdout(saved);
+    check(unsorted == NULL, "serialization", "stream with unsorted keys loaded");
+    check(bad_magic == NULL, "serialization", "stream with a bad magic loaded");
+    check(other_version == NULL, "serialization", "stream of another version loaded");
+    check(other_type == NULL, "serialization", "stream of another key type loaded");
+    cleanup_lla(&unsorted);
+    cleanup_lla(&bad_magic);
+    cleanup_lla(&other_version);
+    cleanup_lla(&other_type);
+
+    loaded = lla_deserialize_buffer(buf, dense_size);
+    check(loaded != NULL && same_elements(dense, loaded), "serialization", "restored stream not loaded");
+    cleanup_lla(&loaded);
+
+    cleanup_lla(&dense);
+    cleanup_lla(&empty);
+    cleanup_lla(&my_lla);
+    free(buf);
+    free(keys);
+}
+
+#ifdef LLA_STATS
+// Every rebalance the hook reported: how many, by kind, and whether each event matched its node
+typedef struct hook_log {
+    lla *lla;
+    long long events;
+    long long by_kind[LLA_REBALANCE_JOB + 1];
+    int consistent;
+} hook_log;
+
+static void log_rebalance(void *ctx, const lla_rebalance_event *event)
+{
+    hook_log *log = ctx;
+    log->events++;
+    log->by_kind[event->kind]++;
+    log->consistent &= event->depth == node_depth(event->node) && event->start == window_start(log->lla, event->node) &&
+                       event->end == window_end(log->lla, event->node) && event->size == log->lla->tree[event->node].size;
+}
+#endif
+
+// The fill ratio and the heatmap follow the tree, and with LLA_STATS the counters and the hook
+// account for every insert and rebalance
+void test_instrumentation(void)
+{
+    const int n = 20000;
+    lla *my_lla = create_lla(64, 8, 0.5, 0.75);
+    check(lla_fill_ratio(my_lla) == 0, "instrumentation", "empty lla has a fill ratio");
+#ifdef LLA_STATS
+    hook_log log = {my_lla, 0, {0}, 1};
+    lla_set_rebalance_hook(my_lla, log_rebalance, &log);
+#endif
+
+    for (int i = 0; i < n; i++)
+    {
+        insert(my_lla, rand() % (4 * n));
+    }
+    double ratio = lla_fill_ratio(my_lla);
+    check(ratio > 0 && ratio < 1 && ratio == (double)n / my_lla->tree[ROOT].max_size, "instrumentation", "fill ratio off");
+
+    // Every depth's rows cover the array once and add up to the root
+    FILE *out = tmpfile();
+    lla_export_heatmap(my_lla, out, -1);
+    rewind(out);
+    char line[256];
+    int rows = 0;
+    int ok = fgets(line, sizeof(line), out) && strncmp(line, "node,depth,", 11) == 0;
+    long long sums[64] = {0};
+    int covered[64] = {0};
+    int node, depth, start, end, size, min_size, max_size;
+    double density;
+    while (fscanf(out, "%d,%d,%d,%d,%d,%d,%d,%lf", &node, &depth, &start, &end, &size, &min_size, &max_size, &density) == 8)
+    {
+        lla_node *expected = &my_lla->tree[node];
+        ok &= node == ROOT + rows && depth == node_depth(node) && start == covered[depth] && size == expected->size &&
+              min_size == expected->min_size && max_size == expected->max_size;
+        ok &= density > (double)size / (end - start + 1) - 0.0001 && density < (double)size / (end - start + 1) + 0.0001;
+        sums[depth] += size;
+        covered[depth] = end + 1;
+        rows++;
+    }
+    ok &= rows == (2 << my_lla->MAX_DEPTH) - 1;
+    for (depth = 0; depth <= my_lla->MAX_DEPTH; depth++)
+    {
+        ok &= sums[depth] == n && covered[depth] == my_lla->N * my_lla->C;
+    }
+    check(ok, "instrumentation", "heatmap rows differ from the tree");
+    fclose(out);
+
+    out = tmpfile();
+    lla_export_heatmap(my_lla, out, 2);
+    rewind(out);
+    rows = 0;
+    while (fgets(line, sizeof(line), out))
+    {
+        rows++;
+    }
+    check(rows == 1 + 7, "instrumentation", "heatmap not cut at max_depth");
+    fclose(out);
+
+#ifdef LLA_STATS
+    lla_stats stats;
+    lla_stats_get(my_lla, &stats);
+    long long rebalances = 0;
+    long long bucketed = 0;
+    for (int i = 0; i < LLA_STATS_LEVELS; i++)
+    {
+        rebalances += stats.rebalances[i];
+    }
+    for (int i = 0; i < LLA_STATS_MOVED_BUCKETS; i++)
+    {
+        bucketed += stats.moved_hist[i];
+    }
+    check(stats.inserts == n && stats.leaf_inserts + stats.escalations == n, "instrumentation", "insert counters off");
+    check(stats.leaf_inserts > 0 && stats.escalations > 0, "instrumentation", "no leaf inserts or no escalations counted");
+    check(rebalances == log.events && bucketed == log.events, "instrumentation", "rebalance counters differ from the hook");
+    check(stats.resizes > 0 && stats.resizes == log.by_kind[LLA_REBALANCE_RESIZE], "instrumentation", "resizes not counted");
+    check(log.by_kind[LLA_REBALANCE_INSERT] > 0 && log.consistent, "instrumentation", "hook events differ from their nodes");
+
+    lla_stats_reset(my_lla);
+    lla_set_rebalance_hook(my_lla, NULL, NULL);
+    long long events = log.events;
+    for (int i = 0; i < n; i++)
+    {
+        insert(my_lla, rand() % (4 * n));
+    }
+    lla_stats_get(my_lla, &stats);
+    check(stats.inserts == n, "instrumentation", "counters not reset");
+    check(log.events == events, "instrumentation", "hook called after it was removed");
+#endif
+    cleanup_lla(&my_lla);
+}
+
+#ifdef LLA_STATS
+// Largest window the deamortized inserts respread on the spot
+static void note_insert_respread(void *ctx, const lla_rebalance_event *event)
+{
+    long long *largest = ctx;
+    if (event->kind == LLA_REBALANCE_INSERT && event->moved > *largest)
+    {
+        *largest = event->moved;
+    }
+}
+#endif
+
+// In deamortized mode no insert moves more than max_moves elements on sequential keys, and on
+// uniform ones only the rare insert the jobs fall behind on while the array grows, counted in
+// job_overruns. Turning the mode off leaves every node within its upper threshold, and the
+// rebalance a delete asks for while a job runs elsewhere is queued behind it
+void test_deamortized(void)
+{
+    const int n = 60000;
+    const int max_moves = 64;
+    int *keys = malloc(n * sizeof(int));
+
+    for (int sequential = 0; sequential <= 1; sequential++)
+    {
+        lla *my_lla = create_lla(64, 8, 0.5, 0.75);
+        long long over = 0;
+        long long largest = 0;
+        lla_set_deamortized(my_lla, max_moves);
+#ifdef LLA_STATS
+        lla_set_rebalance_hook(my_lla, note_insert_respread, &largest);
+#endif
+        for (int i = 0; i < n; i++)
+        {
+            keys[i] = sequential ? i : rand() % (4 * n);
+            long long before = my_lla->moved;
+            insert(my_lla, keys[i]);
+            over += my_lla->moved - before > max_moves;
+        }
+        check(over == my_lla->job_overruns, "deamortized", "an insert moved more than max_moves elements uncounted");
+        check(over <= (sequential ? 0 : n / 5000), "deamortized", "an insert moved more than max_moves elements");
+        check(largest <= max_moves, "deamortized", "an insert respread more than max_moves elements");
+        check_structure(my_lla, n, "deamortized");
+        check_contents(my_lla, keys, n, "deamortized");
+
+        lla_set_deamortized(my_lla, 0);
+        check(!my_lla->job_node && !my_lla->job_queued && !my_lla->grow, "deamortized", "work left after turning the mode off");
+        int ok = 1;
+        for (int node = ROOT; node < (2 << my_lla->MAX_DEPTH); node++)
+        {
+            ok &= my_lla->tree[node].size <= my_lla->tree[node].max_size;
+        }
+        check(ok, "deamortized", "node above its upper threshold after the jobs finished");
+        cleanup_lla(&my_lla);
+    }
+
+    // Respreads asked for while a job runs elsewhere, as delete_entry() does, wait behind it
+    lla *my_lla = create_lla(64, 8, 0.5, 0.75);
+    for (int i = 0; i < n; i++)
+    {
+        keys[i] = rand() % (4 * n);
+        insert(my_lla, keys[i]);
+    }
+    lla_set_deamortized(my_lla, max_moves);
+    schedule_rebalance(my_lla, 3);
+    schedule_rebalance(my_lla, 4);
+    schedule_rebalance(my_lla, 10);
+    check(my_lla->job_node == 10 && my_lla->job_queued == 2, "deamortized", "respread asked for during a job was dropped");
+    schedule_rebalance(my_lla, 2);
+    check(my_lla->job_node == 2 && my_lla->job_queued == 1, "deamortized", "jobs inside a new job's window kept");
+    for (int i = 0; i < n / 2; i++)
+    {
+        lla_delete(my_lla, keys[i]);
+    }
+    lla_set_deamortized(my_lla, 0);
+    check(!my_lla->job_node && !my_lla->job_queued, "deamortized", "jobs left after turning the mode off");
+    check_structure(my_lla, n - n / 2, "deamortized");
+    check_contents(my_lla, keys + n / 2, n - n / 2, "deamortized");
+    cleanup_lla(&my_lla);
+
+    // A job drained by hand with lla_rebalance_step(): every step stays within max_moves and leaves
+    // the keys sorted, the counters exact and every key findable
+    const int drained = n / 4;
+    my_lla = create_lla(64, 8, 0.5, 0.75);
+    for (int i = 0; i < drained; i++)
+    {
+        keys[i] = rand() % (4 * n);
+        insert(my_lla, keys[i]);
+    }
+    lla_set_deamortized(my_lla, max_moves);
+    schedule_rebalance(my_lla, ROOT);
+    int steps = 0;
+    for (int more = 1; more; steps++)
+    {
+        long long before = my_lla->moved;
+        more = lla_rebalance_step(my_lla);
+        if (!check(my_lla->moved - before <= max_moves, "deamortized", "a step moved more than max_moves elements") ||
+            !check_structure(my_lla, drained, "deamortized") ||
+            !check(lla_find(my_lla, keys[rand() % drained]) != -1, "deamortized", "key lost in the middle of a job"))
+        {
+            break;
+        }
+    }
+    check(steps > 1 && !my_lla->job_node, "deamortized", "lla_rebalance_step() did not drain the job in steps");
+    check(!lla_rebalance_step(my_lla), "deamortized", "step reported work after the job was done");
+    check_contents(my_lla, keys, drained, "deamortized");
+    cleanup_lla(&my_lla);
+
+    // A hot spot after a uniform load, like the hammer workload of bench.c: every insert lands
+    // among 64 keys. The jobs there fall behind now and then, and those inserts, only those, count
+    // in job_overruns. A hot spot needs a larger budget than spread out keys.
+    const int hot_moves = 256;
+    my_lla = create_lla(64, 8, 0.5, 0.75);
+    for (int i = 0; i < n / 2; i++)
+    {
+        keys[i] = rand() % (4 * n);
+        insert(my_lla, keys[i]);
+    }
+    lla_set_deamortized(my_lla, hot_moves);
+    long long start = my_lla->moved;
+    long long over = 0;
+    for (int i = n / 2; i < n; i++)
+    {
+        keys[i] = 2 * n + rand() % 64;
+        long long before = my_lla->moved;
+        insert(my_lla, keys[i]);
+        over += my_lla->moved - before > hot_moves;
+    }
+    check(over == my_lla->job_overruns, "deamortized", "an insert moved more than max_moves elements uncounted");
+    check(over <= n / 1000, "deamortized", "a hot spot outran the jobs too often");
+    check(my_lla->moved - start <= (long long)hot_moves * (n - n / 2), "deamortized", "hot spot inserts moved more than max_moves on average");
+    check_structure(my_lla, n, "deamortized");
+    check_contents(my_lla, keys, n, "deamortized");
+    cleanup_lla(&my_lla);
+    free(keys);
+}
+
+// Values follow their keys through shifts, respreads, batches and deletes, and keys wider than 32
+// bits keep their order. Needs an arithmetic LLA_VALUE_TYPE, `make test` runs it in a build with
+// 64-bit keys and values.
+void test_key_value_types(void)
+{
+#if LLA_HAS_VALUES
+    const int n = 50000;
+    lla_key step = (lla_key)(sizeof(lla_key) > 4 ? 1ULL << 32 : 1);
+    lla *my_lla = create_lla(64, 8, 0.5, 0.75);
+    lla_key *keys = malloc((n + n / 10) * sizeof(lla_key));
+    lla_value *values = malloc(n / 10 * sizeof(lla_value));
+    int count = 0;
+
+    for (int i = 0; i < n; i++)
+    {
+        lla_key key = (lla_key)(rand() % (4 * n) - 2 * n) * step;
+        if (lla_find(my_lla, key) == -1)
+        {
+            lla_insert_value(my_lla, key, (lla_value)(key * 3 + 7));
+            keys[count++] = key;
+        }
+        if (i % 3 == 2)
+        {
+            int victim = rand() % count;
+            check(lla_delete(my_lla, keys[victim]) == 1, "key_value_types", "delete of a present key failed");
+            keys[victim] = keys[--count];
+        }
+    }
+    // A batch of keys above everything else, so none of them is already present
+    int batch = n / 10;
+    for (int i = 0; i < batch; i++)
+    {
+        keys[count + i] = (lla_key)(4 * n + i) * step;
+        values[i] = (lla_value)(keys[count + i] * 3 + 7);
+    }
+    lla_insert_batch_values(my_lla, keys + count, values, batch);
+    count += batch;
+    check_structure(my_lla, count, "key_value_types");
+
+    int ok = 1;
+    for (int slot = 0; slot < my_lla->N * my_lla->C; slot++)
+    {
+        ok &= !slot_is_live(my_lla, slot) || my_lla->values[slot] == (lla_value)(my_lla->arr[slot] * 3 + 7);
+    }
+    check(ok, "key_value_types", "value separated from its key");
+    for (int i = 0; i < count; i += 101)
+    {
+        int slot = lla_find(my_lla, keys[i]);
+        check(slot >= 0 && my_lla->values[slot] == (lla_value)(keys[i] * 3 + 7), "key_value_types", "lookup returned the wrong value");
+    }
+
+    lla_iter it;
+    lla_key out[64];
+    lla_value out_values[64];
+    lla_iter_seek(my_lla, &it, -step * n);
+    size_t got = lla_iter_fill(&it, step * n, out, out_values, 64);
+    for (size_t i = 0; i < got; i++)
+    {
+        check(out_values[i] == (lla_value)(out[i] * 3 + 7) && (i == 0 || out[i - 1] < out[i]), "key_value_types", "range copy out of order or with wrong values");
+    }
+
+    free(keys);
+    free(values);
+    cleanup_lla(&my_lla);
+#endif
+}
+
+#define READERS 3
+
+typedef struct reader_args
+{
+    lla *my_lla;
+    int static_keys; // 6 * i for i < static_keys, present throughout
+    _Atomic int *done;
+    int bad;
+    long long reads;
+} reader_args;
+
+// Chunks of one lla_read_scan: in [lo, hi], non-decreasing across chunks, no static key twice
+typedef struct read_scan_log
+{
+    lla_key lo, hi, last;
+    size_t keys;
+    int statics;
+    int bad;
+} read_scan_log;
+
+static void read_scan_chunk(void *ctx, const lla_key *keys, size_t count)
+{
+    read_scan_log *log = (read_scan_log *)ctx;
+    for (size_t i = 0; i < count; i++, log->keys++)
+    {
+        log->bad += keys[i] < log->lo || keys[i] > log->hi || keys[i] % 3 != 0;
+        log->bad += log->keys && (keys[i] < log->last || (keys[i] == log->last && keys[i] % 6 == 0));
+        log->statics += keys[i] % 6 == 0;
+        log->last = keys[i];
+    }
+}
+
+// Reads under a writer that keeps inserting, deleting and resizing: each range and scan is sorted,
+// holds only keys the writer inserted and every static key in its range, and a lower bound never
+// lands past the next static key
+static void *reader_thread(void *arg)
+{
+    reader_args *args = (reader_args *)arg;
+    lla_reader *reader = lla_reader_register(args->my_lla);
+    lla_key out[512];
+    lla_value out_values[512];
+    unsigned seed = (unsigned)(size_t)arg;
+
+    args->bad = !reader;
+    while (reader && !*args->done)
+    {
+        lla_key lo = rand_r(&seed) % (6 * args->static_keys), hi = lo + rand_r(&seed) % 1200;
+        size_t count = lla_read_range(reader, lo, hi, out, LLA_HAS_VALUES ? out_values : NULL, 512);
+        int statics = 0;
+        for (size_t i = 0; i < count; i++)
+        {
+            args->bad += out[i] < lo || out[i] > hi || out[i] % 3 != 0 || (i && out[i] < out[i - 1]);
+            statics += out[i] % 6 == 0;
+#if LLA_HAS_VALUES
+            args->bad += out_values[i] != (lla_value)(out[i] * 3 + 7);
+#endif
+        }
+        lla_key last = hi < 6 * (lla_key)args->static_keys - 1 ? hi : 6 * (lla_key)args->static_keys - 1;
+        args->bad += count < 512 && statics != last / 6 - (lo + 5) / 6 + 1;
+        args->bad += !lla_read_find(reader, 6 * (rand_r(&seed) % args->static_keys), NULL);
+
+        lla_key x = rand_r(&seed) % (6 * args->static_keys - 5), key = -1;
+        lla_value value = 0;
+        args->bad += !lla_read_lower_bound(reader, x, &key, &value);
+        args->bad += key < x || key > (x + 5) / 6 * 6 || key % 3 != 0;
+#if LLA_HAS_VALUES
+        args->bad += value != (lla_value)(key * 3 + 7);
+#endif
+
+        // Small chunks so the scan resumes many times while the writer moves keys around
+        read_scan_log log = {lo, hi, 0, 0, 0, 0};
+        size_t visited = lla_read_scan(reader, lo, hi, out, 16, read_scan_chunk, &log);
+        args->bad += log.bad + (visited != log.keys) + (log.statics != last / 6 - (lo + 5) / 6 + 1);
+        args->reads++;
+    }
+    lla_reader_unregister(reader);
+    return NULL;
+}
+
+void test_concurrent_readers(void)
+{
+    const int static_keys = 20000, n = 200000;
+    lla *my_lla = create_lla(64, 8, 0.5, 0.75);
+    int *keys = malloc((static_keys + n) * sizeof(int));
+    _Atomic int done = 0;
+    reader_args args[READERS];
+    pthread_t threads[READERS];
+    int count = 0;
+
+    for (; count < static_keys; count++)
+    {
+        keys[count] = 6 * count;
+        lla_insert_value(my_lla, keys[count], (lla_value)(keys[count] * 3 + 7));
+    }
+    for (int t = 0; t < READERS; t++)
+    {
+        args[t] = (reader_args){my_lla, static_keys, &done, 0, 0};
+        pthread_create(&threads[t], NULL, reader_thread, &args[t]);
+    }
+
+    // Inserts and deletes of keys 6k + 3, with resizes up and down forced between them
+    for (int i = 0; i < n; i++)
+    {
+        keys[count] = 6 * (rand() % static_keys) + 3;
+        lla_insert_value(my_lla, keys[count], (lla_value)(keys[count] * 3 + 7));
+        count++;
+        if (i % 4 == 3)
+        {
+            int victim = static_keys + rand() % (count - static_keys);
+            lla_delete(my_lla, keys[victim]);
+            keys[victim] = keys[--count];
+        }
+        if (i % 20000 == 10000)
+        {
+            lla_resize(my_lla, my_lla->N * 2);
+        }
+        else if (i % 20000 == 19999)
+        {
+            lla_resize(my_lla, my_lla->N * 3 / 4);
+        }
+    }
+    done = 1;
+
+    int bad = 0;
+    long long reads = 0;
+    for (int t = 0; t < READERS; t++)
+    {
+        pthread_join(threads[t], NULL);
+        bad += args[t].bad;
+        reads += args[t].reads;
+    }
+    check(bad == 0, "concurrent_readers", "read a range, scan or lower bound out of order, with a foreign key or missing a present one");
+    check(reads > 0, "concurrent_readers", "readers never completed a read");
+    check_structure(my_lla, count, "concurrent_readers");
+    check_contents(my_lla, keys, count, "concurrent_readers");
+
+    free(keys);
+    cleanup_lla(&my_lla);
+}
+
+#define WRITERS 4
+
+typedef struct writer_args
+{
+    lla *my_lla;
+    int *keys;
+    int n;
+} writer_args;
+
+static void *writer_thread(void *arg)
+{
+    writer_args *args = (writer_args *)arg;
+    for (int i = 0; i < args->n; i++)
+    {
+        insert(args->my_lla, args->keys[i]);
+        // Deletes take the layout lock exclusively and resize on the way down as well
+        if (i % 50 == 49)
+        {
+            lla_delete(args->my_lla, args->keys[i]);
+            args->keys[i] = args->keys[--args->n];
+            insert(args->my_lla, args->keys[i]);
+        }
+    }
+    return NULL;
+}
+
+void test_concurrent_writers(void)
+{
+    const int per_writer = 50000;
+    lla *my_lla = create_lla(1000, 8, 0.5, 0.75);
+    int *keys = malloc(WRITERS * per_writer * sizeof(int));
+    writer_args args[WRITERS];
+    pthread_t threads[WRITERS];
+
+    for (int i = 0; i < WRITERS * per_writer; i++)
+    {
+        keys[i] = rand() % (8 * WRITERS * per_writer);
+    }
+    lla_enable_concurrent_writers(my_lla);
+    // N = 1000 is not a multiple of the lock alignment, the array grows instead of the cut moving up
+    check(my_lla->lock_depth > 0 && (my_lla->N * my_lla->C) % (64 << my_lla->lock_depth) == 0, "concurrent_writers", "locked subtrees not word aligned");
+    for (int t = 0; t < WRITERS; t++)
+    {
+        args[t] = (writer_args){my_lla, keys + t * per_writer, per_writer};
+        pthread_create(&threads[t], NULL, writer_thread, &args[t]);
+    }
+
+    int count = 0;
+    for (int t = 0; t < WRITERS; t++)
+    {
+        pthread_join(threads[t], NULL);
+        memmove(keys + count, args[t].keys, args[t].n * sizeof(int));
+        count += args[t].n;
+    }
+    check_structure(my_lla, count, "concurrent_writers");
+    check_contents(my_lla, keys, count, "concurrent_writers");
+
+    free(keys);
+    cleanup_lla(&my_lla);
+}
+
+// 1 when both llas have the same capacity and the same keys and values in the same slots
+static int same_layout(lla *a, lla *b)
+{
+    int capacity = a->N * a->C;
+    if (capacity != b->N * b->C || memcmp(a->occupied, b->occupied, (capacity + 63) / 64 * sizeof(uint64_t)))
+    {
+        return 0;
+    }
+    for (int slot = 0; slot < capacity; slot++)
+    {
+        if (slot_is_live(a, slot) && a->arr[slot] != b->arr[slot])
+        {
+            return 0;
+        }
+#if LLA_HAS_VALUES
+        if (slot_is_live(a, slot) && a->values[slot] != b->values[slot])
+        {
+            return 0;
+        }
+#endif
+    }
+    return 1;
+}
+
+// Respreads and resizes split over the worker pool leave the same layout as the sequential path
+void test_worker_pool(void)
+{
+    const int n = 60000;
+    lla *pooled = create_lla(64, 8, 0.5, 0.75);
+    lla *sequential = create_lla(64, 8, 0.5, 0.75);
+    int *keys = malloc(n * sizeof(int));
+
+    // The same inserts and deletes on both, replayed from one seed
+    unsigned seed = (unsigned)rand();
+    lla_set_workers(pooled, 4, 128);
+    srand(seed);
+    fill_random(sequential, keys, n, 5);
+    srand(seed);
+    int count = fill_random(pooled, keys, n, 5);
+    check(same_layout(pooled, sequential), "worker_pool", "pooled inserts left another layout");
+
+    // The whole array at once, with and without a new key, and resizes both ways
+    lla_value none = {0};
+    respread_range(pooled, 0, pooled->N * pooled->C - 1, 0, none, 0);
+    respread_range(sequential, 0, sequential->N * sequential->C - 1, 0, none, 0);
+    check(same_layout(pooled, sequential), "worker_pool", "pooled respread left another layout");
+    lla_resize(pooled, pooled->N * 2);
+    lla_resize(sequential, sequential->N * 2);
+    check(same_layout(pooled, sequential), "worker_pool", "pooled resize left another layout");
+    lla_resize(pooled, pooled->N * 3 / 4);
+    lla_resize(sequential, sequential->N * 3 / 4);
+    check(same_layout(pooled, sequential), "worker_pool", "pooled resize left another layout");
+    check_structure(pooled, count, "worker_pool");
+    check_contents(pooled, keys, count, "worker_pool");
+
+    lla_set_workers(pooled, 1, 0);
+    check(pooled->pool == NULL, "worker_pool", "pool still running after lla_set_workers(1)");
+    free(keys);
+    cleanup_lla(&pooled);
+    cleanup_lla(&sequential);
 }
 
 int main()
 {
     srand(time(NULL));
-    
-    // Test different sizes
-    int sizes[] = {100, 200, 500, 1000, 2000, 5000, 10000, 20000, 50000};
-    int num_sizes = sizeof(sizes) / sizeof(sizes[0]);
-    int trials_per_size = 50; // Average over multiple trials
-    
-    double *avg_times = malloc(num_sizes * sizeof(double));
-    double *log_sizes = malloc(num_sizes * sizeof(double));
-    double *log2_sizes = malloc(num_sizes * sizeof(double));
-    
-    printf("Testing insert() complexity with proper methodology...\n");
-    printf("Measuring insertion time vs structure size (averaged over %d trials each)\n\n", trials_per_size);
-    
-    for (int i = 0; i < num_sizes; i++)
-    {
-        printf("Testing size %d... ", sizes[i]);
-        fflush(stdout);
-        
-        test_complexity_at_size(sizes[i], trials_per_size, &avg_times[i], &log_sizes[i], &log2_sizes[i]);
-        
-        printf("avg time: %.2f μs\n", avg_times[i]);
-    }
-    
-    // Calculate correlation with log(n)
-    double sum_xy_log = 0, sum_x_log = 0, sum_y_log = 0, sum_x2_log = 0, sum_y2_log = 0;
-    // Calculate correlation with log²(n)
-    double sum_xy_log2 = 0, sum_x_log2 = 0, sum_y_log2 = 0, sum_x2_log2 = 0, sum_y2_log2 = 0;
-    
-    for (int i = 0; i < num_sizes; i++)
-    {
-        // For log(n) correlation
-        sum_xy_log += avg_times[i] * log_sizes[i];
-        sum_x_log += avg_times[i];
-        sum_y_log += log_sizes[i];
-        sum_x2_log += avg_times[i] * avg_times[i];
-        sum_y2_log += log_sizes[i] * log_sizes[i];
-        
-        // For log²(n) correlation
-        sum_xy_log2 += avg_times[i] * log2_sizes[i];
-        sum_x_log2 += avg_times[i];
-        sum_y_log2 += log2_sizes[i];
-        sum_x2_log2 += avg_times[i] * avg_times[i];
-        sum_y2_log2 += log2_sizes[i] * log2_sizes[i];
-    }
-    
-    double n = num_sizes;
-    double correlation_log = (n * sum_xy_log - sum_x_log * sum_y_log) /
-                             sqrt((n * sum_x2_log - sum_x_log * sum_x_log) *
-                                  (n * sum_y2_log - sum_y_log * sum_y_log));
-    
-    double correlation_log2 = (n * sum_xy_log2 - sum_x_log2 * sum_y_log2) /
-                              sqrt((n * sum_x2_log2 - sum_x_log2 * sum_x_log2) *
-                                   (n * sum_y2_log2 - sum_y_log2 * sum_y_log2));
-    
-    printf("\n=== RESULTS ===\n");
-    printf("Correlation with log(n):  %.4f\n", correlation_log);
-    printf("Correlation with log²(n): %.4f\n", correlation_log2);
-    
-    // Print detailed results
-    printf("\nSize\tlog₂(n)\tlog²₂(n)\tTime (μs)\tTime/log(n)\tTime/log²(n)\n");
-    printf("----\t-------\t--------\t---------\t-----------\t------------\n");
-    for (int i = 0; i < num_sizes; i++)
-    {
-        double ratio_log = avg_times[i] / log_sizes[i];
-        double ratio_log2 = avg_times[i] / log2_sizes[i];
-        printf("%d\t%.2f\t%.2f\t\t%.2f\t\t%.2f\t\t%.2f\n", 
-               sizes[i], log_sizes[i], log2_sizes[i], avg_times[i], ratio_log, ratio_log2);
-    }
-    
-    // Interpretation
-    printf("\nInterpretation:\n");
-    printf("LOG(N) ANALYSIS:\n");
-    if (correlation_log > 0.9)
-        printf("✓ EXCELLENT: Strong log(n) behavior (correlation > 0.9)\n");
-    else if (correlation_log > 0.7)
-        printf("✓ GOOD: Reasonable log(n) behavior (correlation > 0.7)\n");
-    else if (correlation_log > 0.5)
-        printf("⚠ MODERATE: Weak log(n) behavior (correlation > 0.5)\n");
-    else
-        printf("✗ POOR: Does not follow log(n) behavior (correlation < 0.5)\n");
-    
-    printf("\nLOG²(N) ANALYSIS:\n");
-    if (correlation_log2 > 0.9)
-        printf("✓ EXCELLENT: Strong log²(n) behavior (correlation > 0.9)\n");
-    else if (correlation_log2 > 0.7)
-        printf("✓ GOOD: Reasonable log²(n) behavior (correlation > 0.7)\n");
-    else if (correlation_log2 > 0.5)
-        printf("⚠ MODERATE: Weak log²(n) behavior (correlation > 0.5)\n");
-    else
-        printf("✗ POOR: Does not follow log²(n) behavior (correlation < 0.5)\n");
-    
-    // Compare which correlation is stronger
-    printf("\nBEST FIT:\n");
-    if (correlation_log2 > correlation_log + 0.05) {
-        printf("✓ Algorithm appears to follow O(log²(n)) complexity\n");
-    } else if (correlation_log > correlation_log2 + 0.05) {
-        printf("✓ Algorithm appears to follow O(log(n)) complexity\n");
-    } else {
-        printf("⚠ Similar correlations - complexity may be between log(n) and log²(n)\n");
-    }
-    
-    // Check if ratios are roughly constant
-    double first_ratio_log = avg_times[0] / log_sizes[0];
-    double last_ratio_log = avg_times[num_sizes-1] / log_sizes[num_sizes-1];
-    double ratio_growth_log = last_ratio_log / first_ratio_log;
-    
-    double first_ratio_log2 = avg_times[0] / log2_sizes[0];
-    double last_ratio_log2 = avg_times[num_sizes-1] / log2_sizes[num_sizes-1];
-    double ratio_growth_log2 = last_ratio_log2 / first_ratio_log2;
-    
-    printf("\nRATIO CONSISTENCY:\n");
-    printf("Time/log(n) ratio growth:  %.2fx\n", ratio_growth_log);
-    printf("Time/log²(n) ratio growth: %.2fx\n", ratio_growth_log2);
-    
-    printf("\nFor log(n): ");
-    if (ratio_growth_log < 2.0)
-        printf("✓ GOOD: Ratio stays relatively constant\n");
-    else if (ratio_growth_log < 5.0)
-        printf("⚠ MODERATE: Some growth beyond log(n)\n");
-    else
-        printf("✗ POOR: Significant growth beyond log(n)\n");
-    
-    printf("For log²(n): ");
-    if (ratio_growth_log2 < 2.0)
-        printf("✓ GOOD: Ratio stays relatively constant\n");
-    else if (ratio_growth_log2 < 5.0)
-        printf("⚠ MODERATE: Some growth beyond log²(n)\n");
-    else
-        printf("✗ POOR: Significant growth beyond log²(n)\n");
-    
-    free(avg_times);
-    free(log_sizes);
-    free(log2_sizes);
-    return 0;
-}
 
-// Alternative: Test insertion time vs number of existing elements
-void test_single_structure_growth()
-{
-    const int N = 100000;
-    const int C = 8;
-    const double TAU_0 = 0.5;
-    const double TAU_D = 0.75;
-    
-    lla *test_lla = create_lla(N, C, TAU_0, TAU_D);
-    
-    printf("\n=== SINGLE STRUCTURE GROWTH TEST ===\n");
-    printf("Measuring each insertion as structure grows...\n");
-    printf("Size\tTime (μs)\tlog₂(n)\tlog²₂(n)\tTime/log(n)\tTime/log²(n)\n");
-    printf("----\t---------\t-------\t--------\t-----------\t------------\n");
-    
-    // Measure every 1000th insertion
-    for (int i = 1; i <= 50000; i++)
-    {
-        double start_time = get_time_us();
-        insert(test_lla, rand() % (i * 10));
-        double end_time = get_time_us();
-        
-        if (i % 1000 == 0)
-        {
-            double time_taken = end_time - start_time;
-            double log_i = log2((double)i);
-            double log2_i = log_i * log_i;
-            printf("%d\t%.2f\t\t%.2f\t%.2f\t\t%.2f\t\t%.2f\n", 
-                   i, time_taken, log_i, log2_i, time_taken/log_i, time_taken/log2_i);
-        }
-    }
-    
-    cleanup_lla(&test_lla);
+    test_insert_delete();
+    test_range_scan();
+    test_policy_table();
+    test_insert_batch();
+    test_build_from_sorted();
+    test_simd_kernels();
+    test_respread_in_place();
+    test_local_shift();
+    test_predictor();
+    test_append_run();
+    test_instrumentation();
+    test_deamortized();
+    test_key_value_types();
+    test_concurrent_readers();
+    test_concurrent_writers();
+    test_persistence();
+    test_serialization();
+    test_worker_pool();
+
+    if (failures)
+    {
+        printf("%d checks failed\n", failures);
+        return 1;
+    }
+    printf("All checks passed\n");
+    return 0;
 }